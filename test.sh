@@ -24,3 +24,14 @@ run   forking         ./build/test/zcm/forking
 run   forking2        ./build/test/zcm/forking2
 run   flushing        ./build/test/zcm/flushing
 run   logging         ./build/test/zcm/logtest
+run   file-transport  ./build/test/zcm/filetest
+run   event-ring      ./build/test/zcm/ringtest
+run   channel-policy  ./build/test/zcm/policytest
+if [ -x ./build/test/zcm/zmqtest ]; then
+    run   zmq-transport   ./build/test/zcm/zmqtest
+else
+    echo "Skipping zmq-transport, zcm was built without the ipc and inproc transports"
+fi
+run   serial          ./build/test/zcm/serialtest
+run   generic-serial  ./build/test/zcm/generic_serial
+run   generic-cobs    ./build/test/zcm/generic_serial_cobs
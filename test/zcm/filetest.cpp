@@ -0,0 +1,538 @@
+// Plays small logs through the file transport, driving it directly so that what it plays
+// doesn't depend on how fast a dispatch thread keeps up
+#include "zcm/zcm-cpp.hpp"
+#include "zcm/transport_registrar.h"
+#include <assert.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define CONTROL_CHANNEL "ZCM_FILE_CONTROL"
+#define CLOCK_CHANNEL "ZCM_FILE_CLOCK"
+
+struct Event
+{
+    std::string channel;
+    int64_t utime;
+    std::string data;
+
+    bool operator==(const Event& o) const
+    { return channel == o.channel && utime == o.utime && data == o.data; }
+};
+
+static std::string dir;
+
+static std::string path(const std::string& name)
+{
+    return dir + "/" + name;
+}
+
+static void removeDir()
+{
+    DIR *d = opendir(dir.c_str());
+    if (!d) return;
+    while (struct dirent *e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name != "." && name != "..")
+            unlink(path(name).c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+static int64_t monotonicUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The data of every event is its channel and timestamp, so that a wrong one shows
+static Event makeEvent(const std::string& channel, int64_t utime)
+{
+    return Event { channel, utime, channel + "@" + std::to_string(utime) };
+}
+
+// Written with an index, so that seeking lands exactly on the first event at or after the
+// target
+static void writeLog(const std::string& name, const std::vector<Event>& events)
+{
+    zcm_eventlog_t *l = zcm_eventlog_create(path(name).c_str(), "w");
+    assert(l && "Failed to open log for writing");
+    assert(zcm_eventlog_enable_index(l, 4, 0) == 0 && "Unable to enable log index");
+    for (size_t i = 0; i < events.size(); ++i) {
+        zcm_eventlog_event_t le;
+        le.eventnum = i;
+        le.timestamp = events[i].utime;
+        le.channellen = events[i].channel.size();
+        le.channel = (char*) events[i].channel.c_str();
+        le.datalen = events[i].data.size();
+        le.data = (void*) events[i].data.data();
+        assert(zcm_eventlog_write_event(l, &le) == 0 && "Failed to write log event");
+    }
+    zcm_eventlog_destroy(l);
+}
+
+static std::vector<Event> readLog(const std::string& name)
+{
+    std::vector<Event> events;
+    zcm::LogFile lf(path(name), "r");
+    if (!lf.good()) return events;
+    while (const zcm::LogEvent *le = lf.readNextEvent())
+        events.push_back(Event { le->channel, le->timestamp,
+                                 std::string((const char*)le->data, le->datalen) });
+    return events;
+}
+
+static zcm_trans_t *makeTransport(const std::string& url)
+{
+    zcm_url_t *u = zcm_url_create(url.c_str());
+    zcm_trans_create_func *creator = zcm_transport_find(zcm_url_protocol(u));
+    assert(creator && "Failed to find the file transport");
+    zcm_trans_t *zt = creator(u);
+    zcm_url_destroy(u);
+    return zt;
+}
+
+static void send(zcm_trans_t *zt, const std::string& channel, const std::string& data,
+                 int64_t utime = 0)
+{
+    zcm_msg_t msg;
+    msg.utime = utime;
+    msg.channel = channel.c_str();
+    msg.len = data.size();
+    msg.buf = (char*) data.data();
+    assert(zcm_trans_sendmsg(zt, msg) == ZCM_EOK && "Failed to send message");
+}
+
+static void control(zcm_trans_t *zt, const std::string& cmd)
+{
+    send(zt, CONTROL_CHANNEL, cmd);
+}
+
+// Returns ZCM_EOK with the next message played, or what playback returned instead once
+// nothing was played for 'timeoutMs'
+static int next(zcm_trans_t *zt, Event& ev, int timeoutMs = 2000)
+{
+    int64_t deadline = monotonicUs() + (int64_t)timeoutMs * 1000;
+    while (true) {
+        zcm_msg_t msg;
+        int ret = zcm_trans_recvmsg(zt, &msg, 10);
+        if (ret == ZCM_EOK) {
+            ev = Event { msg.channel, (int64_t)msg.utime, std::string(msg.buf, msg.len) };
+            return ret;
+        }
+        if (ret != ZCM_EAGAIN || monotonicUs() > deadline)
+            return ret;
+    }
+}
+
+static Event nextEvent(zcm_trans_t *zt)
+{
+    Event ev;
+    assert(next(zt, ev) == ZCM_EOK && "Playback stopped early");
+    return ev;
+}
+
+static std::vector<Event> playAll(zcm_trans_t *zt)
+{
+    std::vector<Event> events;
+    Event ev;
+    int ret;
+    while ((ret = next(zt, ev)) == ZCM_EOK)
+        events.push_back(ev);
+    assert(ret == ZCM_ECONNECT && "Playback didn't reach the end");
+    return events;
+}
+
+static std::vector<Event> play(const std::string& url)
+{
+    zcm_trans_t *zt = makeTransport(url);
+    assert(zt && "Failed to create file transport");
+    std::vector<Event> events = playAll(zt);
+    zcm_trans_destroy(zt);
+    return events;
+}
+
+// One event every millisecond on channel "A", starting at 1s
+static std::vector<Event> evenLog(size_t n)
+{
+    std::vector<Event> events;
+    for (size_t i = 0; i < n; ++i)
+        events.push_back(makeEvent("A", 1000000 + i * 1000));
+    return events;
+}
+
+static void testControl()
+{
+    std::vector<Event> events = evenLog(100);
+    writeLog("control.log", events);
+    assert(play("file://" + path("control.log") + "?speed=max") == events &&
+           "Log didn't play back as written");
+
+    zcm_trans_t *zt = makeTransport("file://" + path("control.log") + "?speed=max");
+    assert(zt && "Failed to create file transport");
+    for (size_t i = 0; i < 10; ++i)
+        assert(nextEvent(zt) == events[i] && "Played the wrong event");
+
+    // Paused, only steps play, each exactly one event
+    Event ev;
+    control(zt, "PAUSE");
+    assert(next(zt, ev, 50) == ZCM_EAGAIN && "Played while paused");
+    control(zt, "STEP");
+    assert(nextEvent(zt) == events[10] && "Stepped to the wrong event");
+    assert(next(zt, ev, 50) == ZCM_EAGAIN && "Played on after a step");
+
+    // Seeking goes to the first event at or after the target, skipping from the last one
+    // played
+    control(zt, "SEEK 1050500");
+    control(zt, "STEP");
+    assert(nextEvent(zt) == events[51] && "Seeked to the wrong event");
+    control(zt, "SKIP -0.02");
+    control(zt, "STEP");
+    assert(nextEvent(zt) == events[31] && "Skipped back to the wrong event");
+    control(zt, "SKIP 0.0105");
+    control(zt, "STEP");
+    assert(nextEvent(zt) == events[42] && "Skipped ahead to the wrong event");
+
+    // A tenth of the speed spreads the events 10ms apart
+    control(zt, "SPEED 0.1");
+    control(zt, "PLAY");
+    int64_t start = monotonicUs();
+    for (size_t i = 43; i < 49; ++i)
+        assert(nextEvent(zt) == events[i] && "Played the wrong event after a speed change");
+    assert(monotonicUs() - start >= 50000 && "Played faster than the speed asked for");
+
+    control(zt, "SPEED max");
+    for (size_t i = 49; i < events.size(); ++i)
+        assert(nextEvent(zt) == events[i] && "Played the wrong event at full speed");
+    assert(next(zt, ev) == ZCM_ECONNECT && "Played past the end of the log");
+
+    // The end of the log is not the end of playback
+    control(zt, "SEEK 0");
+    assert(nextEvent(zt) == events[0] && "Failed to seek back from the end of the log");
+    zcm_trans_destroy(zt);
+}
+
+static void testSegments()
+{
+    // Rotated like zcm-logger --rotate, the oldest part has the highest number
+    std::vector<Event> events;
+    for (size_t i = 0; i < 150; ++i)
+        events.push_back(makeEvent(i % 3 ? "A" : "B", 1000000 + i * 1000));
+    for (size_t part = 0; part < 3; ++part) {
+        std::vector<Event> partEvents(events.begin() + (2 - part) * 50,
+                                      events.begin() + (3 - part) * 50);
+        writeLog("rot." + std::to_string(part), partEvents);
+    }
+
+    // Parts play in the order of their first events, whatever order they are given in
+    std::string url = "file://" + path("rot.*") + "?speed=max";
+    assert(play(url) == events && "Rotated log didn't play as one");
+    std::vector<Event> expected(events.begin(), events.begin() + 50);
+    expected.insert(expected.end(), events.begin() + 100, events.end());
+    assert(play("file://" + path("rot.0") + "," + path("rot.2") + "?speed=max") ==
+           expected && "Listed parts didn't play in order");
+    assert(play(url + "&prefetch=0") == events && "Rotated log didn't play without prefetching");
+
+    // Paths that name a file are taken as they are, other ones can escape ',', ';' and glob
+    // patterns with a backslash
+    std::vector<Event> first(events.begin(), events.begin() + 50);
+    std::vector<Event> last(events.begin() + 100, events.end());
+    writeLog("a[1],b.log", first);
+    writeLog("a1,b.log", last);
+    assert(play("file://" + path("a[1],b.log") + "?speed=max") == first &&
+           "Didn't play a log named like a glob");
+    expected = first;
+    expected.insert(expected.end(), last.begin(), last.end());
+    assert(play("file://" + path("a\\[1\\]\\,b.log") + "," + path("rot.0") + "?speed=max") ==
+           expected && "Didn't play escaped paths");
+
+    // Seeking opens the part with the target, and the part after it is opened ahead again
+    zcm_trans_t *zt = makeTransport(url);
+    assert(zt && "Failed to create file transport");
+    for (size_t i = 0; i < 60; ++i)
+        assert(nextEvent(zt) == events[i] && "Played the wrong event");
+    control(zt, "SEEK 1120500");
+    expected.assign(events.begin() + 121, events.end());
+    assert(playAll(zt) == expected && "Played the wrong events after seeking ahead");
+    control(zt, "SEEK 1049000");
+    expected.assign(events.begin() + 49, events.end());
+    assert(playAll(zt) == expected && "Played the wrong events after seeking back");
+    zcm_trans_destroy(zt);
+}
+
+static void testMerge()
+{
+    // The clock of the host that recorded b.log was 1.5ms ahead. Events are large enough
+    // that the readers don't keep their buffers around once released
+    std::string padding(100 << 10, 'x');
+    std::vector<Event> a, b, expected;
+    for (size_t i = 0; i < 50; ++i) {
+        a.push_back(makeEvent("A", 1000000 + i * 2000));
+        a.back().data += padding;
+        b.push_back(makeEvent("B", 1002500 + i * 2000));
+        b.back().data += padding;
+        expected.push_back(a.back());
+        expected.push_back(b.back());
+        expected.back().utime -= 1500;
+    }
+    writeLog("a.log", a);
+    writeLog("b.log", b);
+
+    std::string url = "file://" + path("a.log") + ";" + path("b.log") + "?speed=max";
+    assert(play(url + "&offsets=0,-1500") == expected &&
+           "Merged logs didn't play in the order of their shifted timestamps");
+    assert(!makeTransport(url + "&offsets=0,x") && "Accepted invalid offsets");
+
+    zcm_trans_t *zt = makeTransport(url + "&offsets=0,-1500");
+    assert(zt && "Failed to create file transport");
+    control(zt, "SEEK 1041000");
+    for (size_t i = 41; i < 60; ++i)
+        assert(nextEvent(zt) == expected[i] && "Played the wrong event after seeking");
+
+    // Subscribing changes what the logs read while the next event of each is waiting to
+    // be merged. Those still play as they were read, and after them only the channel
+    // subscribed to
+    assert(zcm_trans_recvmsg_enable(zt, "B", true) == ZCM_EOK && "Failed to subscribe");
+    std::vector<Event> played = playAll(zt);
+    std::vector<Event> onlyB;
+    for (size_t i = 60; i < expected.size(); ++i)
+        if (expected[i].channel == "B" || (i == 60 && played[0] == expected[i]))
+            onlyB.push_back(expected[i]);
+    assert(played == onlyB && "Played the wrong events after subscribing");
+    zcm_trans_destroy(zt);
+}
+
+// Sent 'pauseUs' apart, which leaves the transport time to open the next part of a split log
+static std::vector<Event> record(const std::string& url, const std::vector<Event>& events,
+                                 int pauseUs = 0)
+{
+    zcm_trans_t *zt = makeTransport(url);
+    assert(zt && "Failed to create file transport for writing");
+    for (auto& ev : events) {
+        send(zt, ev.channel, ev.data, ev.utime);
+        if (pauseUs) usleep(pauseUs);
+    }
+    zcm_trans_destroy(zt);
+    return events;
+}
+
+// The events of the parts 'name'.NN numbered from 'first' on, one part after the other
+static std::vector<std::vector<Event>> readParts(const std::string& name, int first = 0)
+{
+    std::vector<std::vector<Event>> parts;
+    for (int i = first; ; ++i) {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), ".%02d", i);
+        if (access(path(name + suffix).c_str(), F_OK) != 0) break;
+        parts.push_back(readLog(name + suffix));
+    }
+    return parts;
+}
+
+// Every part but the last is finished at the first event written once it holds 'splitEvents'
+// events or more. The next part is opened in the background and writing only moves on to it
+// once it is open, so a part may hold more
+static void checkParts(const std::vector<std::vector<Event>>& parts,
+                       const std::vector<Event>& events, size_t splitEvents)
+{
+    std::vector<Event> all;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        assert((i + 1 == parts.size() || parts[i].size() >= splitEvents) &&
+               "Split before a part was full");
+        assert(!parts[i].empty() && "Left an empty part");
+        all.insert(all.end(), parts[i].begin(), parts[i].end());
+    }
+    assert(all == events && "Split log doesn't hold the events written");
+}
+
+static void testWrite()
+{
+    std::vector<Event> events;
+    for (size_t i = 0; i < 40; ++i) {
+        events.push_back(makeEvent(i % 2 ? "A" : "B", 1000000 + i * 1000));
+        events.back().data += std::string(10000, 'x');
+    }
+
+    // Events are flushed in the background, so readers see them before the log is closed
+    zcm_trans_t *zt = makeTransport("file://" + path("w.log") + "?mode=w");
+    assert(zt && "Failed to create file transport for writing");
+    for (auto& ev : events)
+        send(zt, ev.channel, ev.data, ev.utime);
+    for (int i = 0; i < 200 && readLog("w.log").size() < events.size(); ++i)
+        usleep(10000);
+    assert(readLog("w.log") == events && "Written events didn't show up before closing");
+    zcm_trans_destroy(zt);
+    assert(readLog("w.log") == events && "Log doesn't hold the events written");
+
+    std::vector<Event> appended = events;
+    appended.insert(appended.end(), events.begin(), events.begin() + 5);
+    record("file://" + path("w.log") + "?mode=a",
+           std::vector<Event>(events.begin(), events.begin() + 5));
+    assert(readLog("w.log") == appended && "Appending didn't keep the log written before");
+
+    // A part is finished once it holds 0.1MB, 11 of these events
+    record("file://" + path("s") + "?mode=w&split-mb=0.1", events, 2000);
+    std::vector<std::vector<Event>> parts = readParts("s");
+    assert(parts.size() > 1 && "Didn't split");
+    checkParts(parts, events, 11);
+
+    // Splitting again doesn't overwrite the parts already there
+    record("file://" + path("s") + "?mode=w&split-mb=0.1", events, 2000);
+    std::vector<std::vector<Event>> all = readParts("s");
+    assert(all.size() > parts.size() && "Didn't add parts to an earlier recording");
+    assert(std::equal(parts.begin(), parts.end(), all.begin()) &&
+           "Splitting overwrote an earlier recording");
+    checkParts(readParts("s", parts.size()), events, 11);
+
+    // Rotating keeps only the newest parts, and no hidden part opened ahead
+    record("file://" + path("r") + "?mode=w&split-mb=0.1&rotate=2", events, 2000);
+    std::vector<Event> kept = readLog("r.1");
+    std::vector<Event> newest = readLog("r.0");
+    assert(newest.size() > 0 && newest.size() < events.size() && "Didn't rotate");
+    kept.insert(kept.end(), newest.begin(), newest.end());
+    assert(kept.size() < events.size() &&
+           kept == std::vector<Event>(events.end() - kept.size(), events.end()) &&
+           "Rotated log doesn't hold the newest events");
+    assert(access(path("r.2").c_str(), F_OK) != 0 && "Kept too many rotated parts");
+    assert(access(path(".r.0.next").c_str(), F_OK) != 0 && "Left the part opened ahead");
+
+#ifdef USING_ZLIB
+    record("file://" + path("c") + "?mode=w&split-mb=0.1&compress=1", events, 2000);
+    checkParts(readParts("c"), events, 11);
+    assert(play("file://" + path("c.*") + "?speed=max") == events &&
+           "Compressed split log didn't play back as written");
+#endif
+
+    assert(!makeTransport("file://" + path("x") + "?mode=w&rotate=2") &&
+           "Rotated without splitting");
+    assert(!makeTransport("file://" + path("w.log") + "?compress=1") &&
+           "Compressed while reading");
+}
+
+static std::vector<Event> only(const std::vector<Event>& events,
+                               bool (*wanted)(const Event& ev))
+{
+    std::vector<Event> out;
+    for (auto& ev : events)
+        if (wanted(ev)) out.push_back(ev);
+    return out;
+}
+
+static void testSelection()
+{
+    // Three channels for three seconds, starting at 5s
+    std::vector<Event> events;
+    const char *channels[] = { "A", "B", "CAM_L" };
+    for (size_t i = 0; i < 300; ++i)
+        events.push_back(makeEvent(channels[i % 3], 5000000 + i * 10000));
+    writeLog("sel.log", events);
+    std::string url = "file://" + path("sel.log") + "?speed=max";
+
+    auto isCam = [](const Event& ev) { return ev.channel == "CAM_L"; };
+    auto notCam = [](const Event& ev) { return ev.channel != "CAM_L"; };
+    auto notB = [](const Event& ev) { return ev.channel != "B"; };
+    assert(play(url + "&channel=CAM.*") == only(events, isCam) &&
+           "Played the wrong channels");
+    assert(play(url + "&channel=CAM.*&invert") == only(events, notCam) &&
+           "Played the wrong channels when inverted");
+    assert(play(url + "&channel=CAM").empty() && "Matched part of a channel name");
+    assert(play(url + "&channel=A%7CCAM_L") == only(events, notB) &&
+           "Played the wrong channels for an escaped regex");
+    assert(!makeTransport(url + "&channel=(") && "Accepted an invalid regex");
+
+    // Reading a log takes the same regexes
+    zcm::LogFile lf(path("sel.log"), "r");
+    assert(lf.setChannelRegex("A|CAM_L") == 0 && "Unable to filter log");
+    std::vector<Event> read;
+    while (const zcm::LogEvent *le = lf.readNextEvent())
+        read.push_back(Event { le->channel, le->timestamp,
+                               std::string((const char*)le->data, le->datalen) });
+    assert(read == only(events, notB) && "Read the wrong channels");
+    assert(lf.setChannelRegex("(") != 0 && "Accepted an invalid regex");
+
+    // The window is in seconds from the first event, both ends included
+    std::vector<Event> window(events.begin() + 100, events.begin() + 201);
+    assert(play(url + "&start=1&end=2") == window && "Played the wrong window");
+    assert(play(url + "&start=1&end=2&channel=CAM.*") == only(window, isCam) &&
+           "Played the wrong channels of a window");
+    assert(play(url + "&start=2.995") ==
+           std::vector<Event>(events.begin() + 300, events.end()) &&
+           "Played events before the start");
+    assert(play(url + "&start=4").empty() && "Played after the end of the log");
+}
+
+// Expects the tick announcing 'ev' and acknowledges it 'acks' times
+static void tick(zcm_trans_t *zt, const Event& ev, int acks = 1)
+{
+    Event t = nextEvent(zt);
+    assert(t.channel == CLOCK_CHANNEL && t.utime == ev.utime &&
+           t.data == std::to_string(ev.utime) && "Expected a tick announcing the event");
+    for (int i = 0; i < acks; ++i)
+        control(zt, "ACK " + t.data);
+}
+
+static void testLockstep()
+{
+    std::vector<Event> events = evenLog(20);
+    writeLog("lockstep.log", events);
+
+    // Lockstep doesn't wait for the timestamps, however slow the speed
+    std::string url = "file://" + path("lockstep.log") + "?speed=0.001&lockstep";
+    zcm_trans_t *zt = makeTransport(url);
+    assert(zt && "Failed to create file transport");
+    Event ev;
+    for (size_t i = 0; i < events.size(); ++i) {
+        tick(zt, events[i]);
+        assert(nextEvent(zt) == events[i] && "Played the wrong event after its tick");
+    }
+    assert(next(zt, ev) == ZCM_ECONNECT && "Played past the end of the log");
+
+    // Nothing plays until the tick was acknowledged, late acknowledgments don't count
+    control(zt, "SEEK 1005000");
+    Event t = nextEvent(zt);
+    assert(t.channel == CLOCK_CHANNEL && t.utime == events[5].utime &&
+           "Expected a tick after seeking");
+    control(zt, "ACK " + std::to_string(events[19].utime));
+    assert(next(zt, ev, 50) == ZCM_EAGAIN && "Played without an acknowledgment");
+    control(zt, "ACK " + t.data);
+    assert(nextEvent(zt) == events[5] && "Played the wrong event after its tick");
+    zcm_trans_destroy(zt);
+
+    // Each tick needs as many acknowledgments as asked for
+    zt = makeTransport("file://" + path("lockstep.log") + "?lockstep=2");
+    assert(zt && "Failed to create file transport");
+    tick(zt, events[0], 1);
+    assert(next(zt, ev, 50) == ZCM_EAGAIN && "Played after one of two acknowledgments");
+    control(zt, "ACK " + std::to_string(events[0].utime));
+    assert(nextEvent(zt) == events[0] && "Played the wrong event after its tick");
+    tick(zt, events[1], 2);
+    assert(nextEvent(zt) == events[1] && "Played the wrong event after its tick");
+    zcm_trans_destroy(zt);
+
+    assert(!makeTransport("file://" + path("lockstep.log") + "?lockstep=0") &&
+           "Accepted lockstep without acknowledgments");
+}
+
+int main(int argc, const char *argv[])
+{
+    char tmpl[] = "/tmp/zcm-filetest-XXXXXX";
+    assert(mkdtemp(tmpl) && "Failed to create a directory for the logs");
+    dir = tmpl;
+
+    testControl();
+    testSegments();
+    testMerge();
+    testWrite();
+    testSelection();
+    testLockstep();
+
+    removeDir();
+    return 0;
+}
@@ -0,0 +1,148 @@
+// Built once with escape framing and once with ZCM_GENERIC_SERIAL_COBS, see wscript
+#include "zcm/transport/generic_serial_transport.h"
+#include "serial_frames.hpp"
+#include <assert.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+#ifdef ZCM_GENERIC_SERIAL_COBS
+static const bool COBS = true;
+#else
+static const bool COBS = false;
+#endif
+
+typedef std::pair<std::string, std::string> Msg;
+
+static uint64_t timestampNow(void *usr)
+{ return ++*(uint64_t*)usr; }
+
+static std::vector<Msg> testMessages()
+{
+    std::vector<Msg> msgs;
+    msgs.emplace_back("EMPTY", "");
+    msgs.emplace_back("CH\xcc\xcc", std::string(17, '\xcc'));
+    msgs.emplace_back("ZEROS", std::string(ZCM_GENERIC_SERIAL_MTU, '\0'));
+    // COBS blocks end after 254 non-zero bytes, check the runs around that
+    for (size_t run : { 253, 254, 255, 300, 508 }) {
+        if (run + 4 > ZCM_GENERIC_SERIAL_MTU) continue;
+        std::string data(run, '\x5a');
+        data += '\0';
+        data += std::string(3, '\x01');
+        msgs.emplace_back("RUN" + std::to_string(run), data);
+    }
+    std::string mixed;
+    for (int i = 0; i < ZCM_GENERIC_SERIAL_MTU; ++i)
+        mixed += (char)((i % 7 == 0) ? 0 : (i % 5 == 0) ? 0xcc : (i * 31) & 0xff);
+    msgs.emplace_back("MIXED", mixed);
+    return msgs;
+}
+
+static int send(zcm_trans_t *zt, const Msg& m)
+{
+    zcm_msg_t msg;
+    msg.utime = 0;
+    msg.channel = m.first.c_str();
+    msg.len = m.second.size();
+    msg.buf = (char*)m.second.data();
+    return zcm_trans_sendmsg(zt, msg);
+}
+
+// Takes everything the transport encoded out of its send buffer
+static std::string drainTx(zcm_trans_t *zt)
+{
+    std::string out;
+    const uint8_t *data;
+    uint32_t n;
+    while ((n = zcm_trans_generic_serial_tx_region(zt, &data)) > 0) {
+        out.append((const char*)data, n);
+        zcm_trans_generic_serial_tx_consume(zt, n);
+    }
+    return out;
+}
+
+static void recvAll(zcm_trans_t *zt, std::vector<Msg>& out)
+{
+    zcm_msg_t msg;
+    while (zcm_trans_recvmsg(zt, &msg, 0) == ZCM_EOK)
+        out.emplace_back(msg.channel, std::string(msg.buf, msg.len));
+}
+
+// Hands 'bytes' to the transport in odd sized chunks, so that frames wrap around the end of
+// its receive buffer and arrive in pieces, receiving messages as they complete
+static std::vector<Msg> feed(zcm_trans_t *zt, const std::string& bytes)
+{
+    std::vector<Msg> out;
+    size_t off = 0;
+    while (off < bytes.size()) {
+        uint8_t *data;
+        uint32_t n = zcm_trans_generic_serial_rx_region(zt, &data);
+        assert(n > 0 && "Receive buffer filled up");
+        if (n > 37) n = 37;
+        if (n > bytes.size() - off) n = bytes.size() - off;
+        memcpy(data, bytes.data() + off, n);
+        zcm_trans_generic_serial_rx_commit(zt, n);
+        off += n;
+        recvAll(zt, out);
+    }
+    recvAll(zt, out);
+    return out;
+}
+
+int main(int argc, const char *argv[])
+{
+    uint64_t now = 0;
+    zcm_trans_t *zt = zcm_trans_generic_serial_create(NULL, NULL, NULL, timestampNow, &now);
+    assert(zt && "Failed to create generic serial transport");
+
+    std::vector<Msg> msgs = testMessages();
+
+    // Frames on the wire are exactly the documented ones, and decode back to the messages
+    for (size_t rep = 0; rep < 20; ++rep) {
+        for (auto& m : msgs) {
+            assert(send(zt, m) == ZCM_EOK && "Failed to send message");
+            std::string wire = drainTx(zt);
+            assert(wire == serial_frames::frame(COBS, m.first, m.second) &&
+                   "Encoded frame doesn't match the wire format");
+            std::vector<Msg> got = feed(zt, wire);
+            assert(got.size() == 1 && got[0] == m && "Message didn't survive a round trip");
+        }
+    }
+
+    Msg tooLong("LONG", std::string(ZCM_GENERIC_SERIAL_MTU + 1, 'x'));
+    assert(send(zt, tooLong) == ZCM_EINVALID && "Sending a message over the MTU didn't fail");
+
+    // Frames after a damaged one are still received
+    Msg a("A", "first"), b("B", "corrupted"), c("C", "third"), d("D", "truncated frame"),
+        e("E", "fifth"), f("F", "after garbage");
+    std::string corrupted = serial_frames::frame(COBS, b.first, b.second);
+    corrupted[corrupted.size() - 5] ^= 0x20;
+    std::string truncated = serial_frames::frame(COBS, d.first, d.second);
+    truncated.resize(truncated.size() / 2);
+
+    std::string stream;
+    stream += serial_frames::frame(COBS, a.first, a.second);
+    stream += corrupted;
+    stream += serial_frames::frame(COBS, c.first, c.second);
+    stream += truncated;
+    stream += serial_frames::frame(COBS, e.first, e.second);
+    stream += std::string("\x01\x02\xcc\x00\x7f\x00", 6);
+    stream += serial_frames::frame(COBS, f.first, f.second);
+
+    std::vector<Msg> got = feed(zt, stream);
+    std::vector<Msg> expected { a, c, e, f };
+    // Without escapes, the start of a truncated frame runs into the next one, up to its
+    // delimiter, and both are lost
+    if (COBS) expected = { a, c, f };
+    assert(got == expected && "Didn't resynchronize on the frames after damaged ones");
+
+    // A truncated frame at the end of the stream doesn't hold up the frames that follow it
+    got = feed(zt, truncated);
+    assert(got.empty() && "Received a truncated frame");
+    got = feed(zt, std::string(1, '\0') + serial_frames::frame(COBS, a.first, a.second));
+    assert(got.size() == 1 && got[0] == a && "Didn't resynchronize after a truncated frame");
+
+    zcm_trans_destroy(zt);
+    return 0;
+}
@@ -2,8 +2,44 @@
 #include <assert.h>
 #include <string.h>
 #include <string>
+#include <vector>
 #include <iostream>
 
+static int onlyChannelTwo(const char *channel, int32_t channellen, void *usr)
+{
+    ++*(int*)usr;
+    return strcmp(channel, "CHANNEL_TWO") == 0;
+}
+
+struct ScanResults
+{
+    std::vector<std::vector<int64_t>> shards;
+    std::vector<int64_t> merged;
+};
+
+static int scanEvent(int shard, const zcm_eventlog_event_t *le, void *usr)
+{
+    ((ScanResults*)usr)->shards[shard].push_back(le->eventnum);
+    return 0;
+}
+
+static void mergeShard(int shard, void *usr)
+{
+    ScanResults *res = (ScanResults*)usr;
+    res->merged.insert(res->merged.end(), res->shards[shard].begin(), res->shards[shard].end());
+}
+
+static void checkScan(const char *path, int64_t nevents)
+{
+    ScanResults res;
+    res.shards.resize(7);
+    assert(zcm_eventlog_scan_parallel(path, 7, 3, scanEvent, mergeShard, &res) == 0 &&
+           "Failed to scan log in parallel");
+    assert(res.merged.size() == (size_t)nevents && "Parallel scan missed events");
+    for (int64_t i = 0; i < nevents; ++i)
+        assert(res.merged[i] == i && "Parallel scan merged events out of order");
+}
+
 int main(int argc, const char *argv[])
 {
     std::string testChannel = "chan";
@@ -18,6 +54,7 @@ int main(int argc, const char *argv[])
 
     zcm_eventlog_t *l = zcm_eventlog_create("testlog.log", "w");
     assert(l && "Failed to open log for writing");
+    assert(zcm_eventlog_enable_index(l, 10, 0) == 0 && "Unable to enable log index");
     for (size_t i = 0; i < 100; ++i) {
         assert(zcm_eventlog_write_event(l, &event) == 0 && "Unable to write log event to log");
         event.eventnum++;
@@ -89,7 +126,308 @@ int main(int argc, const char *argv[])
            "Incorrect data inside of offset event");
     zcm_eventlog_free_event(le);
 
+    // Zero-copy views must see the same events
+    fseeko(zcm_eventlog_get_fileptr(l), 0, SEEK_SET);
+    zcm_eventlog_event_t view;
+    for (size_t i = 0; i < 100; ++i) {
+        assert(zcm_eventlog_read_next_event_view(l, &view) == 0 &&
+               "Failed to read next log event view out of log");
+        assert(view.eventnum == (int64_t)i && "Incorrect eventnum inside of event view");
+        assert(view.timestamp == (int64_t)i + 1 && "Incorrect timestamp inside of event view");
+        assert(view.channellen == event.channellen && "Incorrect channellen inside of event view");
+        assert(strncmp(view.channel, testChannel.c_str(), view.channellen) == 0 &&
+               "Incorrect channel inside of event view");
+        assert(view.datalen == event.datalen && "Incorrect datalen inside of event view");
+        assert(memcmp(view.data, testData.c_str(), view.datalen) == 0 &&
+               "Incorrect data inside of event view");
+    }
+    assert(zcm_eventlog_read_next_event_view(l, &view) != 0 &&
+           "Requesting event view after last event didn't fail");
+
+    zcm_eventlog_destroy(l);
+
+    // Seeks must be exact, both with the index and without it
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            int ret = system("rm testlog.log" ZCM_EVENTLOG_INDEX_SUFFIX);
+            (void) ret;
+        }
+        l = zcm_eventlog_create("testlog.log", "r");
+        assert(l && "Failed to read in log");
+        for (int64_t i = 0; i < 100; i += 7) {
+            assert(zcm_eventlog_seek_to_eventnum(l, i) == 0 && "Failed to seek to eventnum");
+            assert(zcm_eventlog_read_next_event_view(l, &view) == 0 &&
+                   "Failed to read event after seeking to eventnum");
+            assert(view.eventnum == i && "Incorrect event after seeking to eventnum");
+            if (pass == 0) {
+                assert(zcm_eventlog_seek_to_timestamp(l, i + 1) == 0 &&
+                       "Failed to seek to timestamp");
+                assert(zcm_eventlog_read_next_event_view(l, &view) == 0 &&
+                       "Failed to read event after seeking to timestamp");
+                assert(view.timestamp == i + 1 && "Incorrect event after seeking to timestamp");
+            }
+        }
+        assert(zcm_eventlog_seek_to_eventnum(l, 100) != 0 &&
+               "Seeking past the last event didn't fail");
+        zcm_eventlog_destroy(l);
+    }
+
+    // Batched writes through a background writer must read back the same
+    l = zcm_eventlog_create("testlog.log", "w");
+    assert(l && "Failed to open log for writing");
+    assert(zcm_eventlog_set_write_buffer(l, 1024, ZCM_EVENTLOG_WRITE_ASYNC) == 0 &&
+           "Unable to set log write buffer");
+    std::vector<zcm_eventlog_event_t> batch(100, event);
+    for (size_t i = 0; i < batch.size(); ++i)
+        batch[i].timestamp = i + 1;
+    assert(zcm_eventlog_write_events(l, batch.data(), batch.size()) == batch.size() &&
+           "Unable to write batch of events");
+    zcm_eventlog_destroy(l);
+
+    l = zcm_eventlog_create("testlog.log", "r");
+    assert(l && "Failed to read in log");
+    for (size_t i = 0; i < batch.size(); ++i) {
+        assert(zcm_eventlog_read_next_event_view(l, &view) == 0 &&
+               "Failed to read next batched event");
+        assert(view.eventnum == (int64_t)i && "Incorrect eventnum inside of batched event");
+        assert(view.timestamp == (int64_t)i + 1 && "Incorrect timestamp inside of batched event");
+        assert(memcmp(view.data, testData.c_str(), view.datalen) == 0 &&
+               "Incorrect data inside of batched event");
+    }
+    assert(zcm_eventlog_read_next_event_view(l, &view) != 0 &&
+           "Requesting batched event after last event didn't fail");
+    zcm_eventlog_destroy(l);
+
+    // Version 2 logs must read back the same, forwards, backwards and after seeking
+    const char *v2Channels[] = { "chan", "CHANNEL_TWO", "c3" };
+    l = zcm_eventlog_create("testlog.log", "w");
+    assert(l && "Failed to open log for writing");
+    assert(zcm_eventlog_set_format(l, ZCM_EVENTLOG_FORMAT_V2) == 0 && "Unable to set log format");
+    assert(zcm_eventlog_enable_index(l, 10, 0) == 0 && "Unable to enable v2 log index");
+    for (size_t i = 0; i < 100; ++i) {
+        event.timestamp  = i + 1;
+        event.channel    = (char*) v2Channels[i % 3];
+        event.channellen = strlen(v2Channels[i % 3]);
+        event.datalen    = i % (testData.length() + 1);
+        assert(zcm_eventlog_write_event(l, &event) == 0 && "Unable to write v2 event");
+    }
+    zcm_eventlog_destroy(l);
+    checkScan("testlog.log", 100);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            int ret = system("rm testlog.log" ZCM_EVENTLOG_INDEX_SUFFIX);
+            (void) ret;
+        }
+        l = zcm_eventlog_create("testlog.log", "r");
+        assert(l && "Failed to read in v2 log");
+        for (int64_t i = 0; i < 100; ++i) {
+            assert(zcm_eventlog_read_next_event_view(l, &view) == 0 &&
+                   "Failed to read next v2 event");
+            assert(view.eventnum == i && "Incorrect eventnum inside of v2 event");
+            assert(view.timestamp == i + 1 && "Incorrect timestamp inside of v2 event");
+            assert(view.channellen == (int32_t)strlen(v2Channels[i % 3]) &&
+                   strncmp(view.channel, v2Channels[i % 3], view.channellen) == 0 &&
+                   "Incorrect channel inside of v2 event");
+            assert(view.datalen == (int32_t)(i % (testData.length() + 1)) &&
+                   memcmp(view.data, testData.c_str(), view.datalen) == 0 &&
+                   "Incorrect data inside of v2 event");
+        }
+        assert(zcm_eventlog_read_next_event_view(l, &view) != 0 &&
+               "Requesting v2 event after last event didn't fail");
+        for (int64_t i = 99; i >= 0; --i) {
+            assert(zcm_eventlog_read_prev_event_view(l, &view) == 0 &&
+                   view.eventnum == i && "Failed to read prev v2 event");
+        }
+        for (int64_t i = 99; i >= 0; i -= 7) {
+            assert(zcm_eventlog_seek_to_eventnum(l, i) == 0 && "Failed to seek v2 log");
+            assert(zcm_eventlog_read_next_event_view(l, &view) == 0 && view.eventnum == i &&
+                   strncmp(view.channel, v2Channels[i % 3], view.channellen) == 0 &&
+                   "Incorrect v2 event after seeking to eventnum");
+        }
+
+        // Filtered reads only return the channels matching, in both directions
+        assert(zcm_eventlog_set_channel_regex(l, "c.*") == 0 && "Unable to filter v2 log");
+        assert(zcm_eventlog_seek_to_eventnum(l, 0) == 0 && "Failed to seek v2 log");
+        for (int64_t i = 0; i < 100; ++i) {
+            if (i % 3 == 1) continue;
+            assert(zcm_eventlog_read_next_event_view(l, &view) == 0 && view.eventnum == i &&
+                   "Failed to read next filtered v2 event");
+        }
+        assert(zcm_eventlog_read_next_event_view(l, &view) != 0 &&
+               "Requesting filtered v2 event after last event didn't fail");
+        for (int64_t i = 99; i >= 0; --i) {
+            if (i % 3 == 1) continue;
+            assert(zcm_eventlog_read_prev_event_view(l, &view) == 0 && view.eventnum == i &&
+                   "Failed to read prev filtered v2 event");
+        }
+        zcm_eventlog_destroy(l);
+    }
+
+    l = zcm_eventlog_create("testlog.log", "w");
+    assert(l && "Failed to open log for writing");
+    for (size_t i = 0; i < 100; ++i) {
+        event.timestamp  = i + 1;
+        event.channel    = (char*) v2Channels[i % 3];
+        event.channellen = strlen(v2Channels[i % 3]);
+        assert(zcm_eventlog_write_event(l, &event) == 0 && "Unable to write log event to log");
+    }
+    zcm_eventlog_destroy(l);
+
+    int filterCalls = 0;
+    l = zcm_eventlog_create("testlog.log", "r");
+    assert(l && "Failed to read in log");
+    assert(zcm_eventlog_set_channel_filter(l, onlyChannelTwo, &filterCalls) == 0 &&
+           "Unable to filter log");
+    for (int64_t i = 1; i < 100; i += 3) {
+        assert(zcm_eventlog_read_next_event_view(l, &view) == 0 && view.eventnum == i &&
+               strncmp(view.channel, "CHANNEL_TWO", view.channellen) == 0 &&
+               "Failed to read next filtered event");
+    }
+    assert(zcm_eventlog_read_next_event_view(l, &view) != 0 &&
+           "Requesting filtered event after last event didn't fail");
+    assert(filterCalls == 3 && "Channel filter wasn't asked once per channel");
+    assert(zcm_eventlog_set_channel_filter(l, NULL, NULL) == 0 && "Unable to remove filter");
+    assert(zcm_eventlog_read_prev_event_view(l, &view) == 0 && view.eventnum == 99 &&
+           "Failed to read prev event after removing filter");
+    zcm_eventlog_destroy(l);
+
+    // Prefetched reads must return the same, and other reads must pick up after the last
+    // event returned
+    l = zcm_eventlog_create("testlog.log", "r");
+    assert(l && "Failed to read in log");
+    assert(zcm_eventlog_enable_prefetch(l, 4, 64) == 0 && "Unable to prefetch log");
+    for (int64_t i = 0; i < 10; ++i) {
+        assert(zcm_eventlog_read_next_event_view(l, &view) == 0 && view.eventnum == i &&
+               strncmp(view.channel, v2Channels[i % 3], view.channellen) == 0 &&
+               "Failed to read next prefetched event");
+    }
+    assert(zcm_eventlog_read_prev_event_view(l, &view) == 0 && view.eventnum == 9 &&
+           "Failed to read prev event after prefetching");
+    assert(zcm_eventlog_read_next_event_view(l, &view) == 0 && view.eventnum == 9 &&
+           "Failed to read next prefetched event after reading backwards");
+    assert(zcm_eventlog_seek_to_eventnum(l, 50) == 0 && "Failed to seek prefetched log");
+    assert(zcm_eventlog_set_channel_filter(l, onlyChannelTwo, &filterCalls) == 0 &&
+           "Unable to filter prefetched log");
+    for (int64_t i = 52; i < 100; i += 3) {
+        assert(zcm_eventlog_read_next_event_view(l, &view) == 0 && view.eventnum == i &&
+               "Failed to read next filtered prefetched event");
+    }
+    assert(zcm_eventlog_read_next_event_view(l, &view) != 0 &&
+           "Requesting prefetched event after last event didn't fail");
+    zcm_eventlog_destroy(l);
+
+    // Changing the filter keeps the event returned last, even one too big for its slot to
+    // be kept around once released
+    std::string bigData(256 << 10, 'b');
+    l = zcm_eventlog_create("testlog.log", "w");
+    assert(l && "Failed to open log for writing");
+    for (size_t i = 0; i < 4; ++i) {
+        event.channel    = (char*) v2Channels[i % 3];
+        event.channellen = strlen(v2Channels[i % 3]);
+        event.data       = (void*) bigData.c_str();
+        event.datalen    = bigData.length();
+        assert(zcm_eventlog_write_event(l, &event) == 0 && "Unable to write log event to log");
+    }
+    zcm_eventlog_destroy(l);
+    l = zcm_eventlog_create("testlog.log", "r");
+    assert(l && "Failed to read in log");
+    assert(zcm_eventlog_enable_prefetch(l, 4, 1 << 20) == 0 && "Unable to prefetch log");
+    assert(zcm_eventlog_read_next_event_view(l, &view) == 0 && view.eventnum == 0 &&
+           "Failed to read next prefetched event");
+    assert(zcm_eventlog_set_channel_filter(l, onlyChannelTwo, &filterCalls) == 0 &&
+           "Unable to filter prefetched log");
+    assert(view.datalen == (int32_t) bigData.length() &&
+           memcmp(view.data, bigData.c_str(), view.datalen) == 0 &&
+           "Prefetched event changed when filtering");
+    assert(zcm_eventlog_read_next_event_view(l, &view) == 0 && view.eventnum == 1 &&
+           "Failed to read next filtered prefetched event");
+    assert(zcm_eventlog_read_next_event_view(l, &view) != 0 &&
+           "Requesting prefetched event after last event didn't fail");
+    zcm_eventlog_destroy(l);
+
+    // Parallel scans must see every event once, even when data looks like the magic
+    const uint8_t magicData[] = { 0xED, 0xA1, 0xDA, 0x01, 0, 0, 0, 0, 0, 0, 0, 1 };
+    l = zcm_eventlog_create("testlog.log", "w");
+    assert(l && "Failed to open log for writing");
+    for (size_t i = 0; i < 1000; ++i) {
+        event.data    = (void*) magicData;
+        event.datalen = i % sizeof(magicData);
+        assert(zcm_eventlog_write_event(l, &event) == 0 && "Unable to write log event to log");
+    }
+    zcm_eventlog_destroy(l);
+    checkScan("testlog.log", 1000);
+    event.data = (void*) testData.c_str();
+    event.channel    = (char*) testChannel.c_str();
+    event.channellen = testChannel.length();
+    event.datalen    = testData.length();
+
+#ifdef USING_ZLIB
+    // Compressed logs must read back the same, across many small blocks
+    l = zcm_eventlog_create("testlog.log", "w");
+    assert(l && "Failed to open log for writing");
+    assert(zcm_eventlog_enable_compression(l, -1, 256, 2) == 0 &&
+           "Unable to enable log compression");
+    event.eventnum = 0;
+    event.timestamp = 1;
+    for (size_t i = 0; i < 100; ++i) {
+        assert(zcm_eventlog_write_event(l, &event) == 0 && "Unable to write compressed event");
+        event.timestamp++;
+    }
+    zcm_eventlog_destroy(l);
+
+    l = zcm_eventlog_create("testlog.log", "r");
+    assert(l && "Failed to read in compressed log");
+    for (size_t i = 0; i < 100; ++i) {
+        assert(zcm_eventlog_read_next_event_view(l, &view) == 0 &&
+               "Failed to read next compressed event");
+        assert(view.eventnum == (int64_t)i && "Incorrect eventnum inside of compressed event");
+        assert(view.timestamp == (int64_t)i + 1 &&
+               "Incorrect timestamp inside of compressed event");
+        assert(view.datalen == event.datalen && "Incorrect datalen inside of compressed event");
+        assert(memcmp(view.data, testData.c_str(), view.datalen) == 0 &&
+               "Incorrect data inside of compressed event");
+    }
+    assert(zcm_eventlog_read_next_event_view(l, &view) != 0 &&
+           "Requesting compressed event after last event didn't fail");
+    for (int64_t i = 99; i >= 0; i -= 7) {
+        assert(zcm_eventlog_seek_to_timestamp(l, i + 1) == 0 &&
+               "Failed to seek compressed log to timestamp");
+        assert(zcm_eventlog_read_prev_event_view(l, &view) == (i == 0 ? -1 : 0) &&
+               "Failed to read event before seeking compressed log");
+        assert((i == 0 || view.eventnum == i - 1) && "Incorrect event before seek");
+    }
+    zcm_eventlog_destroy(l);
+    checkScan("testlog.log", 100);
+
+    // A reader tailing a compressed log it opened before any block was written must still
+    // start on the first block. Compressed inline with every event filling a block, so that
+    // each one reaches the file when flushed
+    l = zcm_eventlog_create("testlog.log", "w");
+    assert(l && "Failed to open log for writing");
+    assert(zcm_eventlog_enable_compression(l, -1, 1, 0) == 0 &&
+           "Unable to enable log compression");
+    assert(zcm_eventlog_flush(l) == 0 && "Failed to flush empty compressed log");
+    zcm_eventlog_t *tail = zcm_eventlog_create("testlog.log", "r");
+    assert(tail && "Failed to open empty compressed log for reading");
+    assert(zcm_eventlog_read_next_event_view(tail, &view) != 0 &&
+           "Read an event from an empty compressed log");
+    event.eventnum = 0;
+    for (size_t i = 0; i < 10; ++i) {
+        event.timestamp = i + 1;
+        assert(zcm_eventlog_write_event(l, &event) == 0 && "Unable to write compressed event");
+    }
+    assert(zcm_eventlog_flush(l) == 0 && "Failed to flush compressed log");
+    for (size_t i = 0; i < 10; ++i) {
+        assert(zcm_eventlog_read_next_event_view(tail, &view) == 0 &&
+               "Failed to read next event while tailing compressed log");
+        assert(view.eventnum == (int64_t)i && "Incorrect eventnum while tailing compressed log");
+    }
+    assert(zcm_eventlog_read_next_event_view(tail, &view) != 0 &&
+           "Read past the end of a compressed log being tailed");
+    zcm_eventlog_destroy(tail);
     zcm_eventlog_destroy(l);
+#endif
 
     int ret = system("rm testlog.log");
     (void) ret;
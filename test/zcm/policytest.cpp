@@ -0,0 +1,170 @@
+// Checks what of a channel zcm-logger keeps under its per channel rules, and what it drops
+// when the receive ring fills up
+#include "tools/cpp/logger/ChannelPolicy.hpp"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+static void testDecimate()
+{
+    ChannelPolicy p;
+    p.keepEvery = 3;
+    for (int i = 0; i < 9; ++i)
+        assert(p.admit(i) == (i % 3 == 0) && "Didn't keep every 3rd message");
+
+    ChannelPolicy all;
+    for (int i = 0; i < 5; ++i)
+        assert(all.admit(0) && "Dropped a message without any rule");
+}
+
+static void testMaxRate()
+{
+    // 10 Hz
+    ChannelPolicy p;
+    p.minPeriod = 100000;
+    assert(p.admit(1000000) && "Dropped the first message");
+    assert(!p.admit(1050000) && "Kept a message before the period was up");
+    assert(p.admit(1100000) && "Dropped a message once the period was up");
+
+    // A message a little late still lets the next one be due a period after the one before
+    assert(p.admit(1230000) && "Dropped a late message");
+    assert(p.admit(1300000) && "Late message pushed the next one back");
+    assert(!p.admit(1399999) && "Kept a message before the period was up");
+
+    // After a gap longer than the period, messages are kept from the next one on
+    assert(p.admit(2000000) && "Dropped a message after a gap");
+    assert(!p.admit(2000001) && "Gap let a burst through");
+    assert(p.admit(2100000) && "Dropped a message once the period was up");
+
+    // Decimation applies first, to every message received
+    ChannelPolicy both;
+    both.keepEvery = 2;
+    both.minPeriod = 100000;
+    assert(both.admit(0) && "Dropped the first message");
+    assert(!both.admit(30000) && "Kept a decimated message");
+    assert(!both.admit(60000) && "Kept a message before the period was up");
+    assert(!both.admit(90000) && "Kept a decimated message");
+    assert(both.admit(120000) && "Dropped a message once the period was up");
+}
+
+static void testRules()
+{
+    ChannelPolicies policies;
+    double fill;
+    assert(policies.admit("ANY", 0, fill) && fill == 1.0 && "No rules limited a channel");
+    assert(policies.policies.empty() && "Resolved a policy without any rules");
+
+    policies.addDecimate("CAM.*", 2);
+    policies.addDecimate("CAMERA", 5);   // Only the first matching rule applies
+    policies.addMaxRate("IMU", 100);
+    policies.addPriority("DEBUG.*", PRIORITY_LOW);
+    assert(policies.maxFill[PRIORITY_NORMAL] == 1.0 &&
+           "Normal priority limited without high priority channels");
+    policies.addPriority("CTRL", PRIORITY_HIGH);
+
+    ChannelPolicy& cam = policies.policyFor("CAMERA");
+    assert(cam.keepEvery == 2 && cam.minPeriod == 0 && cam.priority == PRIORITY_NORMAL &&
+           "Incorrect policy for CAMERA");
+    assert(&policies.policyFor("CAMERA") == &cam && "Policy resolved more than once");
+    ChannelPolicy& imu = policies.policyFor("IMU");
+    assert(imu.keepEvery == 1 && imu.minPeriod == 10000 && "Incorrect policy for IMU");
+    assert(policies.policyFor("IMU2").minPeriod == 0 && "Rule matched part of a channel");
+
+    assert(policies.admit("DEBUG_X", 0, fill) && fill == LOW_PRIORITY_MAX_FILL &&
+           "Incorrect fill for a low priority channel");
+    assert(policies.admit("OTHER", 0, fill) && fill == NORMAL_PRIORITY_MAX_FILL &&
+           "Normal priority didn't leave room for high priority channels");
+    assert(policies.admit("CTRL", 0, fill) && fill == 1.0 &&
+           "Incorrect fill for a high priority channel");
+
+    assert(policies.admit("CAM0", 0, fill) && "Dropped the first message");
+    assert(!policies.admit("CAM0", 1, fill) && "Kept a decimated message");
+    assert(policies.admit("CAM1", 2, fill) && "Channels share a decimation count");
+}
+
+// Pushes a message the way the logger's receive thread does, counting it if it's dropped
+static EventRing::PushResult receive(ChannelPolicies& policies, EventRing& ring,
+                                     DropCounts& drops, const char *channel, i64 utime)
+{
+    double fill;
+    if (!policies.admit(channel, utime, fill)) {
+        drops.decimated++;
+        return EventRing::PUSHED;
+    }
+    static const char data[8 * 7] = {0};
+    EventRing::PushResult res = ring.push(utime, channel, strlen(channel),
+                                          data, sizeof(data), fill);
+    if (res != EventRing::PUSHED)
+        drops.count(res, channel);
+    return res;
+}
+
+static void testShed()
+{
+    ChannelPolicies policies;
+    policies.addPriority("LOW", PRIORITY_LOW);
+    policies.addPriority("HIGH", PRIORITY_HIGH);
+    policies.addDecimate("NOISE", 2);
+    DropCounts drops;
+
+    // Low priority channels get half of the queue, normal ones 9 tenths of it rounded down
+    EventRing queue(32, 1 << 20);
+    for (int i = 0; i < 16; ++i)
+        assert(receive(policies, queue, drops, "LOW", i) == EventRing::PUSHED &&
+               "Failed to push");
+    assert(receive(policies, queue, drops, "LOW", 16) == EventRing::SHED &&
+           "Low priority channel took more than half the queue");
+    for (int i = 16; i < 28; ++i)
+        assert(receive(policies, queue, drops, "NORMAL", i) == EventRing::PUSHED &&
+               "Failed to push");
+    assert(receive(policies, queue, drops, "NORMAL", 28) == EventRing::SHED &&
+           "Normal priority channel took the room of high priority ones");
+    for (int i = 28; i < 32; ++i)
+        assert(receive(policies, queue, drops, "HIGH", i) == EventRing::PUSHED &&
+               "High priority channel couldn't use the whole queue");
+    assert(receive(policies, queue, drops, "HIGH", 32) == EventRing::QUEUE_FULL &&
+           "Pushed to a full queue");
+    assert(receive(policies, queue, drops, "LOW", 32) == EventRing::QUEUE_FULL &&
+           "Shed a message the queue had no room for anyway");
+
+    // The same for memory, 8 units an event out of 80
+    EventRing arena(64, 80 * 8);
+    for (int i = 0; i < 5; ++i)
+        assert(receive(policies, arena, drops, "LOW", i) == EventRing::PUSHED &&
+               "Failed to push");
+    assert(receive(policies, arena, drops, "LOW", 5) == EventRing::SHED &&
+           "Low priority channel took more than half the memory");
+    assert(receive(policies, arena, drops, "NORMAL", 5) == EventRing::PUSHED &&
+           receive(policies, arena, drops, "NORMAL", 6) == EventRing::PUSHED &&
+           receive(policies, arena, drops, "NORMAL", 7) == EventRing::PUSHED &&
+           receive(policies, arena, drops, "NORMAL", 8) == EventRing::PUSHED &&
+           "Failed to push");
+    assert(receive(policies, arena, drops, "NORMAL", 9) == EventRing::SHED &&
+           "Normal priority channel took the memory of high priority ones");
+    assert(receive(policies, arena, drops, "HIGH", 9) == EventRing::PUSHED &&
+           "High priority channel couldn't use the whole memory");
+    assert(receive(policies, arena, drops, "HIGH", 10) == EventRing::ARENA_FULL &&
+           "Pushed to a full arena");
+
+    // Decimated messages aren't drops
+    assert(receive(policies, arena, drops, "NOISE", 0) == EventRing::ARENA_FULL &&
+           "Pushed to a full arena");
+    receive(policies, arena, drops, "NOISE", 1);
+
+    assert(drops.shed == 4 && drops.full == 2 && drops.memory == 2 && drops.decimated == 1 &&
+           "Incorrect drop counts");
+    assert(drops.total() == 8 && "Incorrect total drops");
+    assert(drops.byChannel.size() == 4 && drops.byChannel["LOW"] == 3 &&
+           drops.byChannel["NORMAL"] == 2 && drops.byChannel["HIGH"] == 2 &&
+           drops.byChannel["NOISE"] == 1 && "Incorrect drops by channel");
+}
+
+int main(int argc, const char *argv[])
+{
+    testDecimate();
+    testMaxRate();
+    testRules();
+    testShed();
+    return 0;
+}
@@ -0,0 +1,148 @@
+// Pushes events through zcm-logger's EventRing from several threads at once, and fills it up
+#include "tools/cpp/logger/EventRing.hpp"
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define PRODUCERS 4
+#define EVENTS_PER_PRODUCER 100000
+
+// Every event of a producer has its own length, from empty to a few hundred bytes, so that
+// events of all sizes wrap around the arena
+static int32_t eventLength(int producer, uint32_t seq)
+{
+    uint32_t x = (seq + 1) * 2654435761u ^ (producer * 40503u);
+    return (x >> 7) % 301;
+}
+
+static uint8_t eventByte(int producer, uint32_t seq, int32_t i)
+{
+    return (uint8_t)(producer * 31 + seq * 7 + i);
+}
+
+static std::string channelOf(int producer)
+{
+    // Channel names of different lengths move the data by different amounts
+    return "P" + std::string(producer, 'x');
+}
+
+// Consumes in place, so what a push copied in must be intact until it is released
+static void checkEvent(const zcm_eventlog_event_t& le, std::vector<uint32_t>& nextSeq)
+{
+    int producer = le.channellen - 1;
+    assert(producer >= 0 && producer < PRODUCERS && "Event on an unknown channel");
+    assert(std::string(le.channel) == channelOf(producer) && "Incorrect channel");
+    assert((uintptr_t)le.data % 8 == 0 && "Data isn't 8 byte aligned");
+
+    uint32_t seq = (uint32_t)le.timestamp;
+    assert(seq == nextSeq[producer] && "Events of a producer out of order");
+    nextSeq[producer]++;
+
+    assert(le.datalen == eventLength(producer, seq) && "Incorrect data length");
+    const uint8_t *data = (const uint8_t*) le.data;
+    for (int32_t i = 0; i < le.datalen; ++i)
+        assert(data[i] == eventByte(producer, seq, i) && "Incorrect data");
+}
+
+static void produce(EventRing *ring, int producer)
+{
+    std::string channel = channelOf(producer);
+    std::vector<uint8_t> data;
+    for (uint32_t seq = 0; seq < EVENTS_PER_PRODUCER; ++seq) {
+        data.resize(eventLength(producer, seq));
+        for (size_t i = 0; i < data.size(); ++i)
+            data[i] = eventByte(producer, seq, i);
+        // A full ring is emptied by the consumer, push again until it takes the event
+        while (ring->push(seq, channel.c_str(), channel.size(), data.data(), data.size()) !=
+               EventRing::PUSHED)
+            std::this_thread::yield();
+    }
+}
+
+static void testConcurrent()
+{
+    // Small enough that the producers keep filling the queue and the arena, and the arena
+    // wraps around thousands of times
+    EventRing ring(64, 8 << 10);
+    assert(ring.good() && "Failed to allocate ring");
+
+    std::vector<std::thread> producers;
+    for (int i = 0; i < PRODUCERS; ++i)
+        producers.emplace_back(produce, &ring, i);
+
+    std::vector<uint32_t> nextSeq(PRODUCERS, 0);
+    size_t total = 0;
+    zcm_eventlog_event_t batch[16];
+    while (total < PRODUCERS * EVENTS_PER_PRODUCER) {
+        assert(ring.arenaUsed() <= ring.arenaCapacity() && "Used more than the arena");
+        size_t n = ring.peek(batch, 16);
+        for (size_t i = 0; i < n; ++i)
+            checkEvent(batch[i], nextSeq);
+        ring.release();
+        total += n;
+        if (n == 0) std::this_thread::yield();
+    }
+
+    for (auto& t : producers)
+        t.join();
+    assert(ring.peek(batch, 16) == 0 && "Got more events than were pushed");
+    assert(ring.depth() == 0 && ring.arenaUsed() == 0 && "Ring isn't empty at the end");
+}
+
+// Events of 'units' 8 byte units of the arena, one of them for the channel
+static EventRing::PushResult pushUnits(EventRing& ring, int64_t utime, size_t units)
+{
+    static const char data[256] = {0};
+    return ring.push(utime, "A", 1, data, (units - 1) * 8);
+}
+
+static void testFull()
+{
+    zcm_eventlog_event_t batch[16];
+
+    // The queue fills up before the arena
+    EventRing queue(4, 1 << 20);
+    for (int i = 0; i < 4; ++i)
+        assert(pushUnits(queue, i, 2) == EventRing::PUSHED && "Failed to push");
+    assert(pushUnits(queue, 4, 2) == EventRing::QUEUE_FULL && "Pushed to a full queue");
+    assert(queue.depth() == 4 && "Incorrect depth");
+    assert(queue.peek(batch, 1) == 1 && batch[0].timestamp == 0 && "Peeked the wrong event");
+    queue.release();
+    assert(pushUnits(queue, 4, 2) == EventRing::PUSHED && "Released slot wasn't reused");
+    assert(pushUnits(queue, 5, 2) == EventRing::QUEUE_FULL && "Pushed to a full queue");
+
+    // The arena fills up before the queue
+    EventRing arena(16, 10 * 8);
+    assert(pushUnits(arena, 0, 11) == EventRing::ARENA_FULL && "Pushed more than the arena");
+    assert(pushUnits(arena, 0, 4) == EventRing::PUSHED && "Failed to push");
+    assert(pushUnits(arena, 1, 4) == EventRing::PUSHED && "Failed to push");
+    assert(pushUnits(arena, 2, 3) == EventRing::ARENA_FULL && "Pushed to a full arena");
+    assert(arena.arenaUsed() == 8 * 8 && "Incorrect arena use");
+
+    // An event that doesn't fit before the end of the arena skips the rest of it and starts
+    // at the front, once the oldest event released it
+    assert(pushUnits(arena, 2, 4) == EventRing::ARENA_FULL && "Overwrote an event");
+    assert(arena.peek(batch, 1) == 1 && batch[0].timestamp == 0 && "Peeked the wrong event");
+    arena.release();
+    assert(pushUnits(arena, 2, 4) == EventRing::PUSHED && "Failed to wrap around");
+    assert(arena.arenaUsed() == 10 * 8 && "Skipped end of the arena isn't counted as used");
+    assert(pushUnits(arena, 3, 1) == EventRing::ARENA_FULL && "Pushed to a full arena");
+    assert(arena.peek(batch, 16) == 2 && batch[0].timestamp == 1 && batch[1].timestamp == 2 &&
+           "Peeked the wrong events after wrapping around");
+    assert((char*)batch[1].data == (char*)batch[0].data - 4 * 8 &&
+           "Didn't wrap to the front of the arena");
+    arena.release();
+    assert(arena.arenaUsed() == 0 && arena.depth() == 0 && "Ring isn't empty");
+    assert(pushUnits(arena, 3, 10) == EventRing::PUSHED && "Failed to fill the whole arena");
+}
+
+int main(int argc, const char *argv[])
+{
+    testFull();
+    testConcurrent();
+    return 0;
+}
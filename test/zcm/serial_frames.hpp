@@ -0,0 +1,72 @@
+#pragma once
+
+// Reference encoding of serial transport frames, written from the wire format described in
+// zcm/transport/transport_serial.cpp, for checking both serial transports against
+
+#include <cstdint>
+#include <string>
+
+namespace serial_frames {
+
+static uint16_t crc16(const std::string& bytes)
+{
+    uint16_t crc = 0xffff;
+    for (unsigned char c : bytes) {
+        crc ^= (uint16_t)c << 8;
+        for (int i = 0; i < 8; ++i)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+// chan_len, data_len (4 bytes, big endian), channel, data, crc16 of all that (big endian)
+static std::string contents(const std::string& channel, const std::string& data)
+{
+    std::string out;
+    out += (char)channel.size();
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out += (char)((data.size() >> shift) & 0xff);
+    out += channel;
+    out += data;
+    uint16_t crc = crc16(out);
+    out += (char)(crc >> 8);
+    out += (char)(crc & 0xff);
+    return out;
+}
+
+static std::string escapeFrame(const std::string& channel, const std::string& data)
+{
+    std::string out("\xcc\x00", 2);
+    for (char c : contents(channel, data)) {
+        out += c;
+        if ((unsigned char)c == 0xcc) out += c;
+    }
+    return out;
+}
+
+static std::string cobsFrame(const std::string& channel, const std::string& data)
+{
+    std::string in = contents(channel, data);
+    std::string out;
+    size_t codeIdx = 0;
+    out += '\0';
+    for (char c : in) {
+        if (c != 0) {
+            out += c;
+            if (out.size() - codeIdx < 0xff) continue;
+        }
+        out[codeIdx] = (char)(out.size() - codeIdx);
+        codeIdx = out.size();
+        out += '\0';
+    }
+    out[codeIdx] = (char)(out.size() - codeIdx);
+    out += '\0';
+    return out;
+}
+
+static std::string frame(bool cobs, const std::string& channel, const std::string& data)
+{
+    return cobs ? cobsFrame(channel, data) : escapeFrame(channel, data);
+}
+
+}
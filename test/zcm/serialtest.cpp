@@ -0,0 +1,152 @@
+#include "zcm/zcm-cpp.hpp"
+#include "serial_frames.hpp"
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <utility>
+
+typedef std::pair<std::string, std::string> Msg;
+
+struct Received
+{
+    std::mutex lock;
+    std::vector<Msg> msgs;
+};
+
+static void handler(const zcm::ReceiveBuffer *rbuf, const std::string& channel, void *usr)
+{
+    Received *r = (Received*)usr;
+    std::unique_lock<std::mutex> lk(r->lock);
+    r->msgs.emplace_back(channel, std::string(rbuf->data, rbuf->data_size));
+}
+
+static std::vector<Msg> waitFor(Received& r, size_t n)
+{
+    for (int i = 0; i < 200; ++i) {
+        {
+            std::unique_lock<std::mutex> lk(r.lock);
+            if (r.msgs.size() >= n) break;
+        }
+        usleep(10000);
+    }
+    usleep(50000); // Long enough for anything unexpected to show up too
+    std::unique_lock<std::mutex> lk(r.lock);
+    std::vector<Msg> ret;
+    ret.swap(r.msgs);
+    return ret;
+}
+
+static void writeAll(int fd, const std::string& bytes)
+{
+    size_t off = 0;
+    while (off < bytes.size()) {
+        ssize_t n = write(fd, bytes.data() + off, bytes.size() - off);
+        assert(n > 0 && "Failed to write to the pty");
+        off += n;
+    }
+}
+
+static std::string readAtLeast(int fd, size_t n)
+{
+    std::string out;
+    char buf[4096];
+    while (out.size() < n) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        assert(poll(&p, 1, 2000) == 1 && "Timed out reading from the pty");
+        ssize_t r = read(fd, buf, sizeof(buf));
+        assert(r > 0 && "Failed to read from the pty");
+        out.append(buf, r);
+    }
+    return out;
+}
+
+// Runs the serial transport on one end of a pty, with this test speaking the wire format on
+// the other end
+static void testFraming(bool cobs)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    assert(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0 &&
+           "Failed to open a pty");
+    struct termios t;
+    tcgetattr(master, &t);
+    cfmakeraw(&t);
+    tcsetattr(master, TCSANOW, &t);
+
+    std::string url = std::string("serial://") + ptsname(master) + "?baud=115200&framing=" +
+                      (cobs ? "cobs" : "escape");
+    zcm::ZCM zcmLocal(url);
+    assert(zcmLocal.good() && "Failed to create the serial transport");
+
+    Received received;
+    zcmLocal.subscribe(".*", handler, &received);
+    zcmLocal.start();
+
+    std::vector<Msg> msgs;
+    msgs.emplace_back("EMPTY", "");
+    msgs.emplace_back("CH\xcc\xcc", std::string(17, '\xcc'));
+    msgs.emplace_back("ZEROS", std::string(1000, '\0'));
+    for (size_t run : { 253, 254, 255, 508 }) {
+        std::string data(run, '\x5a');
+        data += '\0';
+        msgs.emplace_back("RUN" + std::to_string(run), data);
+    }
+
+    // What is sent is exactly the documented frame
+    for (auto& m : msgs) {
+        assert(zcmLocal.publish(m.first, m.second.data(), m.second.size()) == ZCM_EOK &&
+               "Failed to publish");
+        zcmLocal.flush();
+        std::string expected = serial_frames::frame(cobs, m.first, m.second);
+        assert(readAtLeast(master, expected.size()) == expected &&
+               "Published frame doesn't match the wire format");
+    }
+
+    // Documented frames are received
+    std::string stream;
+    for (auto& m : msgs)
+        stream += serial_frames::frame(cobs, m.first, m.second);
+    writeAll(master, stream);
+    assert(waitFor(received, msgs.size()) == msgs && "Failed to receive frames");
+
+    // Frames after damaged ones are still received
+    Msg a("A", "first"), b("B", "corrupted"), c("C", "third"), d("D", "truncated frame"),
+        e("E", "fifth"), f("F", "after garbage");
+    std::string corrupted = serial_frames::frame(cobs, b.first, b.second);
+    corrupted[corrupted.size() - 5] ^= 0x20;
+    std::string truncated = serial_frames::frame(cobs, d.first, d.second);
+    truncated.resize(truncated.size() / 2);
+
+    stream = serial_frames::frame(cobs, a.first, a.second);
+    stream += corrupted;
+    stream += serial_frames::frame(cobs, c.first, c.second);
+    stream += truncated;
+    stream += serial_frames::frame(cobs, e.first, e.second);
+    stream += std::string("\x01\x02\xcc\x00\x7f\x00", 6);
+    stream += serial_frames::frame(cobs, f.first, f.second);
+    writeAll(master, stream);
+
+    std::vector<Msg> expected { a, c, e, f };
+    // Without escapes, the start of a truncated frame runs into the next one, up to its
+    // delimiter, and both are lost
+    if (cobs) expected = { a, c, f };
+    assert(waitFor(received, expected.size()) == expected &&
+           "Didn't resynchronize on the frames after damaged ones");
+
+    zcmLocal.stop();
+    close(master);
+}
+
+int main(int argc, const char *argv[])
+{
+#ifdef USING_TRANS_SERIAL
+    testFraming(false);
+    testFraming(true);
+#endif
+    return 0;
+}
@@ -0,0 +1,245 @@
+// Checks the url options of the ipc and inproc transports, their socket counters and
+// multiple publishers per channel
+#include "zcm/transport.h"
+#include "zcm/transport_registrar.h"
+#include "zcm/url.h"
+#include "zcm/transport/zmq_sockopts.hpp"
+#include "util/TimeUtil.hpp"
+#include <assert.h>
+#include <dirent.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Per-publisher endpoints are "/tmp/" MPUB_NAME_PREFIX "<pid>-<instance>-<channel>"
+#define MPUB_NAME_PREFIX "zcm-mpub-zmq-ipc-"
+
+using Options = std::unordered_map<std::string, std::string>;
+
+static zcm_trans_t *makeTransport(const char *url)
+{
+    zcm_url_t *u = zcm_url_create(url);
+    zcm_trans_create_func *creator = zcm_transport_find(zcm_url_protocol(u));
+    assert(creator && "Transport isn't registered");
+    zcm_trans_t *trans = creator(u);
+    zcm_url_destroy(u);
+    return trans;
+}
+
+static void testParse()
+{
+    SockOpts dflt;
+    assert(dflt.parse(Options{}, true) && "Failed to parse no options");
+    assert(dflt.ioThreads == DEFAULT_IO_THREADS && dflt.sndhwm == -1 && dflt.rcvhwm == -1 &&
+           dflt.sndbuf == -1 && dflt.rcvbuf == -1 && dflt.linger == -1 && !dflt.multipub &&
+           dflt.statsMs == 0 && "Incorrect defaults");
+
+    SockOpts o;
+    assert(o.parse(Options{ {"io_threads", "4"}, {"sndhwm", "10000"}, {"rcvhwm", "0"},
+                            {"sndbuf", "4194304"}, {"rcvbuf", "1048576"}, {"linger", "0"},
+                            {"multipub", "true"}, {"stats_ms", "500"},
+                            {"unknown", "ignored"} }, true) &&
+           "Failed to parse valid options");
+    assert(o.ioThreads == 4 && o.sndhwm == 10000 && o.rcvhwm == 0 && o.sndbuf == 4194304 &&
+           o.rcvbuf == 1048576 && o.linger == 0 && o.multipub && o.statsMs == 500 &&
+           "Incorrect option values");
+
+    SockOpts b;
+    assert(b.parse(Options{ {"multipub", "1"} }, true) && b.multipub && "Failed to parse 1");
+    assert(b.parse(Options{ {"multipub", "false"} }, true) && !b.multipub &&
+           "Failed to parse false");
+    assert(b.parse(Options{ {"multipub", "0"} }, true) && !b.multipub && "Failed to parse 0");
+
+    // Only ipc has per-publisher endpoints
+    SockOpts inproc;
+    assert(inproc.parse(Options{ {"multipub", "true"} }, false) && !inproc.multipub &&
+           "Enabled multipub on inproc");
+
+    const char *bad[][2] = {
+        { "io_threads", "0" },  { "io_threads", "two" },
+        { "sndhwm", "-1" },     { "sndhwm", "" },       { "sndhwm", "10k" },
+        { "rcvhwm", "-5" },     { "rcvhwm", "1.5" },
+        { "sndbuf", "-1" },     { "sndbuf", "4294967296" },
+        { "rcvbuf", "x" },      { "rcvbuf", " " },
+        { "linger", "-1" },     { "linger", "1s" },
+        { "stats_ms", "-1" },   { "stats_ms", "fast" },
+        { "multipub", "yes" },  { "multipub", "" },     { "multipub", "TRUE" },
+    };
+    for (auto& opt : bad) {
+        SockOpts s;
+        assert(!s.parse(Options{ {opt[0], opt[1]} }, true) && "Accepted an invalid option");
+    }
+}
+
+static void testMultiPubName()
+{
+    pid_t pid;
+    std::string channel;
+    assert(parseMultiPubName("123-0-FOO", pid, channel) && pid == 123 && channel == "FOO" &&
+           "Failed to parse an endpoint name");
+    assert(parseMultiPubName("7-12-A-B-C", pid, channel) && pid == 7 && channel == "A-B-C" &&
+           "Failed to parse a channel with dashes");
+
+    const char *bad[] = { "", "FOO", "123", "123-", "123-0", "123-0-", "-1-0-FOO",
+                          "0-0-FOO", "abc-0-FOO", "123-x-FOO", "123--FOO" };
+    for (const char *name : bad)
+        assert(!parseMultiPubName(name, pid, channel) && "Parsed a malformed endpoint name");
+}
+
+static void testCreate()
+{
+    const char *good[] = {
+        "ipc", "inproc",
+        "ipc?io_threads=2&sndhwm=10000&rcvhwm=10000&sndbuf=65536&rcvbuf=65536&linger=0",
+        "ipc?multipub=true&stats_ms=1000",
+        "inproc?multipub=true",
+    };
+    for (const char *url : good) {
+        zcm_trans_t *trans = makeTransport(url);
+        assert(trans && "Failed to create the transport with valid options");
+        zcm_trans_destroy(trans);
+    }
+
+    const char *bad[] = {
+        "ipc?io_threads=0", "ipc?sndhwm=-1", "ipc?rcvhwm=abc", "ipc?sndbuf=",
+        "ipc?rcvbuf=1x", "ipc?linger=-2", "ipc?multipub=maybe", "ipc?stats_ms=-1",
+        "inproc?sndhwm=-1",
+    };
+    for (const char *url : bad)
+        assert(!makeTransport(url) && "Created the transport with an invalid option");
+}
+
+static void sendString(zcm_trans_t *trans, const char *channel, const std::string& s)
+{
+    zcm_msg_t msg;
+    msg.utime = TimeUtil::utime();
+    msg.channel = channel;
+    msg.len = s.size();
+    msg.buf = (char*) s.data();
+    assert(zcm_trans_sendmsg(trans, msg) == ZCM_EOK && "Failed to send");
+}
+
+// Counts the per-publisher endpoints of 'channel'
+static int countEndpoints(const std::string& channel)
+{
+    DIR *d = opendir("/tmp/");
+    assert(d && "Failed to open /tmp");
+    std::string suffix = "-" + channel;
+    int n = 0;
+    dirent *ent;
+    while ((ent = readdir(d)) != nullptr) {
+        std::string name = ent->d_name;
+        if (name.compare(0, strlen(MPUB_NAME_PREFIX), MPUB_NAME_PREFIX) == 0 &&
+            name.size() > suffix.size() &&
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+            n++;
+    }
+    closedir(d);
+    return n;
+}
+
+// A child process and this one publish on the same channel, each to its own endpoint
+static void testMultiPub()
+{
+    std::string channel = "ZMQTEST_MPUB_" + std::to_string(getpid());
+
+    // The child publishes until the parent closes the pipe
+    int fds[2];
+    assert(pipe(fds) == 0 && "Failed to create a pipe");
+    pid_t child = fork();
+    assert(child >= 0 && "Failed to fork");
+    if (child == 0) {
+        close(fds[1]);
+        zcm_trans_t *pub = makeTransport("ipc?multipub=true&linger=0");
+        if (!pub) _exit(1);
+        pollfd p = { fds[0], POLLIN, 0 };
+        while (poll(&p, 1, 1) == 0)
+            sendString(pub, channel.c_str(), "child");
+        zcm_trans_destroy(pub);
+        _exit(0);
+    }
+    close(fds[0]);
+
+    zcm_trans_t *pub = makeTransport("ipc?multipub=true&linger=0");
+    zcm_trans_t *sub = makeTransport("ipc?multipub=true&linger=0");
+    assert(pub && sub && "Failed to create the transports");
+    assert(zcm_trans_recvmsg_enable(sub, channel.c_str(), true) == ZCM_EOK &&
+           "Failed to subscribe");
+
+    // The subscriber finds the publishers' endpoints when it next scans for them, and
+    // messages sent before it connected are lost
+    std::unordered_set<std::string> received;
+    u64 deadline = TimeUtil::utime() + 5000000;
+    while (received.size() < 2 && TimeUtil::utime() < deadline) {
+        sendString(pub, channel.c_str(), "parent");
+        zcm_msg_t msg;
+        if (zcm_trans_recvmsg(sub, &msg, 10) == ZCM_EOK) {
+            assert(channel == msg.channel && "Received on the wrong channel");
+            received.emplace(msg.buf, msg.len);
+        }
+    }
+    assert(countEndpoints(channel) == 2 && "Publishers don't have their own endpoints");
+
+    close(fds[1]);
+    int status;
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0 && "Child publisher failed");
+    assert(received.size() == 2 && received.count("parent") && received.count("child") &&
+           "Didn't receive from both publishers");
+
+    zcm_trans_destroy(sub);
+    zcm_trans_destroy(pub);
+    assert(countEndpoints(channel) == 0 && "Publishers left their endpoints behind");
+}
+
+// With 'stats_ms', every socket's counters are printed to stderr once per period
+static void testStats()
+{
+    std::string channel = "ZMQTEST_STATS";
+    FILE *out = tmpfile();
+    assert(out && "Failed to create a temporary file");
+    fflush(stderr);
+    int savedStderr = dup(2);
+    dup2(fileno(out), 2);
+
+    zcm_trans_t *pub = makeTransport("ipc?stats_ms=1&linger=0");
+    assert(pub && "Failed to create the transport");
+    // Messages without a subscriber are sent all the same
+    for (int i = 0; i < 3; ++i) {
+        sendString(pub, channel.c_str(), "stats");
+        usleep(2000);
+    }
+    zcm_trans_destroy(pub);
+
+    fflush(stderr);
+    dup2(savedStderr, 2);
+    close(savedStderr);
+
+    std::string report;
+    char buf[256];
+    rewind(out);
+    while (fgets(buf, sizeof(buf), out))
+        report += buf;
+    fclose(out);
+
+    for (int i = 1; i <= 3; ++i) {
+        std::string line = "zmq pubsock " + channel + ": " + std::to_string(i) +
+                           " sent, 0 dropped\n";
+        assert(report.find(line) != std::string::npos && "Didn't report the socket counters");
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    testParse();
+    testMultiPubName();
+    testCreate();
+    testMultiPub();
+    testStats();
+    return 0;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "util/Types.hpp"
+
+#include "EventRing.hpp"
+
+// Priority classes of channels, which decide which ones are dropped first when messages
+// arrive faster than they can be written
+enum Priority { PRIORITY_LOW, PRIORITY_NORMAL, PRIORITY_HIGH, NUM_PRIORITIES };
+
+// How full the receive queue and memory may get before messages of low priority channels,
+// and of normal priority ones once any channel has high priority, are dropped
+#define LOW_PRIORITY_MAX_FILL    0.5
+#define NORMAL_PRIORITY_MAX_FILL 0.9
+
+// What is logged of a channel, resolved from the per channel rules on its first message
+struct ChannelPolicy
+{
+    u64      keepEvery = 1;
+    i64      minPeriod = 0;
+    Priority priority  = PRIORITY_NORMAL;
+
+    u64      received  = 0;
+    i64      nextDue   = INT64_MIN;
+
+    // Whether to log the message received at 'utime' rather than decimate it
+    bool admit(i64 utime)
+    {
+        if (received++ % keepEvery != 0)
+            return false;
+        if (minPeriod > 0) {
+            if (utime < nextDue)
+                return false;
+            // Messages arriving a little late don't push the next one back, but after a gap
+            // the next one is due a whole period later
+            nextDue = (utime - minPeriod < nextDue ? nextDue : utime) + minPeriod;
+        }
+        return true;
+    }
+};
+
+// The per channel rules and the policies resolved from them. Only used by the receive thread
+struct ChannelPolicies
+{
+    std::vector<std::pair<std::regex, u64>>      decimateRules;
+    std::vector<std::pair<std::regex, double>>   maxRateRules;
+    std::vector<std::pair<std::regex, Priority>> priorityRules;
+    std::unordered_map<std::string, ChannelPolicy> policies;
+    std::string policyKey;   // Reused to look up policies without allocating
+    double maxFill[NUM_PRIORITIES] = { LOW_PRIORITY_MAX_FILL, 1.0, 1.0 };
+
+    void addDecimate(const std::string& re, u64 keepEvery)
+    { decimateRules.emplace_back(std::regex{re}, keepEvery); }
+
+    void addMaxRate(const std::string& re, double hz)
+    { maxRateRules.emplace_back(std::regex{re}, hz); }
+
+    void addPriority(const std::string& re, Priority priority)
+    {
+        priorityRules.emplace_back(std::regex{re}, priority);
+        // Normal priority channels leave some room for high priority ones
+        if (priority == PRIORITY_HIGH)
+            maxFill[PRIORITY_NORMAL] = NORMAL_PRIORITY_MAX_FILL;
+    }
+
+    bool empty() const
+    {
+        return decimateRules.empty() && maxRateRules.empty() && priorityRules.empty();
+    }
+
+    ChannelPolicy& policyFor(const char *channel)
+    {
+        policyKey.assign(channel);
+        auto it = policies.find(policyKey);
+        if (it != policies.end())
+            return it->second;
+
+        ChannelPolicy& p = policies[policyKey];
+        for (auto& r : decimateRules) {
+            if (std::regex_match(channel, r.first)) {
+                p.keepEvery = r.second;
+                break;
+            }
+        }
+        for (auto& r : maxRateRules) {
+            if (std::regex_match(channel, r.first)) {
+                p.minPeriod = (i64)(1e6 / r.second);
+                break;
+            }
+        }
+        for (auto& r : priorityRules) {
+            if (std::regex_match(channel, r.first)) {
+                p.priority = r.second;
+                break;
+            }
+        }
+        return p;
+    }
+
+    // Whether to log the message received on 'channel' at 'utime', and if so how full the
+    // receive ring may be for it to still be pushed
+    bool admit(const char *channel, i64 utime, double& fill)
+    {
+        fill = 1.0;
+        if (empty())
+            return true;
+        ChannelPolicy& p = policyFor(channel);
+        if (!p.admit(utime))
+            return false;
+        fill = maxFill[p.priority];
+        return true;
+    }
+};
+
+// Messages that weren't logged, counted by the receive thread and reported by the writer
+struct DropCounts
+{
+    std::atomic<size_t> full      {0};
+    std::atomic<size_t> memory    {0};
+    std::atomic<size_t> shed      {0};
+    std::atomic<size_t> decimated {0};
+
+    std::mutex lock;
+    std::unordered_map<std::string, size_t> byChannel;
+
+    // Counts a message on 'channel' that the ring didn't take
+    void count(EventRing::PushResult res, const char *channel)
+    {
+        if (res == EventRing::SHED)
+            shed++;
+        else if (res == EventRing::QUEUE_FULL)
+            full++;
+        else
+            memory++;
+        std::unique_lock<std::mutex> lk{lock};
+        byChannel[channel]++;
+    }
+
+    // Decimated messages were meant to be left out, so they don't count
+    size_t total() const
+    {
+        return full + memory + shed;
+    }
+};
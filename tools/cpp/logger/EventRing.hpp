@@ -0,0 +1,213 @@
+#pragma once
+
+#include "zcm/eventlog.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// A bounded lock-free multi-producer single-consumer ring of log events.
+// Events are copied into one arena allocated up front, so however the message sizes vary
+// the ring never allocates and never holds on to more memory than the arena. Each event
+// takes the next bytes of the arena, wrapping around to its start, and its bytes are
+// handed back once the consumer releases it. A producer reserves a slot and its bytes
+// together with a single compare and swap, so both are reclaimed in the order they were
+// taken, and copies the event in afterwards. The consumer reads events in place in
+// batches and releases them once they have been written.
+class EventRing
+{
+  public:
+    // SHED when the event only didn't fit under the 'maxFill' it was pushed with
+    enum PushResult { PUSHED, QUEUE_FULL, ARENA_FULL, SHED };
+
+  private:
+    // Positions are kept in 32 bits, slots counted modulo 2^32 and the arena in units of
+    // 8 bytes, so that a position in the queue and one in the arena fit in one word
+    static const size_t UNIT = 8;
+    static const uint64_t MAX_UNITS = UINT32_MAX;
+
+    static uint64_t pack(uint32_t pos, uint32_t unit) { return (uint64_t)pos << 32 | unit; }
+    static uint32_t posOf(uint64_t w) { return (uint32_t)(w >> 32); }
+    static uint32_t unitOf(uint64_t w) { return (uint32_t)w; }
+
+    struct Slot
+    {
+        std::atomic<uint32_t> seq;
+        zcm_eventlog_event_t event;
+        uint32_t end = 0;   // Arena unit right after the event's bytes
+    };
+
+    Slot  *slots;
+    size_t mask;
+    char  *arena;
+    size_t arenaUnits;
+
+    // Next slot and arena unit to take, moved on by the producers
+    std::atomic<uint64_t> reserved {0};
+
+    // Keeps the producers' position off the consumer's cache line
+    char pad0[64];
+    // Slots released and the arena unit after the last of them. Written by the consumer
+    std::atomic<uint64_t> released {0};
+    size_t dequeuePos = 0;
+    size_t peeked = 0;
+
+    // Units of the arena that hold events, or were skipped at its end, between the two
+    size_t unitsUsed(uint64_t r, uint64_t rel) const
+    {
+        if (posOf(r) == posOf(rel)) return 0;
+        uint32_t head = unitOf(r), tail = unitOf(rel);
+        return head > tail ? head - tail : arenaUnits - tail + head;
+    }
+
+  public:
+    // 'size' is rounded up to a power of 2. 'arenaBytes' bounds the bytes of the events
+    // waiting in the ring, channel names included, and is at most 32GB
+    EventRing(size_t size, size_t arenaBytes)
+    {
+        size_t n = 1;
+        while (n < size && n < ((size_t)1 << 31)) n <<= 1;
+        mask = n - 1;
+        slots = new Slot[n];
+        for (size_t i = 0; i < n; ++i)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        arenaUnits = arenaBytes / UNIT;
+        if (arenaUnits > MAX_UNITS) arenaUnits = MAX_UNITS;
+        arena = (char*) malloc(arenaUnits * UNIT);
+    }
+
+    ~EventRing()
+    {
+        free(arena);
+        delete[] slots;
+    }
+
+    bool good() const { return arena != nullptr && arenaUnits > 0; }
+
+    size_t capacity() const { return mask + 1; }
+
+    size_t arenaCapacity() const { return arenaUnits * UNIT; }
+
+    // Number of events pushed but not yet released. Consumer only
+    size_t depth() const
+    {
+        return (uint32_t)(posOf(reserved.load(std::memory_order_relaxed)) - dequeuePos);
+    }
+
+    // Arena bytes taken by events pushed but not yet released
+    size_t arenaUsed() const
+    {
+        return unitsUsed(reserved.load(std::memory_order_relaxed),
+                         released.load(std::memory_order_relaxed)) * UNIT;
+    }
+
+    // Whether the oldest event has been published. Consumer only
+    bool ready() const
+    {
+        const Slot& slot = slots[(dequeuePos + peeked) & mask];
+        return slot.seq.load(std::memory_order_acquire) == (uint32_t)(dequeuePos + peeked + 1);
+    }
+
+    // Copies an event into the ring. Safe to call from any number of threads.
+    // With 'maxFill' below 1 the event is only taken while the queue and the arena stay
+    // at most that full, which keeps the rest of them for events pushed with a higher one
+    PushResult push(int64_t utime, const char *channel, int32_t channellen,
+                    const void *data, int32_t datalen, double maxFill = 1.0)
+    {
+        // The channel is padded so that data starts 8 byte aligned, for handlers that
+        // decode it in place
+        size_t channelUnits = ((size_t)channellen + 1 + UNIT - 1) / UNIT;
+        size_t need = channelUnits + ((size_t)datalen + UNIT - 1) / UNIT;
+        if (need > arenaUnits) return ARENA_FULL;
+        size_t maxSlots = maxFill < 1 ? (size_t)(capacity() * maxFill) : capacity();
+        size_t maxUnits = maxFill < 1 ? (size_t)(arenaUnits * maxFill) : arenaUnits;
+
+        uint32_t pos, start, end;
+        while (true) {
+            // Read in this order, nothing is released that wasn't reserved yet. Read again
+            // in case the consumer moved an empty arena back to its front in between, see
+            // release()
+            uint64_t rel = released.load(std::memory_order_acquire);
+            uint64_t r = reserved.load(std::memory_order_acquire);
+            if (released.load(std::memory_order_relaxed) != rel)
+                continue;
+            pos = posOf(r);
+            size_t slotsUsed = (uint32_t)(pos + 1 - posOf(rel));
+            if (slotsUsed > capacity())
+                return QUEUE_FULL;
+
+            // An event doesn't wrap around the end of the arena, it starts over at the front
+            size_t used = unitsUsed(r, rel);
+            start = unitOf(r);
+            if (start + need > arenaUnits) {
+                used += arenaUnits - start;
+                start = 0;
+            }
+            if (used + need > arenaUnits)
+                return ARENA_FULL;
+            if (slotsUsed > maxSlots || used + need > maxUnits)
+                return SHED;
+
+            end = start + need == arenaUnits ? 0 : start + need;
+            if (reserved.compare_exchange_weak(r, pack(pos + 1, end),
+                                               std::memory_order_relaxed))
+                break;
+        }
+
+        // Released before 'released' moved past it, so the consumer is done with the slot
+        Slot *slot = &slots[pos & mask];
+        slot->end = end;
+        char *buf = arena + (size_t)start * UNIT;
+        zcm_eventlog_event_t& le = slot->event;
+        le.timestamp = utime;
+        le.channellen = channellen;
+        le.datalen = datalen;
+        le.channel = buf;
+        le.data = buf + channelUnits * UNIT;
+        memcpy(le.channel, channel, channellen);
+        le.channel[channellen] = '\0';
+        memcpy(le.data, data, datalen);
+
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return PUSHED;
+    }
+
+    // Points 'events' at up to 'max' of the oldest events, which stay valid until
+    // release() is called. Returns how many there were. Consumer only
+    size_t peek(zcm_eventlog_event_t *events, size_t max)
+    {
+        for (peeked = 0; peeked < max; ++peeked) {
+            const Slot& slot = slots[(dequeuePos + peeked) & mask];
+            if (slot.seq.load(std::memory_order_acquire) != (uint32_t)(dequeuePos + peeked + 1))
+                break;
+            events[peeked] = slot.event;
+        }
+        return peeked;
+    }
+
+    // Hands the slots of the events returned by peek(), and their bytes of the arena, back
+    // to the producers. Consumer only
+    void release()
+    {
+        if (peeked == 0) return;
+        // A slot's sequence is only ever compared to the one it will have once published,
+        // so it doesn't need resetting
+        uint32_t tail = slots[(dequeuePos + peeked - 1) & mask].end;
+        dequeuePos += peeked;
+        peeked = 0;
+
+        // Once empty, the arena starts over at its front, so that an event as large as the
+        // whole arena fits again. Producers that got in first just leave the bytes before
+        // their event counted as used until it is released
+        uint64_t empty = pack(dequeuePos, tail);
+        if (reserved.load(std::memory_order_relaxed) == empty) {
+            released.store(pack(dequeuePos, 0), std::memory_order_release);
+            reserved.compare_exchange_strong(empty, pack(dequeuePos, 0),
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed);
+            return;
+        }
+        released.store(pack(dequeuePos, tail), std::memory_order_release);
+    }
+};
@@ -10,7 +10,9 @@
 #include <mutex>
 #include <condition_variable>
 #include <thread>
-#include <queue>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
 #include <signal.h>
 
 #include <errno.h>
@@ -26,12 +28,25 @@
 #include "util/TimeUtil.hpp"
 #include "util/Types.hpp"
 
+#include "ChannelPolicy.hpp"
+#include "EventRing.hpp"
+
 using namespace std;
 
 #include "platform.hpp"
 
 static atomic_int done {0};
 
+// Splits a "REGEX:VALUE" option argument at its last ':'
+static bool splitRule(const char *arg, string& re, string& value)
+{
+    const char *colon = strrchr(arg, ':');
+    if (!colon || colon == arg || !colon[1]) return false;
+    re.assign(arg, colon - arg);
+    value = colon + 1;
+    return true;
+}
+
 struct Args
 {
     double auto_split_mb      = 0.0;
@@ -45,13 +60,23 @@ struct Args
     int    rotate             = -1;
     int    fflush_interval_ms = 100;
     i64    max_target_memory  = 0;
+    size_t queue_size         = 16384;
+    bool   write_index        = true;
+    int    compress_level     = -2;
+    bool   direct_io          = false;
+    int    log_format         = ZCM_EVENTLOG_FORMAT_V1;
+
+    // Per channel rules, by channel regex. The first rule matching a channel applies
+    vector<pair<string, u64>>      decimate;
+    vector<pair<string, double>>   max_rate;
+    vector<pair<string, Priority>> priority;
 
     string input_fname;
 
     bool parse(int argc, char *argv[])
     {
         // set some defaults
-        const char *optstring = "hb:c:fi:u:r:s:qvl:m:";
+        const char *optstring = "hb:c:fi:u:r:s:qvl:m:xz:dQ:F:";
         struct option long_opts[] = {
             { "help", no_argument, 0, 'h' },
             { "split-mb", required_argument, 0, 'b' },
@@ -65,6 +90,14 @@ struct Args
             { "invert-channels", no_argument, 0, 'v' },
             { "flush-interval", required_argument, 0, 'l'},
             { "max-target-memory", required_argument, 0, 'm'},
+            { "no-index", no_argument, 0, 'x'},
+            { "compress", required_argument, 0, 'z'},
+            { "direct-io", no_argument, 0, 'd'},
+            { "queue-size", required_argument, 0, 'Q'},
+            { "format", required_argument, 0, 'F'},
+            { "decimate", required_argument, 0, 'D'},
+            { "max-rate", required_argument, 0, 'R'},
+            { "priority", required_argument, 0, 'P'},
             { 0, 0, 0, 0 }
         };
 
@@ -110,7 +143,65 @@ struct Args
                     break;
                 case 'm':
                     max_target_memory = atoll(optarg);
+                    if (max_target_memory <= 0)
+                        return false;
+                    break;
+                case 'x':
+                    write_index = false;
                     break;
+                case 'd':
+                    direct_io = true;
+                    break;
+                case 'Q':
+                    queue_size = strtoul(optarg, NULL, 10);
+                    if (queue_size == 0)
+                        return false;
+                    break;
+                case 'F':
+                    log_format = atoi(optarg);
+                    if (log_format != ZCM_EVENTLOG_FORMAT_V1 &&
+                        log_format != ZCM_EVENTLOG_FORMAT_V2)
+                        return false;
+                    break;
+                case 'z': {
+                    char* eptr = NULL;
+                    compress_level = strtol(optarg, &eptr, 10);
+                    if (*eptr || compress_level < -1 || compress_level > 9)
+                        return false;
+                } break;
+                case 'D': {
+                    string re, value;
+                    char* eptr = NULL;
+                    if (!splitRule(optarg, re, value))
+                        return false;
+                    u64 n = strtoull(value.c_str(), &eptr, 10);
+                    if (*eptr || n == 0)
+                        return false;
+                    decimate.emplace_back(re, n);
+                } break;
+                case 'R': {
+                    string re, value;
+                    char* eptr = NULL;
+                    if (!splitRule(optarg, re, value))
+                        return false;
+                    double hz = strtod(value.c_str(), &eptr);
+                    if (*eptr || !(hz > 0))
+                        return false;
+                    max_rate.emplace_back(re, hz);
+                } break;
+                case 'P': {
+                    string re, value;
+                    if (!splitRule(optarg, re, value))
+                        return false;
+                    if (value == "low")
+                        priority.emplace_back(re, PRIORITY_LOW);
+                    else if (value == "normal")
+                        priority.emplace_back(re, PRIORITY_NORMAL);
+                    else if (value == "high")
+                        priority.emplace_back(re, PRIORITY_HIGH);
+                    else
+                        return false;
+                } break;
                 case 'h':
                 default:
                     return false;
@@ -132,6 +223,11 @@ struct Args
             return false;
         }
 
+        if (log_format == ZCM_EVENTLOG_FORMAT_V2 && compress_level >= -1) {
+            fprintf(stderr, "ERROR.  --format=2 and --compress can't both be used\n");
+            return false;
+        }
+
         if (rotate > 0 && auto_increment) {
             fprintf(stderr, "ERROR.  --increment and --rotate can't both be used\n");
             return false;
@@ -141,6 +237,24 @@ struct Args
     }
 };
 
+// Log events and log time between seek index entries
+#define INDEX_STRIDE_EVENTS 256
+#define INDEX_STRIDE_USEC   100000
+
+// Bytes written to disk at a time, from a background thread
+#define WRITE_BUFFER_SIZE (4 << 20)
+
+// Uncompressed bytes per block and background threads compressing them
+#define COMPRESS_BLOCK_SIZE (1 << 20)
+#define COMPRESS_THREADS    2
+
+// Events taken off the receive queue and written at a time
+#define WRITE_BATCH_SIZE 256
+
+// Memory for received messages waiting to be written, unless --max-target-memory says
+// otherwise
+#define DEFAULT_TARGET_MEMORY ((i64)256 << 20)
+
 struct Logger
 {
     Args   args;
@@ -155,6 +269,8 @@ struct Logger
     // variables for inverted matching (e.g., logging all but some channels)
     regex invert_regex;
 
+    ChannelPolicies policies;
+
     // these members controlled by writing
     size_t nevents                  = 0;
     size_t logsize                  = 0;
@@ -164,30 +280,39 @@ struct Logger
     u64    time0                    = TimeUtil::utime();
     u64    last_fflush_time         = 0;
 
-    size_t dropped_packets_count    = 0;
     u64    last_drop_report_utime   = 0;
     size_t last_drop_report_count   = 0;
+    size_t max_queue_depth          = 0;
+    i64    max_memory_usage         = 0;
 
     int    num_splits               = 0;
 
-    i64    totalMemoryUsage         = 0;
+    // these members are shared with the receive thread
+    DropCounts     drops;
+    atomic<bool>   sleeping         {false};
 
     mutex lk;
     condition_variable newEventCond;
 
-    queue<zcm_eventlog_event_t*> q;
+    EventRing *ring = nullptr;
+    vector<zcm_eventlog_event_t> batch;
+
+    // these members are shared with the roller thread, see rollerThreadFunc
+    thread roller;
+    mutex rollLock;
+    condition_variable rollCond;
+    zcm_eventlog_t *nextLog         = nullptr;
+    string nextFilename;
+    bool nextFailed                 = false;
+    zcm_eventlog_t *retiredLog      = nullptr;
+    bool stopRolling                = false;
 
     Logger() {}
 
     ~Logger()
     {
-        while (!q.empty()) {
-            zcm_eventlog_event_t* le = q.front();
-            q.pop();
-            delete[] le->channel;
-            delete[] (char*)le->data;
-            delete le;
-        }
+        stopRoller();
+        delete ring;
     }
 
     bool init(int argc, char *argv[])
@@ -197,15 +322,40 @@ struct Logger
 
         if (!openLogfile())
             return false;
+        if (args.auto_split_mb > 0)
+            roller = thread(&Logger::rollerThreadFunc, this);
+
+        // Received messages are only ever buffered in this arena, so it bounds the memory
+        // they take however their sizes vary
+        i64 arenaBytes = args.max_target_memory ? args.max_target_memory : DEFAULT_TARGET_MEMORY;
+        ring = new EventRing(args.queue_size, arenaBytes);
+        if (!ring->good()) {
+            fprintf(stderr, "Unable to allocate %" PRId64 " bytes for received messages\n",
+                    arenaBytes);
+            return false;
+        }
+        batch.resize(WRITE_BATCH_SIZE);
 
         // Compile the regex if we are in invert mode
         if (args.invert_channels) {
             invert_regex = regex{args.chan};
         }
 
+        for (auto& r : args.decimate)
+            policies.addDecimate(r.first, r.second);
+        for (auto& r : args.max_rate)
+            policies.addMaxRate(r.first, r.second);
+        for (auto& r : args.priority)
+            policies.addPriority(r.first, r.second);
+
         return true;
     }
 
+    size_t totalDropped() const
+    {
+        return drops.total();
+    }
+
     const char *getSubChannel()
     {
         // if inverting the channels, subscribe to everything and invert on the callback
@@ -217,27 +367,31 @@ struct Logger
         if (!args.quiet)
             printf("Rotating log files\n");
 
-        // delete log files that have fallen off the end of the rotation
-        string tomove = fname_prefix + "." + to_string(args.rotate-1);
-        if (FileUtil::exists(tomove)) {
-            if (0 != FileUtil::remove(tomove)) {
-                fprintf(stderr, "ERROR! Unable to delete [%s]\n", tomove.c_str());
+        // Log files are accompanied by their index
+        for (const string& suffix : { string(""), string(ZCM_EVENTLOG_INDEX_SUFFIX) }) {
+            // delete log files that have fallen off the end of the rotation
+            string tomove = fname_prefix + "." + to_string(args.rotate-1) + suffix;
+            if (FileUtil::exists(tomove)) {
+                if (0 != FileUtil::remove(tomove)) {
+                    fprintf(stderr, "ERROR! Unable to delete [%s]\n", tomove.c_str());
+                }
             }
-        }
 
-        // Rotate away any existing log files
-        for (int file_num = args.rotate-1; file_num >= 0; file_num--) {
-            string newname = fname_prefix + "." + to_string(file_num);
-            string tomove  = fname_prefix + "." + to_string(file_num-1);
-            if (FileUtil::exists(tomove)) {
-                if (0 != FileUtil::rename(tomove, newname)) {
-                    fprintf(stderr, "ERROR!  Unable to rotate [%s]\n", tomove.c_str());
+            // Rotate away any existing log files
+            for (int file_num = args.rotate-1; file_num >= 0; file_num--) {
+                string newname = fname_prefix + "." + to_string(file_num) + suffix;
+                string tomove  = fname_prefix + "." + to_string(file_num-1) + suffix;
+                if (FileUtil::exists(tomove)) {
+                    if (0 != FileUtil::rename(tomove, newname)) {
+                        fprintf(stderr, "ERROR!  Unable to rotate [%s]\n", tomove.c_str());
+                    }
                 }
             }
         }
     }
 
-    bool openLogfile()
+    // Picks the name of the next log file
+    string nextLogfileName()
     {
         char tmp_path[PATH_MAX];
 
@@ -260,44 +414,179 @@ struct Logger
         if (args.auto_increment) {
             /* Loop through possible file names until we find one that doesn't
              * already exist.  This way, we never overwrite an existing file. */
+            string name;
             do {
                 snprintf(tmp_path, sizeof(tmp_path), "%s.%02d",
                          fname_prefix.c_str(), next_increment_num);
-                filename = tmp_path;
+                name = tmp_path;
                 next_increment_num++;
-            } while(FileUtil::exists(filename));
+            } while(FileUtil::exists(name));
+            return name;
         } else if (args.rotate > 0) {
-            filename = fname_prefix + ".0";
-        } else {
-            filename = fname_prefix;
-            if (!args.force_overwrite) {
-                if (FileUtil::exists(filename)) {
-                    fprintf(stderr, "Refusing to overwrite existing file \"%s\"\n", filename.c_str());
-                    return false;
-                }
-            }
+            return fname_prefix + ".0";
         }
+        return fname_prefix;
+    }
 
+    zcm_eventlog_t *createLogfile(const string& path, const char *logmode)
+    {
         // create directories if needed
-        string dirpart = FileUtil::dirname(filename);
+        string dirpart = FileUtil::dirname(path);
         if (!FileUtil::dirExists(dirpart))
             FileUtil::mkdirWithParents(dirpart, 0755);
 
         if(!args.quiet) {
-            printf("Opening log file \"%s\"\n", filename.c_str());
+            printf("Opening log file \"%s\"\n", path.c_str());
         }
 
-        // open output file in append mode if we're rotating log files, or write
-        // mode if not.
-        const char *logmode = (args.rotate > 0) ? "a" : "w";
-        log = zcm_eventlog_create(filename.c_str(), logmode);
-        if (!log) {
+        zcm_eventlog_t *l = zcm_eventlog_create(path.c_str(), logmode);
+        if (!l) {
             perror("Error: fopen failed");
+            return nullptr;
+        }
+
+        int writeFlags = ZCM_EVENTLOG_WRITE_ASYNC;
+        if (args.direct_io) writeFlags |= ZCM_EVENTLOG_WRITE_DIRECT;
+        if (zcm_eventlog_set_write_buffer(l, WRITE_BUFFER_SIZE, writeFlags) != 0) {
+            fprintf(stderr, "Unable to set up writing \"%s\"%s\n", path.c_str(),
+                    args.direct_io ? " with direct I/O" : "");
+            zcm_eventlog_destroy(l);
+            return nullptr;
+        }
+
+        // An existing log being appended to keeps its format
+        if (zcm_eventlog_set_format(l, args.log_format) != 0)
+            fprintf(stderr, "Appending to \"%s\" in its existing format\n", path.c_str());
+
+        // Compressed logs carry their own block index
+        if (args.compress_level >= -1) {
+            if (zcm_eventlog_enable_compression(l, args.compress_level,
+                                                COMPRESS_BLOCK_SIZE, COMPRESS_THREADS) != 0) {
+                fprintf(stderr, "Unable to compress \"%s\"\n", path.c_str());
+                zcm_eventlog_destroy(l);
+                return nullptr;
+            }
+        } else if (args.write_index &&
+                   zcm_eventlog_enable_index(l, INDEX_STRIDE_EVENTS, INDEX_STRIDE_USEC) != 0) {
+            fprintf(stderr, "Unable to write a seek index for \"%s\"\n", path.c_str());
+        }
+        return l;
+    }
+
+    bool openLogfile()
+    {
+        filename = nextLogfileName();
+        if (!args.auto_increment && args.rotate <= 0 && !args.force_overwrite &&
+            FileUtil::exists(filename)) {
+            fprintf(stderr, "Refusing to overwrite existing file \"%s\"\n", filename.c_str());
             return false;
         }
+
+        // open output file in append mode if we're rotating log files, or write
+        // mode if not.
+        log = createLogfile(filename, (args.rotate > 0) ? "a" : "w");
+        return log != nullptr;
+    }
+
+    // Where the next file of a rotation is opened ahead of time, until it is renamed to
+    // '<prefix>.0'. Hidden so that globs over the rotated files don't pick it up
+    string rotateAheadPath(const string& name)
+    {
+        size_t slash = name.rfind('/');
+        size_t base = slash == string::npos ? 0 : slash + 1;
+        return name.substr(0, base) + "." + name.substr(base) + ".next";
+    }
+
+    // Opens the file after the current one, on the roller thread
+    void openNextLogfile()
+    {
+        string name = nextLogfileName();
+        string path = args.rotate > 0 ? rotateAheadPath(name) : name;
+        zcm_eventlog_t *l = createLogfile(path, "w");
+
+        unique_lock<mutex> lock{rollLock};
+        nextLog = l;
+        nextFilename = name;
+        nextFailed = !l;
+        rollCond.notify_all();
+    }
+
+    // Closes finished log files, rotates the older ones and opens the next file ahead of
+    // time, so that splitting never stalls the writer on the file system
+    void rollerThreadFunc()
+    {
+        openNextLogfile();
+
+        unique_lock<mutex> lock{rollLock};
+        while (true) {
+            rollCond.wait(lock, [&]{ return retiredLog || stopRolling; });
+            if (!retiredLog) break;
+            zcm_eventlog_t *retired = retiredLog;
+            string current = filename;
+            retiredLog = nullptr;
+            lock.unlock();
+
+            // The writer already writes the file opened ahead, which can still be renamed
+            if (args.rotate > 0) {
+                rotate_logfiles();
+                string ahead = rotateAheadPath(current);
+                for (const string& suffix : { string(""), string(ZCM_EVENTLOG_INDEX_SUFFIX) })
+                    if (FileUtil::exists(ahead + suffix) &&
+                        FileUtil::rename(ahead + suffix, current + suffix) != 0)
+                        fprintf(stderr, "ERROR!  Unable to rotate in [%s]\n", ahead.c_str());
+            }
+            openNextLogfile();
+            // Closing writes out whatever is still buffered, and for compressed logs
+            // the last block and the block index
+            zcm_eventlog_destroy(retired);
+
+            lock.lock();
+        }
+
+        // Nothing was written to the file opened ahead
+        if (nextLog) {
+            string path = args.rotate > 0 ? rotateAheadPath(nextFilename) : nextFilename;
+            zcm_eventlog_destroy(nextLog);
+            nextLog = nullptr;
+            FileUtil::remove(path);
+            FileUtil::remove(path + ZCM_EVENTLOG_INDEX_SUFFIX);
+        }
+    }
+
+    // Moves writing on to the file opened ahead. Only waits for it when splits come
+    // faster than files can be opened
+    bool rollOver()
+    {
+        unique_lock<mutex> lock{rollLock};
+        rollCond.wait(lock, [&]{ return nextLog || nextFailed; });
+        if (!nextLog) return false;
+        retiredLog = log;
+        log = nextLog;
+        filename = nextFilename;
+        nextLog = nullptr;
+        rollCond.notify_all();
         return true;
     }
 
+    void stopRoller()
+    {
+        if (!roller.joinable()) return;
+        {
+            unique_lock<mutex> lock{rollLock};
+            stopRolling = true;
+        }
+        rollCond.notify_all();
+        roller.join();
+    }
+
+    // Stops the roller and closes the log file being written
+    void finish()
+    {
+        stopRoller();
+        zcm_eventlog_destroy(log);
+        log = nullptr;
+    }
+
     static void handler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
     { ((Logger*)usr)->handler_(rbuf, channel); }
 
@@ -310,106 +599,130 @@ struct Logger
                 return;
         }
 
-        bool stillRoom;
-        {
-            unique_lock<mutex> lock{lk};
-            stillRoom = (args.max_target_memory == 0) ? true :
-                (totalMemoryUsage + rbuf->data_size < args.max_target_memory);
+        double fill;
+        if (!policies.admit(channel, rbuf->recv_utime, fill)) {
+            drops.decimated++;
+            return;
         }
 
-        zcm_eventlog_event_t *le;
-        if (stillRoom) {
-            le = new zcm_eventlog_event_t();
-            le->timestamp = rbuf->recv_utime;
-            le->channellen = strlen(channel);
-            le->datalen = rbuf->data_size;
-            le->channel = new char[le->channellen + 1];
-            le->channel[le->channellen] = '\0'; // terminate the cstr with null char
-            memcpy(le->channel, channel, sizeof(char) * le->channellen);
-            le->data = new char[rbuf->data_size];
-            memcpy(le->data, rbuf->data, sizeof(char) * rbuf->data_size);
+        EventRing::PushResult res = ring->push(rbuf->recv_utime, channel, strlen(channel),
+                                               rbuf->data, rbuf->data_size, fill);
+        if (res != EventRing::PUSHED) {
+            if (res == EventRing::SHED)
+                ZCM_DEBUG("Dropping message to leave room for higher priority channels");
+            else if (res == EventRing::QUEUE_FULL)
+                ZCM_DEBUG("Dropping message, receive queue is full");
+            else
+                ZCM_DEBUG("Dropping message due to enforced memory constraints");
+            drops.count(res, channel);
+            return;
         }
 
-        {
+        // Only the writer going to sleep on an empty queue needs waking up. The fence
+        // pairs with the one in flushWhenReady so one of the two sides sees the other
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleeping.load(memory_order_relaxed)) {
             unique_lock<mutex> lock{lk};
-            if (stillRoom) {
-                q.push(le);
-                totalMemoryUsage += le->datalen + le->channellen + sizeof(zcm_eventlog_event_t);
-            } else {
-                ZCM_DEBUG("Dropping message due to enforced memory constraints");
-                ZCM_DEBUG("Current memory estimations are at %" PRId64 " bytes", totalMemoryUsage);
-            }
+            newEventCond.notify_all();
         }
-        newEventCond.notify_all();
     }
 
-    void flushWhenReady()
+    // Writes out the next batch of received events, waiting for some to arrive if
+    // there are none. Returns false if there was nothing to write
+    bool flushWhenReady()
     {
-        zcm_eventlog_event_t *le = nullptr;
-        size_t qSize = 0;
-        i64 memUsed = 0;
-        {
+        size_t depth = ring->depth();
+        size_t n = ring->peek(batch.data(), batch.size());
+        if (n == 0) {
+            ring->release();
             unique_lock<mutex> lock{lk};
+            sleeping = true;
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!done && !ring->ready())
+                newEventCond.wait_for(lock, chrono::milliseconds(100));
+            sleeping = false;
+            return ring->ready();
+        }
+        if (depth > max_queue_depth) max_queue_depth = depth;
+        i64 memUsed = ring->arenaUsed();
+        if (memUsed > max_memory_usage) max_memory_usage = memUsed;
 
-            while (q.empty()) {
-                if (done) return;
-                newEventCond.wait(lock);
-            }
-            if (done) return;
+        writeEvents(batch.data(), n);
 
-            le = q.front();
-            q.pop();
-            qSize = q.size();
-            memUsed = totalMemoryUsage; // want to capture the max mem used, not post flush
-            totalMemoryUsage -= (le->datalen + le->channellen + sizeof(zcm_eventlog_event_t));
+        const zcm_eventlog_event_t& last = batch[n - 1];
+        if (args.fflush_interval_ms >= 0 &&
+            (last.timestamp - last_fflush_time) > (u64)args.fflush_interval_ms * 1000) {
+            Platform::fflush(zcm_eventlog_get_fileptr(log));
+            last_fflush_time = last.timestamp;
         }
-        if (qSize != 0) ZCM_DEBUG("Queue size = %zu\n", qSize);
-
-        // Is it time to start a new logfile?
-        if (args.auto_split_mb) {
-            double logsize_mb = (double)logsize / (1 << 20);
-            if (logsize_mb > args.auto_split_mb) {
-                // Yes.  open up a new log file
-                zcm_eventlog_destroy(log);
-                if (args.rotate > 0)
-                    rotate_logfiles();
-                if(!openLogfile())
+        report(last.timestamp);
+
+        ring->release();
+        return true;
+    }
+
+    void writeEvents(zcm_eventlog_event_t *events, size_t n)
+    {
+        size_t splitBytes = (size_t)(args.auto_split_mb * (1 << 20));
+        while (n > 0) {
+            // Is it time to start a new logfile?
+            if (args.auto_split_mb && logsize > splitBytes) {
+                // Yes.  move on to the log file opened ahead
+                if (!rollOver())
                     exit(1);
                 num_splits++;
                 logsize = 0;
                 last_report_logsize = 0;
             }
-        }
 
-        if (zcm_eventlog_write_event(log, le) != 0) {
-            static u64 last_spew_utime = 0;
-            string reason = strerror(errno);
-            u64 now = TimeUtil::utime();
-            if (now - last_spew_utime > 500000) {
-                fprintf(stderr, "zcm_eventlog_write_event: %s\n", reason.c_str());
-                last_spew_utime = now;
+            // Write everything that goes in this logfile in one go
+            size_t count = 0, bytes = 0;
+            do {
+                bytes += eventSize(events[count++]);
+            } while (count < n && !(args.auto_split_mb && logsize + bytes > splitBytes));
+
+            size_t written = zcm_eventlog_write_events(log, events, count);
+            for (size_t i = 0; i < written; ++i) {
+                nevents++;
+                events_since_last_report++;
+                logsize += eventSize(events[i]);
             }
-            if (errno == ENOSPC)
-                exit(1);
-
-            delete[] le->channel;
-            delete[] (char*)le->data;
-            delete le;
-            return;
+            if (written < count) {
+                int err = errno;
+                static u64 last_spew_utime = 0;
+                u64 now = TimeUtil::utime();
+                if (now - last_spew_utime > 500000) {
+                    fprintf(stderr, "zcm_eventlog_write_event: %s\n", strerror(err));
+                    last_spew_utime = now;
+                }
+                // Only a bad event fails on its own. Any other error sticks to the log
+                // file and every later write to it would fail too
+                if (err != EINVAL) {
+                    fprintf(stderr, "Unable to keep writing \"%s\", stopping\n",
+                            filename.c_str());
+                    exit(1);
+                }
+                written++; // skip the event that failed
+            }
+            events += written;
+            n -= written;
         }
+    }
 
-        if (args.fflush_interval_ms >= 0 &&
-            (le->timestamp - last_fflush_time) > (u64)args.fflush_interval_ms * 1000) {
-            Platform::fflush(zcm_eventlog_get_fileptr(log));
-            last_fflush_time = le->timestamp;
-        }
+    static size_t eventSize(const zcm_eventlog_event_t& le)
+    { return 4 + 8 + 8 + 4 + le.channellen + 4 + le.datalen; }
 
-        // bookkeeping, cleanup
-        nevents++;
-        events_since_last_report++;
-        logsize += 4 + 8 + 8 + 4 + le->channellen + 4 + le->datalen;
+    void report(i64 utime)
+    {
+        size_t dropped = totalDropped();
+        u64 now = TimeUtil::utime();
+        if (dropped != last_drop_report_count && now - last_drop_report_utime > 1000000) {
+            reportDrops();
+            last_drop_report_count = dropped;
+            last_drop_report_utime = now;
+        }
 
-        i64 offset_utime = le->timestamp - time0;
+        i64 offset_utime = utime - time0;
         if (!args.quiet && (offset_utime - last_report_time > 1000000)) {
             double dt = (offset_utime - last_report_time)/1000000.0;
 
@@ -420,15 +733,46 @@ struct Logger
                    filename.c_str(),
                    offset_utime / 1000000,
                    nevents, logsize/1048576,
-                   tps, kbps, memUsed / 1024);
+                   tps, kbps, max_memory_usage / 1024);
+
+            zcm_eventlog_write_stats_t stats;
+            zcm_eventlog_get_write_stats(log, &stats);
+            printf("Pipeline: queue %6zu / %zu max  |  dropped %zu  |  decimated %zu  |  "
+                   "compressing %3" PRIu64 " blocks, %" PRIu64 " waits  |  "
+                   "writing %6" PRIu64 " KB, %" PRIu64 " waits\n",
+                   max_queue_depth, ring->capacity(), dropped, drops.decimated.load(),
+                   stats.queued_blocks, stats.compress_waits,
+                   stats.buffered_bytes / 1024, stats.disk_waits);
             last_report_time = offset_utime;
             events_since_last_report = 0;
             last_report_logsize = logsize;
+            max_queue_depth = 0;
+            max_memory_usage = 0;
         }
+    }
 
-        delete[] le->channel;
-        delete[] (char*)le->data;
-        delete le;
+    // Prints how many messages were dropped so far, and on which channels the most
+    void reportDrops()
+    {
+        size_t dropped = totalDropped();
+        vector<pair<size_t, string>> channels;
+        {
+            unique_lock<mutex> lock{drops.lock};
+            for (auto& it : drops.byChannel)
+                channels.emplace_back(it.second, it.first);
+        }
+        sort(channels.rbegin(), channels.rend());
+
+        string worst;
+        for (size_t i = 0; i < channels.size() && i < 5; ++i)
+            worst += (i ? ", " : "") + channels[i].second + " " + to_string(channels[i].first);
+        if (channels.size() > 5)
+            worst += ", " + to_string(channels.size() - 5) + " more channels";
+
+        fprintf(stderr, "Dropped %zu messages so far (%zu with a full queue, "
+                "%zu over the memory limit, %zu for higher priority channels): %s\n",
+                dropped, drops.full.load(), drops.memory.load(), drops.shed.load(),
+                worst.c_str());
     }
 
     void wakeup()
@@ -486,11 +830,38 @@ static void usage()
             "  -s, --strftime             Format FILE with strftime.\n"
             "  -v, --invert-channels      Invert channels.  Log everything that CHAN\n"
             "                             does not match.\n"
-            "  -m, --max-target-memory    Attempt to limit the total buffer usage to this\n"
-            "                             amount of memory. If specified, ensure that this\n"
-            "                             number is at least as large as the maximum message\n"
-            "                             size you expect to receive. This argument is\n"
-            "                             specified in bytes. Suffixes are not yet supported.\n"
+            "  -m, --max-target-memory    Memory, in bytes, to buffer received messages in\n"
+            "                             while they wait to be written. It is allocated\n"
+            "                             up front and messages that don't fit are\n"
+            "                             dropped, so make sure that this is larger than\n"
+            "                             the largest message you expect to receive.\n"
+            "                             Suffixes are not yet supported.\n"
+            "                             (default: 268435456, i.e. 256MB, at most 32GB)\n"
+            "  -x, --no-index             Don't write a seek index (FILE.zidx) alongside\n"
+            "                             each log file.\n"
+            "  -z, --compress=LEVEL       Write compressed log files at zlib LEVEL (0-9,\n"
+            "                             or -1 for the default). Compression runs in the\n"
+            "                             background and --split-mb counts uncompressed\n"
+            "                             bytes.\n"
+            "  -d, --direct-io            Write log files with O_DIRECT, bypassing the\n"
+            "                             page cache.\n"
+            "  -F, --format=VERSION       Log file format: 1 (the default) or 2, which\n"
+            "                             stores each channel name only once and is\n"
+            "                             smaller for small messages.\n"
+            "  -Q, --queue-size=N         Number of received messages that can wait to be\n"
+            "                             written before new ones are dropped.\n"
+            "                             (default: 16384)\n"
+            "      --decimate=REGEX:N     Only log every Nth message of the channels\n"
+            "                             matching REGEX.  Can be given more than once.\n"
+            "      --max-rate=REGEX:HZ    Log at most HZ messages a second of each channel\n"
+            "                             matching REGEX.  Can be given more than once.\n"
+            "      --priority=REGEX:CLASS Priority class of the channels matching REGEX:\n"
+            "                             low, normal (the default) or high.  When messages\n"
+            "                             arrive faster than they can be written, low\n"
+            "                             priority ones are dropped once the queue or the\n"
+            "                             memory is half full.  If any channel has high\n"
+            "                             priority, normal ones are dropped at 90%%.\n"
+            "                             Can be given more than once.\n"
             "\n"
             "Rotating / splitting log files\n"
             "==============================\n"
@@ -541,10 +912,17 @@ int main(int argc, char *argv[])
     while (!done)
         logger.flushWhenReady();
 
+    // Write out whatever was received before stopping
     zcm_stop(zcm);
+    while (logger.flushWhenReady()) {}
     zcm_flush(zcm);
     zcm_destroy(zcm);
 
+    // Compressed logs still hold their last block and block index
+    logger.finish();
+    if (logger.totalDropped() > 0)
+        logger.reportDrops();
+
     fprintf(stderr, "Logger exiting\n");
 
     return 0;
@@ -2,7 +2,9 @@
 #include <sstream>
 #include <string>
 #include <getopt.h>
+#include <ctype.h>
 #include <atomic>
+#include <thread>
 #include <signal.h>
 #include <unistd.h>
 
@@ -10,6 +12,9 @@
 
 using namespace std;
 
+// Commands published on this channel control playback through the file transport
+#define CONTROL_CHANNEL "ZCM_FILE_CONTROL"
+
 static atomic_int done {0};
 
 static void sighandler(int signal)
@@ -18,13 +23,39 @@ static void sighandler(int signal)
     if (done == 3) exit(1);
 }
 
+// Escapes a url option value, which may contain any character a regex does
+static string urlEscape(const string& str)
+{
+    static const char *hex = "0123456789ABCDEF";
+    string out;
+    for (unsigned char c : str) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            out += c;
+        } else {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        }
+    }
+    return out;
+}
+
 struct Args
 {
-    double speed = 1.0;
+    string speed = "1";
     bool verbose = false;
+    bool interactive = false;
+    bool merge = false;
+    string offsets = "";
+    string channel = "";
+    bool invertChannels = false;
+    string start = "";
+    string end = "";
+    int lockstep = 0;
     string zcmUrlOut = "";
     string filename = "";
     string zcmUrlIn = "";
+    string logStartUrl = "";
 
     bool init(int argc, char *argv[])
     {
@@ -33,15 +64,27 @@ struct Args
             { "speed", required_argument, 0, 's' },
             { "zcm-url", required_argument, 0, 'u' },
             { "verbose", no_argument, 0, 'v' },
+            { "interactive", no_argument, 0, 'i' },
+            { "merge", no_argument, 0, 'm' },
+            { "offsets", required_argument, 0, 'o' },
+            { "channel", required_argument, 0, 'c' },
+            { "invert-channels", no_argument, 0, 'x' },
+            { "start", required_argument, 0, 'b' },
+            { "end", required_argument, 0, 'e' },
+            { "lockstep", optional_argument, 0, 'l' },
             { 0, 0, 0, 0 }
         };
 
         int c;
-        while ((c = getopt_long(argc, argv, "hs:vu:", long_opts, 0)) >= 0)
+        while ((c = getopt_long(argc, argv, "hs:vu:imo:c:", long_opts, 0)) >= 0)
         {
             switch (c) {
                 case 's':
-                    speed = strtod(optarg, NULL);
+                    speed = string(optarg);
+                    if (speed != "max" && strtod(optarg, NULL) <= 0) {
+                        cerr << "Speed must be a positive number or 'max'" << endl;
+                        return false;
+                    }
                     break;
                 case 'u':
                     zcmUrlOut = string(optarg);
@@ -49,23 +92,80 @@ struct Args
                 case 'v':
                     verbose = true;
                     break;
+                case 'i':
+                    interactive = true;
+                    break;
+                case 'm':
+                    merge = true;
+                    break;
+                case 'o':
+                    offsets = string(optarg);
+                    break;
+                case 'c':
+                    channel = string(optarg);
+                    break;
+                case 'x':
+                    invertChannels = true;
+                    break;
+                case 'b':
+                    start = string(optarg);
+                    break;
+                case 'e':
+                    end = string(optarg);
+                    break;
+                case 'l':
+                    lockstep = optarg ? atoi(optarg) : 1;
+                    if (lockstep <= 0) {
+                        cerr << "Lockstep needs a positive number of subscribers" << endl;
+                        return false;
+                    }
+                    break;
                 case 'h':
                 default:
                     return false;
             };
         }
 
-        if (optind != argc - 1) {
+        if (optind >= argc) {
             cerr << "Please specify a logfile" << endl;
             return false;
         }
 
+        if (invertChannels && channel.empty()) {
+            cerr << "--invert-channels requires --channel" << endl;
+            return false;
+        }
+
+        if (!offsets.empty() && !merge) {
+            cerr << "Offsets only apply to merged logs" << endl;
+            return false;
+        }
+
+        // Several files are played one after the other, or merged by timestamp
         filename = string(argv[optind]);
+        for (int i = optind + 1; i < argc; ++i)
+            filename += (merge ? ";" : ",") + string(argv[i]);
 
         std::stringstream ss;
         ss << "file://" << filename << "?speed=" << speed;
+        if (!offsets.empty())
+            ss << "&offsets=" << offsets;
+        // Unwanted events are skipped by the reader, and the start is sought to
+        if (!channel.empty())
+            ss << "&channel=" << urlEscape(channel) << (invertChannels ? "&invert" : "");
+        if (!start.empty())
+            ss << "&start=" << start;
+        if (!end.empty())
+            ss << "&end=" << end;
+        if (lockstep > 0)
+            ss << "&lockstep=" << lockstep;
         zcmUrlIn = ss.str();
 
+        // The same log without the selection, to find where it starts
+        logStartUrl = "file://" + filename + "?speed=max&prefetch=0";
+        if (!offsets.empty())
+            logStartUrl += "&offsets=" + offsets;
+
         return true;
     }
 };
@@ -76,6 +176,13 @@ struct LogPlayer
     zcm::ZCM *zcmIn = nullptr;
     zcm::ZCM *zcmOut = nullptr;
 
+    // Log time of the first event of the log, on any channel, which --start and --end and
+    // the interactive commands count from, and of the last message played
+    int64_t logStart = 0;
+    atomic<int64_t> lastUtime {0};
+    bool paused = false;
+    double speed = 1.0;
+
     LogPlayer() { }
 
     ~LogPlayer()
@@ -101,25 +208,107 @@ struct LogPlayer
             return false;
         }
 
+        if (args.interactive && !findLogStart()) {
+            cerr << "Error: Failed to read the start of '" << args.filename << "'" << endl;
+            return false;
+        }
+
         cout << "Using playback speed " << args.speed << endl;
+        speed = args.speed == "max" ? 0 : strtod(args.speed.c_str(), NULL);
 
         return true;
     }
 
+    // Read through a transport of its own, so that the start is found the same way as
+    // for --start, across split and merged logs
+    bool findLogStart()
+    {
+        zcm::ZCM zcm(args.logStartUrl);
+        if (!zcm.good()) return false;
+        zcm.subscribe(".*", &setLogStart, this);
+        return zcm.handle() == ZCM_EOK;
+    }
+
+    static void setLogStart(const zcm::ReceiveBuffer *rbuf, const string& channel, void *usr)
+    {
+        ((LogPlayer*) usr)->logStart = rbuf->recv_utime;
+    }
+
+    void control(const string& cmd)
+    {
+        zcmIn->publish(CONTROL_CHANNEL, cmd.c_str(), cmd.size());
+    }
+
+    // Reads playback commands from stdin, see usage()
+    void readCommands()
+    {
+        string line;
+        while (!done && getline(cin, line)) {
+            istringstream in(line);
+            string word;
+            double arg = 0;
+            in >> word >> arg;
+
+            if (word.empty() || word == "p") {
+                paused = !paused;
+                control(paused ? "PAUSE" : "PLAY");
+                cout << (paused ? "Paused" : "Playing") << endl;
+            } else if (word == "s") {
+                paused = true;
+                control("STEP");
+            } else if ((word == "+" || word == "-") && speed == 0) {
+                cout << "Playing at max speed, which can't be changed" << endl;
+            } else if (word == "+" || word == "-") {
+                speed = word == "+" ? speed * 2 : speed / 2;
+                control("SPEED " + to_string(speed));
+                cout << "Speed " << speed << endl;
+            } else if (word == "f" || word == "b") {
+                control("SKIP " + to_string(word == "f" ? arg : -arg));
+            } else if (word == "g") {
+                control("SEEK " + to_string(logStart + (int64_t)(arg * 1e6)));
+            } else if (word == "t") {
+                cout << "At " << (lastUtime - logStart) / 1e6 << "s" << endl;
+            } else if (word == "q") {
+                done++;
+            } else {
+                cout << "Unknown command: " << line << endl;
+            }
+        }
+    }
+
     void run()
     {
         zcmIn->subscribe(".*", &handler, this);
 
+        // Subscribers acknowledge lockstep ticks, see zcm/sim_clock.hpp, on the output
+        if (args.lockstep > 0) {
+            zcmOut->subscribe(CONTROL_CHANNEL, &forwardControl, this);
+            zcmOut->start();
+        }
+
         zcmIn->start();
 
+        // Blocks on stdin until the next command, so it can't be joined
+        if (args.interactive)
+            thread(&LogPlayer::readCommands, this).detach();
+
         while (!done) usleep(1e6);
 
         zcmIn->stop();
+        if (args.lockstep > 0)
+            zcmOut->stop();
+    }
+
+    static void forwardControl(const zcm::ReceiveBuffer *rbuf, const string& channel, void *usr)
+    {
+        LogPlayer* lp = (LogPlayer *) usr;
+        lp->zcmIn->publish(CONTROL_CHANNEL, rbuf->data, rbuf->data_size);
     }
 
     static void handler(const zcm::ReceiveBuffer *rbuf, const string& channel, void *usr)
     {
         LogPlayer* lp = (LogPlayer *) usr;
+        lp->lastUtime = rbuf->recv_utime;
         if (lp->args.verbose)
             printf("%.3f Channel %-20s size %d\n", rbuf->recv_utime / 1e6,
                     channel.c_str(), rbuf->data_size);
@@ -129,16 +318,44 @@ struct LogPlayer
 
 void usage(char * cmd)
 {
-    cerr << "usage: zcm-logplayer [options] [FILE]" << endl
+    cerr << "usage: zcm-logplayer [options] FILE..." << endl
          << "" << endl
          << "    Reads packets from an ZCM log file and publishes them to a " << endl
-         << "    ZCM transport." << endl
+         << "    ZCM transport. Several files (e.g. the files of a split or" << endl
+         << "    rotated log) are played as one log, in the order of their" << endl
+         << "    first events. A quoted glob pattern works too." << endl
+         << "" << endl
+         << "    With --merge every FILE is a log recorded at the same time as" << endl
+         << "    the others (e.g. on another host), and their messages are" << endl
+         << "    played in timestamp order. A FILE may still list the files of" << endl
+         << "    one split log, separated by commas." << endl
          << "" << endl
          << "Options:" << endl
          << "" << endl
          << "  -s, --speed=NUM     Playback speed multiplier.  Default is 1." << endl
+         << "                      'max' plays as fast as the output transport allows." << endl
          << "  -u, --zcm-url=URL   Play logged messages on the specified ZCM URL." << endl
          << "  -v, --verbose       Print information about each packet." << endl
+         << "  -i, --interactive   Control playback with commands typed on stdin:" << endl
+         << "                        <enter> or p  pause / resume" << endl
+         << "                        s             step one message" << endl
+         << "                        + or -        double or halve the speed" << endl
+         << "                        f SEC, b SEC  skip forward or back SEC seconds" << endl
+         << "                        g SEC         go to SEC seconds into the log" << endl
+         << "                        t             print the current position" << endl
+         << "                        q             quit" << endl
+         << "  -m, --merge         Merge the logs given by timestamp." << endl
+         << "  -o, --offsets=LIST  Microseconds added to the timestamps of each" << endl
+         << "                      merged log, separated by commas, to correct" << endl
+         << "                      for clocks that disagree (e.g. 0,-1500)." << endl
+         << "  -c, --channel=REGEX Only play the channels matching REGEX." << endl
+         << "  --invert-channels   Play the channels NOT matching --channel." << endl
+         << "  --start=SEC         Start playing SEC seconds into the log." << endl
+         << "  --end=SEC           Stop playing SEC seconds into the log." << endl
+         << "  --lockstep[=NUM]    Play each message only once NUM subscribers" << endl
+         << "                      (default 1) have handled the ones before it," << endl
+         << "                      regardless of the speed. Subscribers follow" << endl
+         << "                      with a zcm::SimClock (zcm/sim_clock.hpp)." << endl
          << "  -h, --help          Shows some help text and exits." << endl
          << endl;
 }
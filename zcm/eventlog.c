@@ -1,10 +1,2169 @@
+#define _GNU_SOURCE // O_DIRECT
 #include "zcm/eventlog.h"
 #include "zcm/util/ioutils.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <regex.h>
+#ifdef USING_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USING_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 #define MAGIC ((int32_t) 0xEDA1DA01L)
 
+// Bytes following the magic: eventnum, timestamp, channellen and datalen
+#define EVENT_HEADER_BYTES (sizeof(int64_t) * 2 + sizeof(int32_t) * 2)
+
+// Bytes of a whole event, magic included
+#define EVENT_BYTES(le) (sizeof(int32_t) + EVENT_HEADER_BYTES + \
+                         (size_t)(le)->channellen + (size_t)(le)->datalen)
+
+// How far ahead of the read cursor the file is asked to be read in, and (for
+// compressed logs) how many blocks
+#define READ_AHEAD_BYTES (8 << 20)
+#define READ_AHEAD_BLOCKS 4
+
+typedef struct _zcm_eventlog_index_t zcm_eventlog_index_t;
+typedef struct _zcm_eventlog_blocks_t zcm_eventlog_blocks_t;
+typedef struct _zcm_eventlog_writer_t zcm_eventlog_writer_t;
+typedef struct _zcm_eventlog_dict_t zcm_eventlog_dict_t;
+typedef struct _zcm_eventlog_filter_t zcm_eventlog_filter_t;
+typedef struct _zcm_eventlog_prefetch_t zcm_eventlog_prefetch_t;
+
+struct _zcm_eventlog_private_t
+{
+    /* In read mode the file is memory mapped when possible, in which case 'mappos'
+     * rather than the position of 'f' is the read cursor */
+    uint8_t *map;
+    size_t   maplen;
+    off_t    mappos;
+    int      mapped;
+    int      mappos_in_file; /* 'f' was handed out, its position is authoritative */
+    off_t    readahead;      /* end of the mapped bytes already asked to be read in */
+    uint8_t *readbuf;        /* backs event views when not mapped */
+    size_t   readbuflen;
+
+    /* Seek index, see zcm_eventlog_enable_index() */
+    char    *path;
+    off_t    writepos;
+    zcm_eventlog_index_t *index;
+
+    /* Block compressed container, see zcm_eventlog_enable_compression() */
+    zcm_eventlog_blocks_t *blocks;
+
+    /* Write buffering, see zcm_eventlog_set_write_buffer() */
+    zcm_eventlog_writer_t *writer;
+
+    /* Channel dictionary of version 2 logs, see zcm_eventlog_set_format() */
+    zcm_eventlog_dict_t *dict;
+
+    /* See zcm_eventlog_set_channel_filter() */
+    zcm_eventlog_filter_t *filter;
+
+    /* See zcm_eventlog_enable_prefetch() */
+    zcm_eventlog_prefetch_t *prefetch;
+};
+
+// Version 2 logs:
+//   "ZCMLOGV2" (8 bytes), version (int32), reserved (int32)
+//   followed by any number of records, each starting on an 8 byte boundary with a fixed
+//   size header:
+//     magic (int32), channel id (int32), eventnum (int64), timestamp (int64),
+//     length (int32), reserved (int32)
+//   and then 'length' bytes, zero padded up to the next 8 byte boundary.
+// Events (V2_EVENT_MAGIC) carry their data and refer to their channel by id. A channel
+// definition (V2_CHANNEL_MAGIC) carries the name of the next unused id and precedes the
+// first event on that channel, whose eventnum and timestamp it repeats.
+// Readers learn definitions lazily, walking the records they haven't looked at yet only
+// when they come across an id they don't know.
+#define V2_MAGIC "ZCMLOGV2"
+#define V2_VERSION 2
+#define V2_FILE_HEADER_BYTES (sizeof(V2_MAGIC) - 1 + sizeof(int32_t) * 2)
+#define V2_HEADER_BYTES 32
+#define V2_EVENT_MAGIC   ((int32_t) 0xEDA1DA02L)
+#define V2_CHANNEL_MAGIC ((int32_t) 0xEDA1DA03L)
+#define V2_CHANNEL_MAXLEN (1 << 16)
+
+// Bytes of a whole record with a 'len' byte payload
+#define V2_RECORD_BYTES(len) (V2_HEADER_BYTES + (((size_t)(len) + 7) & ~(size_t)7))
+
+// Seek index sidecar:
+//   "ZCMLOGIX" (8 bytes), version (int32)
+//   followed by any number of records, each starting with a one byte tag:
+//     'C' channel definition: id (int32), len (int32), *name
+//     'E' index entry:        timestamp (int64), eventnum (int64), offset (int64),
+//                             channel id (int32)
+// Entries appear in log order and always refer to the start of an event's magic.
+// Channel definitions precede the first entry that uses them.
+#define INDEX_MAGIC "ZCMLOGIX"
+#define INDEX_VERSION 1
+
+typedef struct _index_entry_t index_entry_t;
+struct _index_entry_t
+{
+    int64_t timestamp;
+    int64_t eventnum;
+    int64_t offset;
+    int32_t channel;
+};
+
+struct _zcm_eventlog_index_t
+{
+    FILE *f; // Only open when writing
+
+    int64_t stride_events;
+    int64_t stride_usec;
+
+    char   **channels;
+    int32_t  nchannels;
+
+    index_entry_t *entries;
+    size_t nentries;
+    size_t capentries;
+};
+
+static inline int32_t read_be32(const uint8_t *p)
+{
+    return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                     ((uint32_t)p[2] << 8)  | ((uint32_t)p[3]));
+}
+
+static inline int64_t read_be64(const uint8_t *p)
+{
+    return (int64_t)(((uint64_t)(uint32_t)read_be32(p) << 32) | (uint32_t)read_be32(p + 4));
+}
+
+static inline void write_be32(uint8_t *p, int32_t v)
+{
+    p[0] = (uint8_t)((uint32_t)v >> 24);
+    p[1] = (uint8_t)((uint32_t)v >> 16);
+    p[2] = (uint8_t)((uint32_t)v >> 8);
+    p[3] = (uint8_t)((uint32_t)v);
+}
+
+static inline void write_be64(uint8_t *p, int64_t v)
+{
+    write_be32(p, (int32_t)((uint64_t)v >> 32));
+    write_be32(p + 4, (int32_t)(uint64_t)v);
+}
+
+// Maps (or remaps, if it has grown) the file. Returns 0 on success -1 on failure
+static int map_file(zcm_eventlog_t *l)
+{
+    struct stat st;
+    if (fstat(fileno(l->f), &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    size_t len = (size_t)st.st_size;
+    if (l->priv->mapped && len <= l->priv->maplen)
+        return 0;
+
+    uint8_t *map = NULL;
+    if (len > 0) {
+        // Private writable mapping so that callers scribbling on event data can
+        // never modify the log on disk
+        map = (uint8_t*) mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                              fileno(l->f), 0);
+        if (map == MAP_FAILED)
+            return -1;
+        madvise(map, len, l->priv->filter ? MADV_RANDOM : MADV_SEQUENTIAL);
+    }
+
+    if (l->priv->map)
+        munmap(l->priv->map, l->priv->maplen);
+    l->priv->map = map;
+    l->priv->maplen = len;
+    l->priv->mapped = 1;
+    return 0;
+}
+
+// Refreshes the mapping of a log that is still being written.
+// Returns 1 if more bytes became available
+static int map_grow(zcm_eventlog_t *l)
+{
+    size_t oldlen = l->priv->maplen;
+    if (map_file(l) != 0) return 0;
+    return l->priv->maplen > oldlen;
+}
+
+// Has the kernel start reading in the mapped bytes after 'pos', so that reading through
+// the log doesn't stall on every page fault. Only does so once the window runs low
+static void map_read_ahead(zcm_eventlog_t *l, off_t pos)
+{
+    if (pos + READ_AHEAD_BYTES / 2 <= l->priv->readahead && pos >= l->priv->readahead - 2 * READ_AHEAD_BYTES)
+        return;
+
+    off_t start = (pos < l->priv->readahead && l->priv->readahead - pos < READ_AHEAD_BYTES) ?
+                  l->priv->readahead : pos;
+    off_t end = pos + READ_AHEAD_BYTES;
+    if (end > (off_t)l->priv->maplen) end = l->priv->maplen;
+    start &= ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    if (end > start)
+        madvise(l->priv->map + start, end - start, MADV_WILLNEED);
+    l->priv->readahead = end;
+}
+
+static void index_destroy(zcm_eventlog_index_t *idx)
+{
+    int32_t i;
+    if (idx->f)
+        fclose(idx->f);
+    for (i = 0; i < idx->nchannels; ++i)
+        free(idx->channels[i]);
+    free(idx->channels);
+    free(idx->entries);
+    free(idx);
+}
+
+static int index_add_channel(zcm_eventlog_index_t *idx, const char *name, int32_t len)
+{
+    char **channels = (char**) realloc(idx->channels, (idx->nchannels + 1) * sizeof(char*));
+    if (!channels) return -1;
+    idx->channels = channels;
+    idx->channels[idx->nchannels] = (char*) calloc(1, len + 1);
+    if (!idx->channels[idx->nchannels]) return -1;
+    memcpy(idx->channels[idx->nchannels], name, len);
+    return idx->nchannels++;
+}
+
+static int index_add_entry(zcm_eventlog_index_t *idx, const index_entry_t *e)
+{
+    if (idx->nentries == idx->capentries) {
+        size_t cap = idx->capentries ? idx->capentries * 2 : 1024;
+        index_entry_t *entries = (index_entry_t*) realloc(idx->entries, cap * sizeof(*e));
+        if (!entries) return -1;
+        idx->entries = entries;
+        idx->capentries = cap;
+    }
+    idx->entries[idx->nentries++] = *e;
+    return 0;
+}
+
+static char *index_path(const char *path)
+{
+    char *ret = (char*) malloc(strlen(path) + sizeof(ZCM_EVENTLOG_INDEX_SUFFIX));
+    if (ret) {
+        strcpy(ret, path);
+        strcat(ret, ZCM_EVENTLOG_INDEX_SUFFIX);
+    }
+    return ret;
+}
+
+// Loads the sidecar of a log being read. Everything up to the first malformed
+// record (e.g. from a writer that died) is kept
+static zcm_eventlog_index_t *index_load(const char *path)
+{
+    char *ipath = index_path(path);
+    FILE *f = ipath ? fopen(ipath, "rb") : NULL;
+    free(ipath);
+    if (!f) return NULL;
+
+    char magic[sizeof(INDEX_MAGIC) - 1];
+    int32_t version;
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+        fread32(f, &version) != 0 || version != INDEX_VERSION) {
+        fclose(f);
+        return NULL;
+    }
+
+    zcm_eventlog_index_t *idx =
+        (zcm_eventlog_index_t*) calloc(1, sizeof(zcm_eventlog_index_t));
+
+    int tag;
+    while ((tag = fgetc(f)) != EOF) {
+        if (tag == 'C') {
+            int32_t id, len;
+            char name[1000];
+            if (fread32(f, &id) || fread32(f, &len)) break;
+            if (id != idx->nchannels || len <= 0 || len >= (int32_t)sizeof(name)) break;
+            if (fread(name, 1, len, f) != (size_t)len) break;
+            if (index_add_channel(idx, name, len) < 0) break;
+        } else if (tag == 'E') {
+            index_entry_t e;
+            if (fread64(f, &e.timestamp) || fread64(f, &e.eventnum) ||
+                fread64(f, &e.offset) || fread32(f, &e.channel)) break;
+            if (e.channel < 0 || e.channel >= idx->nchannels) break;
+            if (idx->nentries > 0) {
+                const index_entry_t *last = &idx->entries[idx->nentries - 1];
+                if (e.eventnum <= last->eventnum || e.offset <= last->offset) break;
+            }
+            if (index_add_entry(idx, &e) != 0) break;
+        } else {
+            break;
+        }
+    }
+    fclose(f);
+
+    if (idx->nentries == 0) {
+        index_destroy(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+int zcm_eventlog_enable_index(zcm_eventlog_t *l, int64_t stride_events, int64_t stride_usec)
+{
+    // Event numbers restart when appending to an existing log, so it can't be indexed
+    if (l->priv->index || l->priv->blocks || !l->priv->writer || l->eventcount != 0 || !l->priv->path ||
+        l->priv->writepos != (l->priv->dict ? (off_t)V2_FILE_HEADER_BYTES : 0))
+        return -1;
+
+    char *ipath = index_path(l->priv->path);
+    FILE *f = ipath ? fopen(ipath, "wb") : NULL;
+    free(ipath);
+    if (!f) return -1;
+
+    if (fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC) - 1, f) != sizeof(INDEX_MAGIC) - 1 ||
+        fwrite32(f, INDEX_VERSION) != 0) {
+        fclose(f);
+        return -1;
+    }
+
+    l->priv->index = (zcm_eventlog_index_t*) calloc(1, sizeof(zcm_eventlog_index_t));
+    l->priv->index->f = f;
+    l->priv->index->stride_events = stride_events;
+    l->priv->index->stride_usec = stride_usec;
+    return 0;
+}
+
+// Called for every event written. Only entries actually written to the sidecar
+// are remembered
+static int index_event(zcm_eventlog_index_t *idx, const zcm_eventlog_event_t *le, off_t offset)
+{
+    if (idx->nentries > 0) {
+        const index_entry_t *last = &idx->entries[idx->nentries - 1];
+        int due = (idx->stride_events > 0 &&
+                   le->eventnum - last->eventnum >= idx->stride_events) ||
+                  (idx->stride_usec > 0 &&
+                   le->timestamp - last->timestamp >= idx->stride_usec);
+        if (!due) return 0;
+    }
+
+    index_entry_t e;
+    e.timestamp = le->timestamp;
+    e.eventnum = le->eventnum;
+    e.offset = offset;
+
+    // Channels are only looked up when an entry is due, so a linear search is fine
+    for (e.channel = 0; e.channel < idx->nchannels; ++e.channel) {
+        if ((int32_t)strlen(idx->channels[e.channel]) == le->channellen &&
+            memcmp(idx->channels[e.channel], le->channel, le->channellen) == 0)
+            break;
+    }
+    if (e.channel == idx->nchannels) {
+        if (index_add_channel(idx, le->channel, le->channellen) < 0) return -1;
+        if (fputc('C', idx->f) == EOF ||
+            fwrite32(idx->f, e.channel) != 0 ||
+            fwrite32(idx->f, le->channellen) != 0 ||
+            fwrite(le->channel, 1, le->channellen, idx->f) != (size_t)le->channellen)
+            return -1;
+    }
+
+    if (fputc('E', idx->f) == EOF ||
+        fwrite64(idx->f, e.timestamp) != 0 ||
+        fwrite64(idx->f, e.eventnum) != 0 ||
+        fwrite64(idx->f, e.offset) != 0 ||
+        fwrite32(idx->f, e.channel) != 0)
+        return -1;
+
+    // Only the last entry is needed to decide when the next is due
+    idx->nentries = 0;
+    return index_add_entry(idx, &e);
+}
+
+static int check_event_lengths(const zcm_eventlog_event_t *le)
+{
+    // Sanity check the channel length and data length
+    if (le->channellen <= 0 || le->channellen >= 1000) {
+        fprintf(stderr, "Log event has invalid channel length: %d\n", le->channellen);
+        return -1;
+    }
+    if (le->datalen < 0) {
+        fprintf(stderr, "Log event has invalid data length: %d\n", le->datalen);
+        return -1;
+    }
+    return 0;
+}
+
+// Serializes an event, magic included, the way it is laid out in a log
+static void put_event(uint8_t *p, const zcm_eventlog_event_t *le)
+{
+    write_be32(p,      MAGIC);
+    write_be64(p + 4,  le->eventnum);
+    write_be64(p + 12, le->timestamp);
+    write_be32(p + 20, le->channellen);
+    write_be32(p + 24, le->datalen);
+    p += sizeof(int32_t) + EVENT_HEADER_BYTES;
+    memcpy(p, le->channel, le->channellen);
+    memcpy(p + le->channellen, le->data, le->datalen);
+}
+
+/**** Buffered writing ****/
+// Writers serialize events into a buffer that is written out with pwrite() once full.
+// With ZCM_EVENTLOG_WRITE_ASYNC filled buffers are written out while the next one is
+// being filled: through io_uring, which keeps up to WRITE_URING_DEPTH writes in flight,
+// or, where that isn't available, with two buffers and a thread writing one out. With ZCM_EVENTLOG_WRITE_DIRECT only whole aligned blocks
+// go through O_DIRECT; a partial block left at a flush goes through the page cache and
+// is written again, directly, once it fills up.
+#define WRITE_ALIGN (4096)
+#define WRITE_BUFFER_DEFAULT (64 * 1024)
+#define WRITE_URING_DEPTH (4)
+
+typedef struct _uring_t uring_t;
+
+struct _zcm_eventlog_writer_t
+{
+    int      fd;
+    int      flags;
+    off_t    filepos;     // Where the buffer being filled starts in the file
+    uint8_t *bufs[WRITE_URING_DEPTH];
+    int      nbufs;
+    size_t   cap;         // Of each buffer, a multiple of WRITE_ALIGN
+    int      active;      // Buffer being filled
+    size_t   len;
+    int      error;       // errno of the first failed write, every later write fails
+    uint64_t waits;       // Times the disk was behind
+
+    /* ZCM_EVENTLOG_WRITE_ASYNC */
+    int      running;
+    int      quit;
+    uint8_t *pendbuf;     // Being written out by 'thread'
+    size_t   pendlen;
+    off_t    pendpos;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    /* ZCM_EVENTLOG_WRITE_ASYNC through io_uring */
+    uring_t *uring;
+    size_t   inflight[WRITE_URING_DEPTH];    // Bytes of each buffer being written
+    off_t    inflightpos[WRITE_URING_DEPTH];
+    int      ninflight;
+};
+
+static size_t align_up(size_t n)
+{
+    return (n + WRITE_ALIGN - 1) & ~(size_t)(WRITE_ALIGN - 1);
+}
+
+static int pwrite_all(int fd, const uint8_t *buf, size_t len, off_t pos)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        buf += n;
+        len -= n;
+        pos += n;
+    }
+    return 0;
+}
+
+#ifdef USING_URING
+// Just enough of io_uring to keep a few writes in flight, without needing liburing
+struct _uring_t
+{
+    int       fd;
+    uint8_t  *sqring;
+    size_t    sqringlen;
+    uint8_t  *cqring;
+    size_t    cqringlen;
+    struct io_uring_sqe *sqes;
+    size_t    sqeslen;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+};
+
+static void uring_destroy(uring_t *u)
+{
+    if (u->sqes)
+        munmap(u->sqes, u->sqeslen);
+    if (u->cqring && u->cqring != u->sqring)
+        munmap(u->cqring, u->cqringlen);
+    if (u->sqring)
+        munmap(u->sqring, u->sqringlen);
+    close(u->fd);
+    free(u);
+}
+
+static void *uring_map(int fd, size_t len, off_t what)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, what);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Returns NULL if the kernel doesn't support io_uring (or IORING_OP_WRITE)
+static uring_t *uring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return NULL;
+
+    uring_t *u = (uring_t*) calloc(1, sizeof(uring_t));
+    if (!u) {
+        close(fd);
+        return NULL;
+    }
+    u->fd = fd;
+
+    // IORING_OP_WRITE came along with IORING_FEAT_RW_CUR_POS
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        uring_destroy(u);
+        return NULL;
+    }
+
+    u->sqringlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqringlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && u->cqringlen > u->sqringlen)
+        u->sqringlen = u->cqringlen;
+    u->sqring = (uint8_t*) uring_map(fd, u->sqringlen, IORING_OFF_SQ_RING);
+    if (u->sqring && (p.features & IORING_FEAT_SINGLE_MMAP))
+        u->cqring = u->sqring;
+    else if (u->sqring)
+        u->cqring = (uint8_t*) uring_map(fd, u->cqringlen, IORING_OFF_CQ_RING);
+    u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*) uring_map(fd, u->sqeslen, IORING_OFF_SQES);
+    if (!u->sqring || !u->cqring || !u->sqes) {
+        uring_destroy(u);
+        return NULL;
+    }
+
+    u->sqhead  = (unsigned*) (u->sqring + p.sq_off.head);
+    u->sqtail  = (unsigned*) (u->sqring + p.sq_off.tail);
+    u->sqmask  = (unsigned*) (u->sqring + p.sq_off.ring_mask);
+    u->sqarray = (unsigned*) (u->sqring + p.sq_off.array);
+    u->cqhead  = (unsigned*) (u->cqring + p.cq_off.head);
+    u->cqtail  = (unsigned*) (u->cqring + p.cq_off.tail);
+    u->cqmask  = (unsigned*) (u->cqring + p.cq_off.ring_mask);
+    u->cqes    = (struct io_uring_cqe*) (u->cqring + p.cq_off.cqes);
+    return u;
+}
+
+// Starts writing 'len' bytes at 'pos'. Returns an errno on failure
+static int uring_write(uring_t *u, int fd, const uint8_t *buf, size_t len, off_t pos,
+                       uint64_t tag)
+{
+    unsigned tail = *u->sqtail;
+    unsigned i = tail & *u->sqmask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t) buf;
+    sqe->len = len < (1u << 30) ? len : (1u << 30); // The rest is finished off as a short write
+    sqe->off = pos;
+    sqe->user_data = tag;
+    u->sqarray[i] = i;
+    __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) return errno;
+    }
+    return 0;
+}
+
+// Takes the next completed write, waiting for one if 'wait' is set.
+// Returns EAGAIN if there was none, or an errno on failure
+static int uring_reap(uring_t *u, int wait, uint64_t *tag, int32_t *res)
+{
+    while (1) {
+        unsigned head = *u->cqhead;
+        if (head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &u->cqes[head & *u->cqmask];
+            *tag = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (!wait) return EAGAIN;
+        if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR)
+            return errno;
+    }
+}
+#else
+static uring_t *uring_create(unsigned entries) { return NULL; }
+static void uring_destroy(uring_t *u) {}
+static int uring_write(uring_t *u, int fd, const uint8_t *buf, size_t len, off_t pos,
+                       uint64_t tag) { return ENOSYS; }
+static int uring_reap(uring_t *u, int wait, uint64_t *tag, int32_t *res) { return ENOSYS; }
+#endif
+
+// Handles one finished io_uring write, waiting for it if 'wait' is set.
+// Returns 0 if there was one
+static int writer_reap(zcm_eventlog_writer_t *w, int wait)
+{
+    uint64_t i = 0;
+    int32_t res = 0;
+    int err = uring_reap(w->uring, wait, &i, &res);
+    if (err) {
+        if (err != EAGAIN) {
+            // Nothing more will complete
+            if (!w->error) w->error = err;
+            memset(w->inflight, 0, sizeof(w->inflight));
+            w->ninflight = 0;
+        }
+        return err;
+    }
+
+    if (res < 0)
+        err = -res;
+    else if ((size_t)res < w->inflight[i])
+        err = pwrite_all(w->fd, w->bufs[i] + res, w->inflight[i] - res, w->inflightpos[i] + res);
+    if (err && !w->error) w->error = err;
+    w->inflight[i] = 0;
+    w->ninflight--;
+    return 0;
+}
+
+static void *writer_thread(void *usr)
+{
+    zcm_eventlog_writer_t *w = (zcm_eventlog_writer_t*) usr;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (w->pendlen == 0 && !w->quit)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->pendlen == 0) break;
+
+        pthread_mutex_unlock(&w->lock);
+        int err = pwrite_all(w->fd, w->pendbuf, w->pendlen, w->pendpos);
+        pthread_mutex_lock(&w->lock);
+
+        if (err && !w->error) w->error = err;
+        w->pendlen = 0;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Waits for the background write, if any. Returns the errno of a failed write or 0
+static int writer_wait(zcm_eventlog_writer_t *w)
+{
+    if (w->uring) {
+        if (w->ninflight > 0)
+            w->waits++;
+        while (w->ninflight > 0 && writer_reap(w, 1) == 0) {}
+        return w->error;
+    }
+    if (!w->running) return w->error;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->pendlen > 0)
+        w->waits++;
+    while (w->pendlen > 0)
+        pthread_cond_wait(&w->cond, &w->lock);
+    int err = w->error;
+    pthread_mutex_unlock(&w->lock);
+    return err;
+}
+
+// Writes out the first 'n' bytes of the buffer being filled, keeping the rest
+static int writer_commit(zcm_eventlog_writer_t *w, size_t n)
+{
+    if (w->uring) {
+        // The next buffer to fill is the one handed to the kernel longest ago
+        int next = (w->active + 1) % w->nbufs;
+        if (w->inflight[next] > 0)
+            w->waits++;
+        while (w->inflight[next] > 0 && writer_reap(w, 1) == 0) {}
+        while (w->ninflight > 0 && writer_reap(w, 0) == 0) {}
+        if (w->error || n == 0) return w->error;
+
+        uint8_t *buf = w->bufs[w->active];
+        memcpy(w->bufs[next], buf + n, w->len - n);
+        int err = uring_write(w->uring, w->fd, buf, n, w->filepos, w->active);
+        if (err) {
+            w->error = err;
+            return err;
+        }
+        w->inflight[w->active] = n;
+        w->inflightpos[w->active] = w->filepos;
+        w->ninflight++;
+        w->active = next;
+        w->filepos += n;
+        w->len -= n;
+        return 0;
+    }
+
+    int err = writer_wait(w);
+    if (err || n == 0) return err;
+
+    uint8_t *buf = w->bufs[w->active];
+    if (w->running) {
+        memcpy(w->bufs[!w->active], buf + n, w->len - n);
+        pthread_mutex_lock(&w->lock);
+        w->pendbuf = buf;
+        w->pendlen = n;
+        w->pendpos = w->filepos;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        w->active = !w->active;
+    } else {
+        err = pwrite_all(w->fd, buf, n, w->filepos);
+        if (err) {
+            w->error = err;
+            return err;
+        }
+        memmove(buf, buf + n, w->len - n);
+    }
+    w->filepos += n;
+    w->len -= n;
+    return 0;
+}
+
+// Bytes of the buffer being filled that can be written out
+static size_t writer_committable(const zcm_eventlog_writer_t *w)
+{
+    return (w->flags & ZCM_EVENTLOG_WRITE_DIRECT) ? w->len & ~(size_t)(WRITE_ALIGN - 1) : w->len;
+}
+
+// Makes room for 'need' more bytes in the buffer being filled
+static int writer_reserve(zcm_eventlog_writer_t *w, size_t need)
+{
+    if (w->len + need <= w->cap) return 0;
+
+    int err = writer_commit(w, writer_committable(w));
+    if (err) return err;
+    if (w->len + need <= w->cap) return 0;
+
+    // Larger than a whole buffer, grow them
+    err = writer_wait(w);
+    if (err) return err;
+    size_t cap = align_up(w->len + need);
+    int i;
+    for (i = 0; i < w->nbufs; ++i) {
+        void *buf;
+        if (posix_memalign(&buf, WRITE_ALIGN, cap) != 0)
+            return ENOMEM;
+        if (i == w->active)
+            memcpy(buf, w->bufs[i], w->len);
+        free(w->bufs[i]);
+        w->bufs[i] = (uint8_t*) buf;
+    }
+    w->cap = cap;
+    return 0;
+}
+
+static int writer_write(zcm_eventlog_writer_t *w, const void *data, size_t len)
+{
+    int err = writer_reserve(w, len);
+    if (err) return err;
+    memcpy(w->bufs[w->active] + w->len, data, len);
+    w->len += len;
+    return 0;
+}
+
+// Hands everything buffered to the OS
+static int writer_flush(zcm_eventlog_writer_t *w)
+{
+    int err = writer_commit(w, writer_committable(w));
+    if (!err) err = writer_wait(w);
+    if (err || w->len == 0) return err;
+
+#ifdef O_DIRECT
+    // What's left is a partial block that O_DIRECT can't write
+    int fl = fcntl(w->fd, F_GETFL);
+    if (fl < 0 || fcntl(w->fd, F_SETFL, fl & ~O_DIRECT) != 0) {
+        err = errno;
+    } else {
+        err = pwrite_all(w->fd, w->bufs[w->active], w->len, w->filepos);
+        if (fcntl(w->fd, F_SETFL, fl) != 0 && !err)
+            err = errno;
+    }
+    if (err) w->error = err;
+#endif
+    return err;
+}
+
+// Hands what's buffered to the background writes unless they are all still busy, in which
+// case a later call does. Never waits. Returns the errno of a failed write or 0
+static int writer_flush_async(zcm_eventlog_writer_t *w)
+{
+    if (w->uring) {
+        while (w->ninflight > 0 && writer_reap(w, 0) == 0) {}
+        if (w->inflight[(w->active + 1) % w->nbufs] > 0) return w->error;
+    } else if (w->running) {
+        pthread_mutex_lock(&w->lock);
+        int busy = w->pendlen > 0;
+        pthread_mutex_unlock(&w->lock);
+        if (busy) return w->error;
+    }
+    return writer_commit(w, writer_committable(w));
+}
+
+static void writer_stop(zcm_eventlog_writer_t *w)
+{
+    if (!w->running) return;
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    w->running = 0;
+}
+
+// Flushes and frees the writer. Returns the errno of a failed write or 0
+static int writer_destroy(zcm_eventlog_writer_t *w)
+{
+    int err = writer_flush(w);
+    writer_stop(w);
+    if (w->uring) {
+        writer_wait(w);
+        uring_destroy(w->uring);
+    }
+#ifdef O_DIRECT
+    if (w->flags & ZCM_EVENTLOG_WRITE_DIRECT) {
+        int fl = fcntl(w->fd, F_GETFL);
+        if (fl >= 0) fcntl(w->fd, F_SETFL, fl & ~O_DIRECT);
+    }
+#endif
+    int i;
+    for (i = 0; i < w->nbufs; ++i)
+        free(w->bufs[i]);
+    free(w);
+    return err;
+}
+
+static zcm_eventlog_writer_t *writer_create(int fd, off_t filepos, size_t cap, int flags)
+{
+#ifndef O_DIRECT
+    if (flags & ZCM_EVENTLOG_WRITE_DIRECT) return NULL;
+#endif
+    if ((flags & ZCM_EVENTLOG_WRITE_DIRECT) && filepos % WRITE_ALIGN != 0)
+        return NULL;
+
+    zcm_eventlog_writer_t *w = (zcm_eventlog_writer_t*) calloc(1, sizeof(zcm_eventlog_writer_t));
+    if (!w) return NULL;
+    w->fd = fd;
+    w->flags = flags;
+    w->filepos = filepos;
+    w->cap = align_up(cap ? cap : 1);
+
+    int nbufs = 1;
+    if (flags & ZCM_EVENTLOG_WRITE_ASYNC) {
+        w->uring = uring_create(WRITE_URING_DEPTH);
+        nbufs = w->uring ? WRITE_URING_DEPTH : 2;
+    }
+    for (w->nbufs = 0; w->nbufs < nbufs; ++w->nbufs) {
+        void *buf;
+        if (posix_memalign(&buf, WRITE_ALIGN, w->cap) != 0) {
+            writer_destroy(w);
+            return NULL;
+        }
+        w->bufs[w->nbufs] = (uint8_t*) buf;
+    }
+
+    // Writes go to explicit offsets, which O_APPEND would override
+    int fl = fcntl(fd, F_GETFL);
+    int newfl = fl & ~O_APPEND;
+#ifdef O_DIRECT
+    if (flags & ZCM_EVENTLOG_WRITE_DIRECT)
+        newfl |= O_DIRECT;
+#endif
+    if (fl < 0 || (newfl != fl && fcntl(fd, F_SETFL, newfl) != 0)) {
+        writer_destroy(w);
+        return NULL;
+    }
+
+    if ((flags & ZCM_EVENTLOG_WRITE_ASYNC) && !w->uring) {
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+            pthread_mutex_destroy(&w->lock);
+            pthread_cond_destroy(&w->cond);
+            writer_destroy(w);
+            return NULL;
+        }
+        w->running = 1;
+    }
+    return w;
+}
+
+/**** Version 2 logs ****/
+struct _zcm_eventlog_dict_t
+{
+    char   **names;       // By id, NUL terminated
+    int32_t *lens;
+    int32_t  nnames;
+    int32_t  capnames;
+
+    /* Writing: ids by name, open addressed, -1 where empty */
+    int32_t *table;
+    size_t   tablecap;    // A power of 2
+
+    /* Reading: the definitions before this offset have been learned */
+    off_t    scanpos;
+};
+
+static void dict_destroy(zcm_eventlog_dict_t *d)
+{
+    int32_t i;
+    for (i = 0; i < d->nnames; ++i)
+        free(d->names[i]);
+    free(d->names);
+    free(d->lens);
+    free(d->table);
+    free(d);
+}
+
+static zcm_eventlog_dict_t *dict_create(int writing)
+{
+    zcm_eventlog_dict_t *d = (zcm_eventlog_dict_t*) calloc(1, sizeof(zcm_eventlog_dict_t));
+    if (!d) return NULL;
+    d->scanpos = V2_FILE_HEADER_BYTES;
+    if (writing) {
+        d->tablecap = 64;
+        d->table = (int32_t*) malloc(d->tablecap * sizeof(int32_t));
+        if (!d->table) {
+            dict_destroy(d);
+            return NULL;
+        }
+        memset(d->table, 0xff, d->tablecap * sizeof(int32_t));
+    }
+    return d;
+}
+
+static uint32_t dict_hash(const char *name, int32_t len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    int32_t i;
+    for (i = 0; i < len; ++i)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+// Returns the id of a channel, or -1 if it hasn't been defined. Writing only
+static int32_t dict_find(const zcm_eventlog_dict_t *d, const char *name, int32_t len)
+{
+    size_t i = dict_hash(name, len) & (d->tablecap - 1);
+    while (d->table[i] >= 0) {
+        int32_t id = d->table[i];
+        if (d->lens[id] == len && memcmp(d->names[id], name, len) == 0)
+            return id;
+        i = (i + 1) & (d->tablecap - 1);
+    }
+    return -1;
+}
+
+static void dict_insert(zcm_eventlog_dict_t *d, int32_t id)
+{
+    size_t i = dict_hash(d->names[id], d->lens[id]) & (d->tablecap - 1);
+    while (d->table[i] >= 0)
+        i = (i + 1) & (d->tablecap - 1);
+    d->table[i] = id;
+}
+
+// Gives a channel the next id. Returns the id or -1 on failure
+static int32_t dict_add(zcm_eventlog_dict_t *d, const char *name, int32_t len)
+{
+    if (d->nnames == d->capnames) {
+        int32_t cap = d->capnames ? d->capnames * 2 : 16;
+        char **names = (char**) realloc(d->names, cap * sizeof(char*));
+        if (!names) return -1;
+        d->names = names;
+        int32_t *lens = (int32_t*) realloc(d->lens, cap * sizeof(int32_t));
+        if (!lens) return -1;
+        d->lens = lens;
+        d->capnames = cap;
+    }
+
+    // Keep the table at most half full
+    if (d->table && (size_t)(d->nnames + 1) * 2 > d->tablecap) {
+        int32_t *table = (int32_t*) malloc(d->tablecap * 2 * sizeof(int32_t));
+        if (!table) return -1;
+        free(d->table);
+        d->table = table;
+        d->tablecap *= 2;
+        memset(d->table, 0xff, d->tablecap * sizeof(int32_t));
+        int32_t i;
+        for (i = 0; i < d->nnames; ++i)
+            dict_insert(d, i);
+    }
+
+    char *copy = (char*) malloc(len + 1);
+    if (!copy) return -1;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    int32_t id = d->nnames++;
+    d->names[id] = copy;
+    d->lens[id] = len;
+    if (d->table)
+        dict_insert(d, id);
+    return id;
+}
+
+// Copies 'len' bytes at 'pos' of a log. Returns 0 on success -1 on failure
+static int read_at(zcm_eventlog_t *l, off_t pos, void *buf, size_t len)
+{
+    if (l->priv->mapped && (pos + (off_t)len <= (off_t)l->priv->maplen ||
+                      (map_grow(l) && pos + (off_t)len <= (off_t)l->priv->maplen))) {
+        memcpy(buf, l->priv->map + pos, len);
+        return 0;
+    }
+    return pread(fileno(l->f), buf, len, pos) == (ssize_t)len ? 0 : -1;
+}
+
+// Learns the channel definitions between where the last call stopped and 'upto'
+// Returns 0 on success -1 if the records there are unreadable
+static int dict_learn(zcm_eventlog_t *l, off_t upto)
+{
+    zcm_eventlog_dict_t *d = l->priv->dict;
+    while (d->scanpos < upto) {
+        uint8_t hdr[V2_HEADER_BYTES];
+        if (read_at(l, d->scanpos, hdr, sizeof(hdr)) != 0)
+            return -1;
+        int32_t magic = read_be32(hdr);
+        int32_t len = read_be32(hdr + 24);
+        if ((magic != V2_EVENT_MAGIC && magic != V2_CHANNEL_MAGIC) || len < 0)
+            return -1;
+        if (magic == V2_CHANNEL_MAGIC && read_be32(hdr + 4) == d->nnames) {
+            if (len == 0 || len > V2_CHANNEL_MAXLEN)
+                return -1;
+            char *name = (char*) malloc(len);
+            int ok = name && read_at(l, d->scanpos + V2_HEADER_BYTES, name, len) == 0 &&
+                     dict_add(d, name, len) >= 0;
+            free(name);
+            if (!ok) return -1;
+        }
+        d->scanpos += V2_RECORD_BYTES(len);
+    }
+    return 0;
+}
+
+// Looks up the channel of the event whose record starts at 'pos'
+static int dict_channel(zcm_eventlog_t *l, int32_t id, off_t pos, zcm_eventlog_event_t *le)
+{
+    zcm_eventlog_dict_t *d = l->priv->dict;
+    if (id >= d->nnames && id >= 0)
+        dict_learn(l, pos);
+    if (id < 0 || id >= d->nnames) {
+        fprintf(stderr, "Log event has unknown channel id: %d\n", id);
+        return -1;
+    }
+    le->channel = d->names[id];
+    le->channellen = d->lens[id];
+    return 0;
+}
+
+static void v2_put_record(uint8_t *p, int32_t magic, int32_t id, const zcm_eventlog_event_t *le,
+                          const void *payload, int32_t len)
+{
+    write_be32(p,      magic);
+    write_be32(p + 4,  id);
+    write_be64(p + 8,  le->eventnum);
+    write_be64(p + 16, le->timestamp);
+    write_be32(p + 24, len);
+    write_be32(p + 28, 0);
+    memcpy(p + V2_HEADER_BYTES, payload, len);
+    memset(p + V2_HEADER_BYTES + len, 0, V2_RECORD_BYTES(len) - V2_HEADER_BYTES - len);
+}
+
+// Writes an event, defining its channel first if needed. 'offset' is set to where the
+// event itself starts. Returns the errno of a failure or 0
+static int v2_write_event(zcm_eventlog_t *l, const zcm_eventlog_event_t *le, off_t *offset)
+{
+    zcm_eventlog_writer_t *w = l->priv->writer;
+    int32_t id = dict_find(l->priv->dict, le->channel, le->channellen);
+    size_t deflen = 0;
+    if (id < 0) {
+        if (le->channellen <= 0 || le->channellen > V2_CHANNEL_MAXLEN)
+            return EINVAL;
+        deflen = V2_RECORD_BYTES(le->channellen);
+    }
+    size_t len = deflen + V2_RECORD_BYTES(le->datalen);
+    int err = writer_reserve(w, len);
+    if (err) return err;
+
+    uint8_t *p = w->bufs[w->active] + w->len;
+    if (id < 0) {
+        id = dict_add(l->priv->dict, le->channel, le->channellen);
+        if (id < 0) return ENOMEM;
+        v2_put_record(p, V2_CHANNEL_MAGIC, id, le, le->channel, le->channellen);
+    }
+    v2_put_record(p + deflen, V2_EVENT_MAGIC, id, le, le->data, le->datalen);
+    w->len += len;
+
+    *offset = l->priv->writepos + deflen;
+    l->priv->writepos += len;
+    return 0;
+}
+
+int zcm_eventlog_set_format(zcm_eventlog_t *l, int format)
+{
+    if (!l->priv->writer || l->priv->blocks)
+        return -1;
+    if (format == (l->priv->dict ? ZCM_EVENTLOG_FORMAT_V2 : ZCM_EVENTLOG_FORMAT_V1))
+        return 0;
+    if (format != ZCM_EVENTLOG_FORMAT_V2 || l->eventcount != 0 || l->priv->writepos != 0 || l->priv->index)
+        return -1;
+
+    uint8_t hdr[V2_FILE_HEADER_BYTES];
+    memcpy(hdr, V2_MAGIC, sizeof(V2_MAGIC) - 1);
+    write_be32(hdr + sizeof(V2_MAGIC) - 1, V2_VERSION);
+    write_be32(hdr + sizeof(V2_MAGIC) - 1 + sizeof(int32_t), 0);
+    l->priv->dict = dict_create(1);
+    if (!l->priv->dict) return -1;
+    if (writer_write(l->priv->writer, hdr, sizeof(hdr)) != 0) {
+        dict_destroy(l->priv->dict);
+        l->priv->dict = NULL;
+        return -1;
+    }
+    l->priv->writepos = sizeof(hdr);
+    return 0;
+}
+
+// Sets up reading (or appending to) a log if it is a version 2 log. Returns 1 if it is,
+// 0 if it isn't and -1 if it is but its version is not supported
+static int v2_open(zcm_eventlog_t *l, int writing)
+{
+    uint8_t hdr[V2_FILE_HEADER_BYTES];
+    if (pread(fileno(l->f), hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr, V2_MAGIC, sizeof(V2_MAGIC) - 1) != 0)
+        return 0;
+    if (read_be32(hdr + sizeof(V2_MAGIC) - 1) != V2_VERSION)
+        return -1;
+    l->priv->dict = dict_create(writing);
+    return l->priv->dict ? 1 : -1;
+}
+
+// Version 2 records are aligned, so only every 8th byte can start one. Channel
+// definitions the scan lands on are skipped whole
+static int v2_sync_stream(zcm_eventlog_t *l)
+{
+    off_t pos = l->priv->mapped ? l->priv->mappos : ftello(l->f);
+    pos = (pos + 7) & ~(off_t)7;
+    if (pos < (off_t)V2_FILE_HEADER_BYTES)
+        pos = V2_FILE_HEADER_BYTES;
+
+    if (l->priv->mapped) {
+        do {
+            while (pos + V2_HEADER_BYTES <= (off_t)l->priv->maplen) {
+                int32_t magic = read_be32(l->priv->map + pos);
+                if (magic == V2_EVENT_MAGIC) {
+                    l->priv->mappos = pos + 4;
+                    return 0;
+                }
+                int32_t len = read_be32(l->priv->map + pos + 24);
+                if (magic == V2_CHANNEL_MAGIC && len > 0 && len <= V2_CHANNEL_MAXLEN)
+                    pos += V2_RECORD_BYTES(len);
+                else
+                    pos += 8;
+            }
+        } while (map_grow(l));
+        l->priv->mappos = pos;
+        return -1;
+    }
+
+    uint8_t hdr[V2_HEADER_BYTES];
+    while (fseeko(l->f, pos, SEEK_SET) == 0 && fread(hdr, 1, sizeof(hdr), l->f) == sizeof(hdr)) {
+        int32_t magic = read_be32(hdr);
+        if (magic == V2_EVENT_MAGIC) {
+            fseeko(l->f, pos + 4, SEEK_SET);
+            return 0;
+        }
+        int32_t len = read_be32(hdr + 24);
+        if (magic == V2_CHANNEL_MAGIC && len > 0 && len <= V2_CHANNEL_MAXLEN)
+            pos += V2_RECORD_BYTES(len);
+        else
+            pos += 8;
+    }
+    fseeko(l->f, pos, SEEK_SET);
+    return -1;
+}
+
+// Moves the cursor past the magic of the last event that starts before the cursor
+static int v2_sync_stream_backwards(zcm_eventlog_t *l)
+{
+    off_t pos = (l->priv->mapped ? l->priv->mappos : ftello(l->f)) - 5;
+    for (pos &= ~(off_t)7; pos >= (off_t)V2_FILE_HEADER_BYTES; pos -= 8) {
+        int32_t magic;
+        if (read_at(l, pos, &magic, sizeof(magic)) != 0)
+            return -1;
+        if (read_be32((const uint8_t*)&magic) == V2_EVENT_MAGIC) {
+            if (l->priv->mapped)
+                l->priv->mappos = pos + 4;
+            else
+                fseeko(l->f, pos + 4, SEEK_SET);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int filter_wants_id(zcm_eventlog_t *l, int32_t id);
+
+// Reads the event whose magic the cursor was just synced past, see read_event_mapped()
+static int v2_read_event(zcm_eventlog_t *l, zcm_eventlog_event_t *le, int rewindWhenDone,
+                         int skipUnwanted)
+{
+    off_t start = (l->priv->mapped ? l->priv->mappos : ftello(l->f)) - 4;
+    uint8_t hdr[V2_HEADER_BYTES];
+    if (read_at(l, start, hdr, sizeof(hdr)) != 0)
+        return -1;
+    int32_t id     = read_be32(hdr + 4);
+    le->eventnum   = read_be64(hdr + 8);
+    le->timestamp  = read_be64(hdr + 16);
+    le->datalen    = read_be32(hdr + 24);
+    if (le->datalen < 0) {
+        fprintf(stderr, "Log event has invalid data length: %d\n", le->datalen);
+        return -1;
+    }
+    if (dict_channel(l, id, start, le) != 0)
+        return -1;
+    int wanted = !skipUnwanted || !l->priv->filter || filter_wants_id(l, id);
+
+    off_t data = start + V2_HEADER_BYTES;
+    off_t end = start + V2_RECORD_BYTES(le->datalen);
+    if (l->priv->mapped) {
+        if (data + le->datalen > (off_t)l->priv->maplen && !map_grow(l))
+            return -1;
+        if (data + le->datalen > (off_t)l->priv->maplen)
+            return -1;
+        le->data = l->priv->map + data;
+    } else if (wanted) {
+        // Null terminate the data, like the version 1 reader does
+        size_t need = (size_t)le->datalen + 1;
+        if (need > l->priv->readbuflen) {
+            uint8_t *buf = (uint8_t*) realloc(l->priv->readbuf, need);
+            if (!buf) return -1;
+            l->priv->readbuf = buf;
+            l->priv->readbuflen = need;
+        }
+        le->data = l->priv->readbuf;
+        if (read_at(l, data, le->data, le->datalen) != 0)
+            return -1;
+        ((char*)le->data)[le->datalen] = '\0';
+    }
+
+    // Check that there's a valid record or the EOF after this event.
+    int32_t next;
+    if (read_at(l, end, &next, sizeof(next)) == 0) {
+        next = read_be32((const uint8_t*)&next);
+        if (next != V2_EVENT_MAGIC && next != V2_CHANNEL_MAGIC) {
+            fprintf(stderr, "Invalid header after log data\n");
+            return -1;
+        }
+    }
+
+    off_t pos = rewindWhenDone ? start : end;
+    if (l->priv->mapped) {
+        l->priv->mappos = pos;
+        if (!rewindWhenDone && wanted)
+            map_read_ahead(l, end);
+    } else {
+        fseeko(l->f, pos, SEEK_SET);
+    }
+    return wanted ? 0 : 1;
+}
+
+/**** Channel filtering ****/
+struct _zcm_eventlog_filter_t
+{
+    zcm_eventlog_channel_filter_t wanted;
+    void    *usr;
+    regex_t  regex;
+    int      hasregex;
+
+    zcm_eventlog_dict_t *seen;  // Channels decided on so far
+    int8_t  *decisions;         // For each channel in 'seen'
+    int32_t  ndecisions;
+    int8_t  *byid;              // For each channel id of a version 2 log, -1 if undecided
+    int32_t  nbyid;
+};
+
+static void filter_destroy(zcm_eventlog_filter_t *f)
+{
+    if (f->hasregex)
+        regfree(&f->regex);
+    if (f->seen)
+        dict_destroy(f->seen);
+    free(f->decisions);
+    free(f->byid);
+    free(f);
+}
+
+static int filter_decide(zcm_eventlog_filter_t *f, const char *name, int32_t len)
+{
+    if (f->hasregex)
+        return regexec(&f->regex, name, 0, NULL, 0) == 0;
+    return f->wanted(name, len, f->usr) != 0;
+}
+
+// Whether events on a channel are wanted. Each channel is only decided on once
+static int filter_wants(zcm_eventlog_filter_t *f, const char *channel, int32_t len)
+{
+    int32_t id = dict_find(f->seen, channel, len);
+    if (id >= 0)
+        return f->decisions[id];
+
+    id = dict_add(f->seen, channel, len);
+    if (id < 0)
+        return 1;
+    if (id >= f->ndecisions) {
+        int32_t n = f->seen->capnames;
+        int8_t *decisions = (int8_t*) realloc(f->decisions, n);
+        if (!decisions)
+            return filter_decide(f, f->seen->names[id], len);
+        f->decisions = decisions;
+        f->ndecisions = n;
+    }
+    f->decisions[id] = filter_decide(f, f->seen->names[id], len);
+    return f->decisions[id];
+}
+
+// Same as above for a channel of a version 2 log, by id
+static int filter_wants_id(zcm_eventlog_t *l, int32_t id)
+{
+    zcm_eventlog_filter_t *f = l->priv->filter;
+    if (id < f->nbyid && f->byid[id] >= 0)
+        return f->byid[id];
+
+    const zcm_eventlog_dict_t *d = l->priv->dict;
+    int wanted = filter_wants(f, d->names[id], d->lens[id]);
+    if (id >= f->nbyid) {
+        int32_t n = d->capnames;
+        int8_t *byid = (int8_t*) realloc(f->byid, n);
+        if (!byid) return wanted;
+        memset(byid + f->nbyid, 0xff, n - f->nbyid);
+        f->byid = byid;
+        f->nbyid = n;
+    }
+    f->byid[id] = wanted;
+    return wanted;
+}
+
+static void prefetch_pause(zcm_eventlog_t *l);
+static void prefetch_destroy(zcm_eventlog_t *l);
+
+static int set_filter(zcm_eventlog_t *l, zcm_eventlog_filter_t *f)
+{
+    if (l->priv->writer) {
+        if (f) filter_destroy(f);
+        return -1;
+    }
+    // The prefetch thread applies the filter
+    prefetch_pause(l);
+    if (l->priv->filter)
+        filter_destroy(l->priv->filter);
+    l->priv->filter = f;
+
+    // Filtered reads skip most of the file, so the kernel reading ahead would only
+    // read in data that is skipped. Only events that are returned read ahead
+    if (l->priv->map)
+        madvise(l->priv->map, l->priv->maplen, f ? MADV_RANDOM : MADV_SEQUENTIAL);
+    return 0;
+}
+
+static zcm_eventlog_filter_t *filter_create(void)
+{
+    zcm_eventlog_filter_t *f = (zcm_eventlog_filter_t*) calloc(1, sizeof(zcm_eventlog_filter_t));
+    if (!f) return NULL;
+    f->seen = dict_create(1);
+    if (!f->seen) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+int zcm_eventlog_set_channel_filter(zcm_eventlog_t *l, zcm_eventlog_channel_filter_t wanted,
+                                    void *usr)
+{
+    if (!wanted)
+        return set_filter(l, NULL);
+    zcm_eventlog_filter_t *f = filter_create();
+    if (!f) return -1;
+    f->wanted = wanted;
+    f->usr = usr;
+    return set_filter(l, f);
+}
+
+int zcm_eventlog_set_channel_regex(zcm_eventlog_t *l, const char *regex)
+{
+    if (!regex)
+        return set_filter(l, NULL);
+
+    // Like subscriptions, the whole channel name has to match
+    char *anchored = (char*) malloc(strlen(regex) + 5);
+    zcm_eventlog_filter_t *f = anchored ? filter_create() : NULL;
+    if (!f) {
+        free(anchored);
+        return -1;
+    }
+    sprintf(anchored, "^(%s)$", regex);
+    int err = regcomp(&f->regex, anchored, REG_EXTENDED | REG_NOSUB);
+    free(anchored);
+    if (err) {
+        fprintf(stderr, "Invalid channel regex: %s\n", regex);
+        filter_destroy(f);
+        return -1;
+    }
+    f->hasregex = 1;
+    return set_filter(l, f);
+}
+
+/**** Block compressed container ****/
+// Compressed logs:
+//   "ZCMLOGBZ" (8 bytes), version (int32)
+//   followed by any number of blocks, each a header and then 'complen' bytes of data:
+//     magic (int32), codec (int32), rawlen (int32), complen (int32), nevents (int32),
+//     rawoff (int64), first eventnum (int64), last eventnum (int64),
+//     first timestamp (int64), last timestamp (int64)
+//   and, once the writer has closed the log, the block index:
+//     for every block, the file offset of its header (int64) and its header fields
+//     after the magic, then the block count (int64), the offset of the index (int64)
+//     and "ZCMLOGBI" (8 bytes)
+// A block decompresses to exactly the bytes an uncompressed log holds for the same
+// events, which would start at 'rawoff' in it. Events never span blocks.
+// Logs without the index (e.g. still being written) are read by walking the headers.
+#define BLOCKS_MAGIC "ZCMLOGBZ"
+#define BLOCKS_VERSION 1
+#define BLOCKS_INDEX_MAGIC "ZCMLOGBI"
+#define BLOCK_MAGIC ((int32_t) 0xEDA1DA0BL)
+#define BLOCK_CODEC_ZLIB 1
+
+#define BLOCKS_FILE_HEADER_BYTES (sizeof(BLOCKS_MAGIC) - 1 + sizeof(int32_t))
+#define BLOCK_FIELDS_BYTES       (sizeof(int32_t) * 4 + sizeof(int64_t) * 5)
+#define BLOCK_HEADER_BYTES       (sizeof(int32_t) + BLOCK_FIELDS_BYTES)
+#define BLOCKS_INDEX_ENTRY_BYTES (sizeof(int64_t) + BLOCK_FIELDS_BYTES)
+#define BLOCKS_TRAILER_BYTES     (sizeof(int64_t) * 2 + sizeof(BLOCKS_INDEX_MAGIC) - 1)
+
+typedef struct _block_entry_t block_entry_t;
+struct _block_entry_t
+{
+    int64_t fileoff;
+    int32_t codec;
+    int32_t rawlen;
+    int32_t complen;
+    int32_t nevents;
+    int64_t rawoff;
+    int64_t first_eventnum;
+    int64_t last_eventnum;
+    int64_t first_timestamp;
+    int64_t last_timestamp;
+};
+
+enum { JOB_FREE, JOB_QUEUED, JOB_COMPRESSING, JOB_DONE };
+
+typedef struct _block_job_t block_job_t;
+struct _block_job_t
+{
+    int state;
+    block_entry_t e;
+    uint8_t *raw;
+    size_t   rawcap;
+    uint8_t *comp;
+    size_t   compcap;
+};
+
+struct _zcm_eventlog_blocks_t
+{
+    block_entry_t *entries; // Every block of the log, in file order
+    size_t nentries;
+    size_t capentries;
+
+    /* Reading */
+    int      indexed;     // The block index was found, so the log is complete
+    off_t    scanpos;     // Otherwise, where the next block header is expected
+    int64_t  loaded;      // Block currently decompressed in 'raw', -1 if none
+    uint8_t *raw;
+    size_t   rawcap;
+    uint8_t *comp;
+    size_t   compcap;
+    int32_t *offsets;     // Of each event of the loaded block within 'raw'
+    size_t   capoffsets;
+    int64_t  block;       // Read cursor: before event 'event' of block 'block'
+    int32_t  event;
+    int      handed;      // 'f' was handed out and was left at 'handpos'
+    off_t    handpos;
+
+    /* Writing */
+    int      level;
+    size_t   block_size;
+    int64_t  rawpos;
+    off_t    filepos;
+    block_job_t *jobs;    // Ring of blocks being filled, compressed and written
+    size_t   njobs;
+    uint64_t fill;        // Sequence number of the block being filled
+    int      filling;     // It holds events. Only touched by the writing thread
+    uint64_t head;        // Sequence number of the next block to write out
+    int      error;
+    int      quit;
+    uint64_t waits;       // Times the block to fill was still being compressed
+    pthread_t *threads;
+    int      nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+};
+
+static void block_fields_put(uint8_t *p, const block_entry_t *e)
+{
+    write_be32(p,      e->codec);
+    write_be32(p + 4,  e->rawlen);
+    write_be32(p + 8,  e->complen);
+    write_be32(p + 12, e->nevents);
+    write_be64(p + 16, e->rawoff);
+    write_be64(p + 24, e->first_eventnum);
+    write_be64(p + 32, e->last_eventnum);
+    write_be64(p + 40, e->first_timestamp);
+    write_be64(p + 48, e->last_timestamp);
+}
+
+static int block_fields_get(const uint8_t *p, block_entry_t *e)
+{
+    e->codec           = read_be32(p);
+    e->rawlen          = read_be32(p + 4);
+    e->complen         = read_be32(p + 8);
+    e->nevents         = read_be32(p + 12);
+    e->rawoff          = read_be64(p + 16);
+    e->first_eventnum  = read_be64(p + 24);
+    e->last_eventnum   = read_be64(p + 32);
+    e->first_timestamp = read_be64(p + 40);
+    e->last_timestamp  = read_be64(p + 48);
+    if (e->codec != BLOCK_CODEC_ZLIB || e->rawlen <= 0 || e->complen <= 0 ||
+        e->nevents <= 0 || e->rawoff < 0 || e->first_eventnum > e->last_eventnum)
+        return -1;
+    return 0;
+}
+
+static int codec_compress(int level, const uint8_t *src, size_t srclen,
+                          uint8_t **dst, size_t *dstcap, size_t *dstlen)
+{
+#ifdef USING_ZLIB
+    uLongf len = compressBound(srclen);
+    if (len > *dstcap) {
+        uint8_t *buf = (uint8_t*) realloc(*dst, len);
+        if (!buf) return -1;
+        *dst = buf;
+        *dstcap = len;
+    }
+    if (compress2(*dst, &len, src, srclen, level) != Z_OK)
+        return -1;
+    *dstlen = len;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static int codec_decompress(int32_t codec, const uint8_t *src, size_t srclen,
+                            uint8_t *dst, size_t dstlen)
+{
+#ifdef USING_ZLIB
+    uLongf len = dstlen;
+    if (codec != BLOCK_CODEC_ZLIB || uncompress(dst, &len, src, srclen) != Z_OK)
+        return -1;
+    return len == dstlen ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+static int blocks_add_entry(zcm_eventlog_blocks_t *b, const block_entry_t *e)
+{
+    if (b->nentries == b->capentries) {
+        size_t cap = b->capentries ? b->capentries * 2 : 256;
+        block_entry_t *entries = (block_entry_t*) realloc(b->entries, cap * sizeof(*e));
+        if (!entries) return -1;
+        b->entries = entries;
+        b->capentries = cap;
+    }
+    b->entries[b->nentries++] = *e;
+    return 0;
+}
+
+static int grow(uint8_t **buf, size_t *cap, size_t need)
+{
+    if (need <= *cap) return 0;
+    uint8_t *ret = (uint8_t*) realloc(*buf, need);
+    if (!ret) return -1;
+    *buf = ret;
+    *cap = need;
+    return 0;
+}
+
+static void blocks_destroy(zcm_eventlog_blocks_t *b)
+{
+    size_t i;
+    for (i = 0; i < b->njobs; ++i) {
+        free(b->jobs[i].raw);
+        free(b->jobs[i].comp);
+    }
+    if (b->jobs) {
+        pthread_mutex_destroy(&b->lock);
+        pthread_cond_destroy(&b->cond);
+    }
+    free(b->jobs);
+    free(b->threads);
+    free(b->entries);
+    free(b->raw);
+    free(b->comp);
+    free(b->offsets);
+    free(b);
+}
+
+/**** Block compressed container: writing ****/
+static block_job_t *blocks_job(zcm_eventlog_blocks_t *b, uint64_t seq)
+{
+    return &b->jobs[seq % b->njobs];
+}
+
+// Writes out, in order, the blocks that have been compressed.
+// Called with 'lock' held when there are worker threads
+static void blocks_drain(zcm_eventlog_t *l)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    while (b->head != b->fill) {
+        block_job_t *job = blocks_job(b, b->head);
+        if (job->state != JOB_DONE) break;
+        if (!b->error) {
+            uint8_t hdr[BLOCK_HEADER_BYTES];
+            job->e.fileoff = b->filepos;
+            write_be32(hdr, BLOCK_MAGIC);
+            block_fields_put(hdr + sizeof(int32_t), &job->e);
+            int err = writer_write(l->priv->writer, hdr, sizeof(hdr));
+            if (!err) err = writer_write(l->priv->writer, job->comp, job->e.complen);
+            if (!err && blocks_add_entry(b, &job->e) != 0) err = ENOMEM;
+            if (err) b->error = err;
+            b->filepos += sizeof(hdr) + job->e.complen;
+        }
+        job->state = JOB_FREE;
+        b->head++;
+    }
+}
+
+static int blocks_compress(zcm_eventlog_blocks_t *b, block_job_t *job)
+{
+    size_t complen;
+    if (codec_compress(b->level, job->raw, job->e.rawlen,
+                       &job->comp, &job->compcap, &complen) != 0 || complen > INT32_MAX)
+        return -1;
+    job->e.complen = (int32_t)complen;
+    return 0;
+}
+
+static void *blocks_worker(void *usr)
+{
+    zcm_eventlog_t *l = (zcm_eventlog_t*) usr;
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+
+    pthread_mutex_lock(&b->lock);
+    while (1) {
+        block_job_t *job = NULL;
+        uint64_t seq;
+        for (seq = b->head; seq != b->fill; ++seq) {
+            if (blocks_job(b, seq)->state == JOB_QUEUED) {
+                job = blocks_job(b, seq);
+                break;
+            }
+        }
+        if (!job) {
+            if (b->quit) break;
+            pthread_cond_wait(&b->cond, &b->lock);
+            continue;
+        }
+
+        job->state = JOB_COMPRESSING;
+        pthread_mutex_unlock(&b->lock);
+        int ret = blocks_compress(b, job);
+        pthread_mutex_lock(&b->lock);
+
+        if (ret != 0) b->error = EIO;
+        job->state = JOB_DONE;
+        blocks_drain(l);
+        pthread_cond_broadcast(&b->cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+// Hands the block being filled off to be compressed and written
+static void blocks_submit(zcm_eventlog_t *l)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    block_job_t *job = blocks_job(b, b->fill);
+    b->filling = 0;
+
+    if (b->nthreads == 0) {
+        if (blocks_compress(b, job) != 0) b->error = EIO;
+        job->state = JOB_DONE;
+        b->fill++;
+        blocks_drain(l);
+        return;
+    }
+
+    pthread_mutex_lock(&b->lock);
+    job->state = JOB_QUEUED;
+    b->fill++;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static int blocks_write_event(zcm_eventlog_t *l, const zcm_eventlog_event_t *le)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    size_t len = EVENT_BYTES(le);
+    if (len > INT32_MAX) return -1;
+
+    block_job_t *job = blocks_job(b, b->fill);
+    if (b->filling && (size_t)job->e.rawlen + len > INT32_MAX) {
+        blocks_submit(l);
+        job = blocks_job(b, b->fill);
+    }
+
+    if (!b->filling) {
+        // Wait for the block to have been written out the last time it was used
+        int error;
+        if (b->nthreads > 0) {
+            pthread_mutex_lock(&b->lock);
+            if (job->state != JOB_FREE)
+                b->waits++;
+            while (job->state != JOB_FREE && !b->error)
+                pthread_cond_wait(&b->cond, &b->lock);
+            error = b->error;
+            pthread_mutex_unlock(&b->lock);
+        } else {
+            error = b->error;
+        }
+        if (error) {
+            errno = error;
+            return -1;
+        }
+
+        memset(&job->e, 0, sizeof(job->e));
+        job->e.codec = BLOCK_CODEC_ZLIB;
+        job->e.rawoff = b->rawpos;
+        job->e.first_eventnum = le->eventnum;
+        job->e.first_timestamp = le->timestamp;
+        b->filling = 1;
+    }
+
+    size_t need = (size_t)job->e.rawlen + len;
+    if (need > job->rawcap &&
+        grow(&job->raw, &job->rawcap, need > b->block_size ? need : b->block_size) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    put_event(job->raw + job->e.rawlen, le);
+
+    job->e.last_eventnum = le->eventnum;
+    job->e.last_timestamp = le->timestamp;
+    job->e.nevents++;
+    job->e.rawlen += (int32_t)len;
+    b->rawpos += len;
+
+    if ((size_t)job->e.rawlen >= b->block_size)
+        blocks_submit(l);
+    return 0;
+}
+
+// Writes out everything still buffered followed by the block index
+static int blocks_finish(zcm_eventlog_t *l)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    int i;
+
+    if (b->filling)
+        blocks_submit(l);
+
+    if (b->nthreads > 0) {
+        pthread_mutex_lock(&b->lock);
+        b->quit = 1;
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+        for (i = 0; i < b->nthreads; ++i)
+            pthread_join(b->threads[i], NULL);
+    }
+    if (b->error) return -1;
+
+    uint8_t buf[BLOCKS_INDEX_ENTRY_BYTES > BLOCKS_TRAILER_BYTES ?
+                BLOCKS_INDEX_ENTRY_BYTES : BLOCKS_TRAILER_BYTES];
+    size_t n;
+    for (n = 0; n < b->nentries; ++n) {
+        write_be64(buf, b->entries[n].fileoff);
+        block_fields_put(buf + sizeof(int64_t), &b->entries[n]);
+        if (writer_write(l->priv->writer, buf, BLOCKS_INDEX_ENTRY_BYTES) != 0)
+            return -1;
+    }
+    write_be64(buf, b->nentries);
+    write_be64(buf + sizeof(int64_t), b->filepos);
+    memcpy(buf + sizeof(int64_t) * 2, BLOCKS_INDEX_MAGIC, sizeof(BLOCKS_INDEX_MAGIC) - 1);
+    return writer_write(l->priv->writer, buf, BLOCKS_TRAILER_BYTES) == 0 ? 0 : -1;
+}
+
+int zcm_eventlog_enable_compression(zcm_eventlog_t *l, int level, size_t block_size,
+                                    int nthreads)
+{
+#ifndef USING_ZLIB
+    fprintf(stderr, "Unable to compress log, zcm was built without zlib\n");
+    return -1;
+#else
+    if (l->priv->blocks || l->priv->index || l->priv->dict || !l->priv->writer || l->eventcount != 0 ||
+        l->priv->writepos != 0 || block_size == 0 || block_size > INT32_MAX || nthreads < 0)
+        return -1;
+
+    uint8_t hdr[BLOCKS_FILE_HEADER_BYTES];
+    memcpy(hdr, BLOCKS_MAGIC, sizeof(BLOCKS_MAGIC) - 1);
+    write_be32(hdr + sizeof(BLOCKS_MAGIC) - 1, BLOCKS_VERSION);
+    if (writer_write(l->priv->writer, hdr, sizeof(hdr)) != 0)
+        return -1;
+
+    zcm_eventlog_blocks_t *b = (zcm_eventlog_blocks_t*) calloc(1, sizeof(zcm_eventlog_blocks_t));
+    b->level = level;
+    b->block_size = block_size;
+    b->filepos = BLOCKS_FILE_HEADER_BYTES;
+    b->loaded = -1;
+    // Let every thread work on a block while the next ones are being filled
+    b->njobs = nthreads > 0 ? 2 * nthreads : 1;
+    b->jobs = (block_job_t*) calloc(b->njobs, sizeof(block_job_t));
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    l->priv->blocks = b;
+
+    if (nthreads > 0) {
+        b->threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+        for (b->nthreads = 0; b->nthreads < nthreads; ++b->nthreads) {
+            if (pthread_create(&b->threads[b->nthreads], NULL, blocks_worker, l) != 0)
+                break;
+        }
+    }
+    return 0;
+#endif
+}
+
+/**** Block compressed container: reading ****/
+// Reads the block header at 'pos'. Returns 0 if a complete block starts there
+static int blocks_read_header(zcm_eventlog_t *l, off_t pos, off_t filelen, block_entry_t *e)
+{
+    uint8_t hdr[BLOCK_HEADER_BYTES];
+    if (pread(fileno(l->f), hdr, sizeof(hdr), pos) != (ssize_t)sizeof(hdr) ||
+        read_be32(hdr) != BLOCK_MAGIC ||
+        block_fields_get(hdr + sizeof(int32_t), e) != 0 ||
+        pos + (off_t)sizeof(hdr) + e->complen > filelen)
+        return -1;
+    e->fileoff = pos;
+    return 0;
+}
+
+// Blocks must follow each other in both the file and the uncompressed events
+static int blocks_follows(const zcm_eventlog_blocks_t *b, const block_entry_t *e)
+{
+    if (b->nentries == 0)
+        return e->rawoff == 0 && e->fileoff == (off_t)BLOCKS_FILE_HEADER_BYTES;
+    const block_entry_t *prev = &b->entries[b->nentries - 1];
+    return e->rawoff == prev->rawoff + prev->rawlen &&
+           e->fileoff == prev->fileoff + (off_t)BLOCK_HEADER_BYTES + prev->complen &&
+           e->first_eventnum > prev->last_eventnum;
+}
+
+// Picks up the blocks appended since the last scan of a log without a block index.
+// Returns the number of new blocks
+static int blocks_scan(zcm_eventlog_t *l)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    if (b->indexed) return 0;
+
+    struct stat st;
+    if (fstat(fileno(l->f), &st) != 0) return 0;
+
+    int found = 0;
+    block_entry_t e;
+    while (blocks_read_header(l, b->scanpos, st.st_size, &e) == 0 &&
+           blocks_follows(b, &e) && blocks_add_entry(b, &e) == 0) {
+        b->scanpos += BLOCK_HEADER_BYTES + e.complen;
+        found++;
+    }
+    return found;
+}
+
+// Loads the block index written when the log was closed. Returns 0 on success
+static int blocks_load_index(zcm_eventlog_t *l)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    struct stat st;
+    if (fstat(fileno(l->f), &st) != 0 ||
+        st.st_size < (off_t)(BLOCKS_FILE_HEADER_BYTES + BLOCKS_TRAILER_BYTES))
+        return -1;
+
+    uint8_t trailer[BLOCKS_TRAILER_BYTES];
+    if (pread(fileno(l->f), trailer, sizeof(trailer), st.st_size - sizeof(trailer)) !=
+            (ssize_t)sizeof(trailer) ||
+        memcmp(trailer + sizeof(int64_t) * 2, BLOCKS_INDEX_MAGIC,
+               sizeof(BLOCKS_INDEX_MAGIC) - 1) != 0)
+        return -1;
+
+    int64_t n = read_be64(trailer);
+    off_t start = read_be64(trailer + sizeof(int64_t));
+    if (n < 0 || start < (off_t)BLOCKS_FILE_HEADER_BYTES ||
+        n > (st.st_size - start) / (off_t)BLOCKS_INDEX_ENTRY_BYTES ||
+        start + n * (off_t)BLOCKS_INDEX_ENTRY_BYTES + (off_t)sizeof(trailer) != st.st_size)
+        return -1;
+
+    size_t len = n * BLOCKS_INDEX_ENTRY_BYTES;
+    uint8_t *buf = (uint8_t*) malloc(len ? len : 1);
+    if (!buf) return -1;
+    int ret = pread(fileno(l->f), buf, len, start) == (ssize_t)len ? 0 : -1;
+
+    int64_t i;
+    for (i = 0; ret == 0 && i < n; ++i) {
+        block_entry_t e;
+        const uint8_t *p = buf + i * BLOCKS_INDEX_ENTRY_BYTES;
+        e.fileoff = read_be64(p);
+        if (block_fields_get(p + sizeof(int64_t), &e) != 0 || !blocks_follows(b, &e) ||
+            e.fileoff + (off_t)BLOCK_HEADER_BYTES + e.complen > start ||
+            blocks_add_entry(b, &e) != 0)
+            ret = -1;
+    }
+    free(buf);
+
+    if (ret != 0) {
+        b->nentries = 0;
+        return -1;
+    }
+    b->indexed = 1;
+    return 0;
+}
+
+static int blocks_open(zcm_eventlog_t *l)
+{
+    l->priv->blocks = (zcm_eventlog_blocks_t*) calloc(1, sizeof(zcm_eventlog_blocks_t));
+    if (!l->priv->blocks) return -1;
+    l->priv->blocks->loaded = -1;
+    if (blocks_load_index(l) != 0) {
+        l->priv->blocks->scanpos = BLOCKS_FILE_HEADER_BYTES;
+        blocks_scan(l);
+    }
+    return 0;
+}
+
+// Decompresses a block and finds its events
+static int blocks_load(zcm_eventlog_t *l, int64_t i)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    if (b->loaded == i) return 0;
+    b->loaded = -1;
+
+    const block_entry_t *e = &b->entries[i];
+    if (grow(&b->comp, &b->compcap, e->complen) != 0 ||
+        grow(&b->raw, &b->rawcap, e->rawlen) != 0 ||
+        grow((uint8_t**)&b->offsets, &b->capoffsets, e->nevents * sizeof(int32_t)) != 0)
+        return -1;
+
+    if (pread(fileno(l->f), b->comp, e->complen, e->fileoff + BLOCK_HEADER_BYTES) !=
+            (ssize_t)e->complen ||
+        codec_decompress(e->codec, b->comp, e->complen, b->raw, e->rawlen) != 0) {
+        fprintf(stderr, "Unable to decompress log block at offset %" PRId64 "\n", e->fileoff);
+        return -1;
+    }
+
+    // Have the kernel start reading in the next few blocks while this one is read
+    int64_t last = i + READ_AHEAD_BLOCKS;
+    if (last >= (int64_t)b->nentries) last = b->nentries - 1;
+    if (last > i) {
+        const block_entry_t *ahead = &b->entries[last];
+        off_t start = e->fileoff + BLOCK_HEADER_BYTES + e->complen;
+        off_t end = ahead->fileoff + BLOCK_HEADER_BYTES + ahead->complen;
+        posix_fadvise(fileno(l->f), start, end - start, POSIX_FADV_WILLNEED);
+    }
+
+    size_t pos = 0;
+    int32_t n;
+    for (n = 0; n < e->nevents; ++n) {
+        zcm_eventlog_event_t le;
+        const uint8_t *p = b->raw + pos;
+        if (pos + sizeof(int32_t) + EVENT_HEADER_BYTES > (size_t)e->rawlen ||
+            read_be32(p) != MAGIC)
+            break;
+        le.channellen = read_be32(p + 20);
+        le.datalen    = read_be32(p + 24);
+        if (check_event_lengths(&le) != 0)
+            break;
+        b->offsets[n] = pos;
+        pos += EVENT_BYTES(&le);
+    }
+    if (n != e->nevents || pos != (size_t)e->rawlen) {
+        fprintf(stderr, "Log block at offset %" PRId64 " is corrupt\n", e->fileoff);
+        return -1;
+    }
+
+    b->loaded = i;
+    return 0;
+}
+
+// Fills in a view of event 'i' of the loaded block
+static void blocks_view(const zcm_eventlog_blocks_t *b, int32_t i, zcm_eventlog_event_t *le)
+{
+    const uint8_t *p = b->raw + b->offsets[i] + sizeof(int32_t);
+    le->eventnum   = read_be64(p);
+    le->timestamp  = read_be64(p + 8);
+    le->channellen = read_be32(p + 16);
+    le->datalen    = read_be32(p + 20);
+    le->channel    = (char*) p + EVENT_HEADER_BYTES;
+    le->data       = (uint8_t*) p + EVENT_HEADER_BYTES + le->channellen;
+}
+
+static int blocks_read_next(zcm_eventlog_t *l, zcm_eventlog_event_t *le)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    while (1) {
+        if (b->block < (int64_t)b->nentries && b->event < b->entries[b->block].nevents) {
+            if (blocks_load(l, b->block) == 0) break;
+            // Skip past a corrupt block
+            b->event = b->entries[b->block].nevents;
+            continue;
+        }
+        if (b->block + 1 >= (int64_t)b->nentries && blocks_scan(l) == 0)
+            return -1;
+        // A log opened before its first block was written finds that block here, and
+        // must start on it rather than move past it
+        if (b->block < (int64_t)b->nentries && b->event >= b->entries[b->block].nevents) {
+            b->block++;
+            b->event = 0;
+        }
+    }
+    blocks_view(b, b->event++, le);
+    return 0;
+}
+
+static int blocks_read_prev(zcm_eventlog_t *l, zcm_eventlog_event_t *le)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    while (1) {
+        if (b->event > 0) {
+            if (blocks_load(l, b->block) == 0) break;
+            b->event = 0;
+            continue;
+        }
+        if (b->block == 0) return -1;
+        b->block--;
+        b->event = b->entries[b->block].nevents;
+    }
+    blocks_view(b, --b->event, le);
+    return 0;
+}
+
+// Leaves the cursor before the first event at or after 'offset' in the uncompressed events
+static int blocks_seek_offset(zcm_eventlog_t *l, off_t offset)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    blocks_scan(l);
+
+    // Find the last block starting at or before the offset
+    size_t lo = 0, hi = b->nentries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (b->entries[mid].rawoff <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    b->block = lo > 0 ? lo - 1 : 0;
+    b->event = 0;
+    if (lo == 0 || b->entries[b->block].rawoff == offset)
+        return 0;
+
+    if (blocks_load(l, b->block) != 0) return -1;
+    const block_entry_t *e = &b->entries[b->block];
+    while (b->event < e->nevents && e->rawoff + b->offsets[b->event] < offset)
+        b->event++;
+    return 0;
+}
+
+static int blocks_seek(zcm_eventlog_t *l, int64_t target, int by_eventnum)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    blocks_scan(l);
+
+    // Find the first block ending at or after the target
+    size_t lo = 0, hi = b->nentries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const block_entry_t *e = &b->entries[mid];
+        if ((by_eventnum ? e->last_eventnum : e->last_timestamp) < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == b->nentries || blocks_load(l, lo) != 0)
+        return -1;
+
+    zcm_eventlog_event_t le;
+    int32_t i;
+    int found = 0;
+    for (i = 0; i < b->entries[lo].nevents; ++i) {
+        blocks_view(b, i, &le);
+        if ((by_eventnum ? le.eventnum : le.timestamp) >= target) {
+            found = !by_eventnum || le.eventnum == target;
+            break;
+        }
+    }
+    b->block = lo;
+    b->event = i;
+    return found ? 0 : -1;
+}
+
+// Leaves 'f' at the start of the block holding the cursor, or at the end of the file
+static void blocks_hand_cursor(zcm_eventlog_t *l)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    if (b->block < (int64_t)b->nentries && b->event < b->entries[b->block].nevents)
+        fseeko(l->f, b->entries[b->block].fileoff, SEEK_SET);
+    else
+        fseeko(l->f, 0, SEEK_END);
+    b->handpos = ftello(l->f);
+    b->handed = 1;
+}
+
+// Moves the cursor to the start of the block holding the position of 'f' if the
+// caller moved it since it was handed out
+static void blocks_take_cursor(zcm_eventlog_t *l)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    if (!b->handed) return;
+    b->handed = 0;
+
+    off_t pos = ftello(l->f);
+    if (pos == b->handpos) return;
+    blocks_scan(l);
+
+    size_t lo = 0, hi = b->nentries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (b->entries[mid].fileoff <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    b->block = lo > 0 ? lo - 1 : 0;
+    b->event = 0;
+    if (lo > 0) {
+        const block_entry_t *e = &b->entries[b->block];
+        if (pos >= e->fileoff + (off_t)BLOCK_HEADER_BYTES + e->complen)
+            b->event = e->nevents;
+    }
+}
+
 zcm_eventlog_t *zcm_eventlog_create(const char *path, const char *mode)
 {
     assert(!strcmp(mode, "r") || !strcmp(mode, "w") || !strcmp(mode, "a"));
@@ -13,38 +2172,181 @@ zcm_eventlog_t *zcm_eventlog_create(const char *path, const char *mode)
     else if(*mode == 'r')
         mode = "rb";
     else if(*mode == 'a')
-        mode = "ab";
+        mode = "a+b"; // Appending has to read the format of the log
     else
         return NULL;
 
     zcm_eventlog_t *l = (zcm_eventlog_t*) calloc(1, sizeof(zcm_eventlog_t));
+    l->priv = (zcm_eventlog_private_t*) calloc(1, sizeof(zcm_eventlog_private_t));
 
     l->f = fopen(path, mode);
     if (!l->f) {
+        free (l->priv);
         free (l);
         return NULL;
     }
 
     l->eventcount = 0;
+    l->priv->path = strdup(path);
+
+    // Reads go through stdio if the file can't be mapped (e.g. it is a pipe)
+    if (*mode == 'r') {
+        uint8_t hdr[BLOCKS_FILE_HEADER_BYTES];
+        if (pread(fileno(l->f), hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) &&
+            memcmp(hdr, BLOCKS_MAGIC, sizeof(BLOCKS_MAGIC) - 1) == 0) {
+#ifdef USING_ZLIB
+            int ok = read_be32(hdr + sizeof(BLOCKS_MAGIC) - 1) == BLOCKS_VERSION &&
+                     blocks_open(l) == 0;
+            if (!ok) fprintf(stderr, "Unsupported compressed log: %s\n", path);
+#else
+            int ok = 0;
+            fprintf(stderr, "Unable to read compressed log, zcm was built without zlib\n");
+#endif
+            if (!ok) {
+                zcm_eventlog_destroy(l);
+                return NULL;
+            }
+            return l;
+        }
+        if (v2_open(l, 0) < 0) {
+            fprintf(stderr, "Unsupported log version: %s\n", path);
+            zcm_eventlog_destroy(l);
+            return NULL;
+        }
+        map_file(l);
+        l->priv->index = index_load(path);
+        return l;
+    }
+
+    if (*mode == 'a') {
+        struct stat st;
+        if (fstat(fileno(l->f), &st) == 0)
+            l->priv->writepos = st.st_size;
+
+        // Keep appending in the format of the log
+        int v2 = l->priv->writepos > 0 ? v2_open(l, 1) : 0;
+        if (v2 < 0) {
+            fprintf(stderr, "Unsupported log version: %s\n", path);
+            zcm_eventlog_destroy(l);
+            return NULL;
+        }
+        if (v2) {
+            if (dict_learn(l, l->priv->writepos) != 0)
+                fprintf(stderr, "Log has unreadable records, appending after them anyway\n");
+            l->priv->writepos = (l->priv->writepos + 7) & ~(off_t)7;
+        }
+    }
+    l->priv->writer = writer_create(fileno(l->f), l->priv->writepos, WRITE_BUFFER_DEFAULT, 0);
+    if (!l->priv->writer) {
+        zcm_eventlog_destroy(l);
+        return NULL;
+    }
 
     return l;
 }
 
 void zcm_eventlog_destroy(zcm_eventlog_t *l)
 {
+    if (l->priv->prefetch)
+        prefetch_destroy(l);
+    if (l->priv->blocks) {
+        if (l->priv->writer && blocks_finish(l) != 0)
+            fprintf(stderr, "Unable to finish writing compressed log, it may be incomplete\n");
+        blocks_destroy(l->priv->blocks);
+    }
+    if (l->priv->writer) {
+        int err = writer_destroy(l->priv->writer);
+        if (err)
+            fprintf(stderr, "Unable to write log: %s\n", strerror(err));
+    }
+    if (l->priv->map)
+        munmap(l->priv->map, l->priv->maplen);
+    free(l->priv->readbuf);
+    if (l->priv->index)
+        index_destroy(l->priv->index);
+    if (l->priv->dict)
+        dict_destroy(l->priv->dict);
+    if (l->priv->filter)
+        filter_destroy(l->priv->filter);
+    free(l->priv->path);
     fflush(l->f);
     fclose(l->f);
+    free(l->priv);
     free(l);
 }
 
 FILE *zcm_eventlog_get_fileptr(zcm_eventlog_t *l)
 {
+    if (l->priv->writer) {
+        zcm_eventlog_flush(l);
+        if (!l->priv->blocks)
+            fseeko(l->f, l->priv->writepos, SEEK_SET);
+        return l->f;
+    }
+    prefetch_pause(l);
+    if (l->priv->blocks) {
+        blocks_hand_cursor(l);
+        return l->f;
+    }
+    if (l->priv->mapped && !l->priv->mappos_in_file) {
+        fseeko(l->f, l->priv->mappos, SEEK_SET);
+        l->priv->mappos_in_file = 1;
+    }
     return l->f;
 }
 
-// Returns 0 on success -1 on failure
+// Takes the read cursor back from the FILE* if it was handed out
+static void take_cursor(zcm_eventlog_t *l)
+{
+    prefetch_pause(l);
+    if (l->priv->blocks) {
+        blocks_take_cursor(l);
+        return;
+    }
+    if (l->priv->mapped && l->priv->mappos_in_file) {
+        l->priv->mappos = ftello(l->f);
+        l->priv->mappos_in_file = 0;
+    }
+}
+
+static off_t tell(zcm_eventlog_t *l)
+{
+    return l->priv->mapped ? l->priv->mappos : ftello(l->f);
+}
+
+static void seek(zcm_eventlog_t *l, off_t offset)
+{
+    if (l->priv->mapped)
+        l->priv->mappos = offset;
+    else
+        fseeko(l->f, offset, SEEK_SET);
+}
+
+// Moves the cursor past the next magic. Returns 0 on success -1 on failure
 static int sync_stream(zcm_eventlog_t *l)
 {
+    if (l->priv->dict)
+        return v2_sync_stream(l);
+    if (l->priv->mapped) {
+        do {
+            const uint8_t *p = l->priv->map + l->priv->mappos;
+            const uint8_t *end = l->priv->map + l->priv->maplen;
+            while (end - p >= 4) {
+                p = (const uint8_t*) memchr(p, 0xED, (end - p) - 3);
+                if (!p) break;
+                if (read_be32(p) == MAGIC) {
+                    l->priv->mappos = (p - l->priv->map) + 4;
+                    return 0;
+                }
+                p++;
+            }
+            // Keep a partial magic at the end around in case the log grows
+            if ((off_t)l->priv->maplen - l->priv->mappos > 3)
+                l->priv->mappos = l->priv->maplen - 3;
+        } while (map_grow(l));
+        return -1;
+    }
+
     uint32_t magic = 0;
     int r;
     do {
@@ -55,8 +2357,22 @@ static int sync_stream(zcm_eventlog_t *l)
     return 0;
 }
 
+// Moves the cursor past the last magic that ends before the cursor
 static int sync_stream_backwards(zcm_eventlog_t *l)
 {
+    if (l->priv->dict)
+        return v2_sync_stream_backwards(l);
+    if (l->priv->mapped) {
+        off_t q;
+        for (q = l->priv->mappos - 5; q >= 0; --q) {
+            if (l->priv->map[q] == 0xED && read_be32(l->priv->map + q) == MAGIC) {
+                l->priv->mappos = q + 4;
+                return 0;
+            }
+        }
+        return -1;
+    }
+
     uint32_t magic = 0;
     int r;
     do {
@@ -76,19 +2392,42 @@ static int64_t get_next_event_time(zcm_eventlog_t *l)
 
     int64_t event_num;
     int64_t timestamp;
-    if (0 != fread64(l->f, &event_num)) return -1;
-    if (0 != fread64(l->f, &timestamp)) return -1;
-    fseeko (l->f, -(sizeof(int64_t) * 2 + sizeof(int32_t)), SEEK_CUR);
+    if (l->priv->dict) {
+        // Version 2 events have their channel id first
+        uint8_t hdr[V2_HEADER_BYTES];
+        off_t start = tell(l) - sizeof(int32_t);
+        if (read_at(l, start, hdr, sizeof(hdr)) != 0) return -1;
+        event_num = read_be64(hdr + 8);
+        timestamp = read_be64(hdr + 16);
+        seek(l, start);
+    } else if (l->priv->mapped) {
+        if ((off_t)l->priv->maplen - l->priv->mappos < (off_t)(sizeof(int64_t) * 2)) return -1;
+        event_num = read_be64(l->priv->map + l->priv->mappos);
+        timestamp = read_be64(l->priv->map + l->priv->mappos + sizeof(int64_t));
+        l->priv->mappos -= sizeof(int32_t);
+    } else {
+        if (0 != fread64(l->f, &event_num)) return -1;
+        if (0 != fread64(l->f, &timestamp)) return -1;
+        fseeko (l->f, -(sizeof(int64_t) * 2 + sizeof(int32_t)), SEEK_CUR);
+    }
 
     l->eventcount = event_num;
 
     return timestamp;
 }
 
-int zcm_eventlog_seek_to_timestamp(zcm_eventlog_t *l, int64_t timestamp)
+// Bisects the file by fraction until landing near the event with the given timestamp or
+// event number. Assumes both increase monotonically with file position.
+static int bisect(zcm_eventlog_t *l, int64_t target, int by_eventnum)
 {
-    fseeko (l->f, 0, SEEK_END);
-    off_t file_len = ftello(l->f);
+    off_t file_len;
+    if (l->priv->mapped) {
+        map_grow(l);
+        file_len = l->priv->maplen;
+    } else {
+        fseeko (l->f, 0, SEEK_END);
+        file_len = ftello(l->f);
+    }
 
     int64_t cur_time;
     double frac1 = 0;               // left bracket
@@ -99,10 +2438,12 @@ int zcm_eventlog_seek_to_timestamp(zcm_eventlog_t *l, int64_t timestamp)
     while (1) {
         frac = 0.5*(frac1+frac2);
         off_t offset = (off_t)(frac*file_len);
-        fseeko (l->f, offset, SEEK_SET);
+        seek(l, offset);
         cur_time = get_next_event_time (l);
         if (cur_time < 0)
             return -1;
+        if (by_eventnum)
+            cur_time = l->eventcount;
 
         if ((frac > frac2) || (frac < frac1) || (frac1>=frac2))
             break;
@@ -113,10 +2454,10 @@ int zcm_eventlog_seek_to_timestamp(zcm_eventlog_t *l, int64_t timestamp)
         if (df < 1e-12)
             break;
 
-        if (cur_time == timestamp)
+        if (cur_time == target)
             break;
 
-        if (cur_time < timestamp)
+        if (cur_time < target)
             frac1 = frac;
         else
             frac2 = frac;
@@ -127,44 +2468,184 @@ int zcm_eventlog_seek_to_timestamp(zcm_eventlog_t *l, int64_t timestamp)
     return 0;
 }
 
-static zcm_eventlog_event_t *zcm_event_read_helper(zcm_eventlog_t *l, int rewindWhenDone)
+static int read_event(zcm_eventlog_t *l, zcm_eventlog_event_t *le, int rewindWhenDone,
+                      int skipUnwanted);
+
+// Reads forward to the first event whose timestamp (or event number) is >= 'target'
+// and leaves the cursor at its start
+static int scan_forward(zcm_eventlog_t *l, int64_t target, int by_eventnum)
 {
-    zcm_eventlog_event_t *le =
-        (zcm_eventlog_event_t*) calloc(1, sizeof(zcm_eventlog_event_t));
+    zcm_eventlog_event_t le;
+    while (1) {
+        if (sync_stream(l)) return -1;
+        off_t start = tell(l) - sizeof(int32_t);
+        if (read_event(l, &le, 0, 0)) return -1;
+        if ((by_eventnum ? le.eventnum : le.timestamp) >= target) {
+            seek(l, start);
+            l->eventcount = le.eventnum;
+            return (!by_eventnum || le.eventnum == target) ? 0 : -1;
+        }
+    }
+}
+
+#define INDEX_INVALID (-2)
+
+// Seeks using the index. Returns INDEX_INVALID, after dropping the index, if it does
+// not match the log.
+static int index_seek(zcm_eventlog_t *l, int64_t target, int by_eventnum)
+{
+    const zcm_eventlog_index_t *idx = l->priv->index;
+
+    // Find the last entry before the target
+    size_t lo = 0, hi = idx->nentries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const index_entry_t *e = &idx->entries[mid];
+        if ((by_eventnum ? e->eventnum : e->timestamp) < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (by_eventnum && lo < idx->nentries && idx->entries[lo].eventnum == target)
+        lo++;
+
+    if (lo == 0) {
+        seek(l, 0);
+        return scan_forward(l, target, by_eventnum);
+    }
+
+    // Make sure the entry really points at the event it claims to
+    const index_entry_t *e = &idx->entries[lo - 1];
+    zcm_eventlog_event_t le;
+    seek(l, e->offset);
+    if (sync_stream(l) == 0 && tell(l) == e->offset + (off_t)sizeof(int32_t) &&
+        read_event(l, &le, 1, 0) == 0 && le.eventnum == e->eventnum) {
+        return scan_forward(l, target, by_eventnum);
+    }
+
+    fprintf(stderr, "Log index does not match the log, ignoring it\n");
+    index_destroy(l->priv->index);
+    l->priv->index = NULL;
+    return INDEX_INVALID;
+}
+
+int zcm_eventlog_seek_to_timestamp(zcm_eventlog_t *l, int64_t timestamp)
+{
+    take_cursor(l);
+    if (l->priv->blocks)
+        return blocks_seek(l, timestamp, 0);
+    if (l->priv->index) {
+        int ret = index_seek(l, timestamp, 0);
+        if (ret != INDEX_INVALID)
+            return ret;
+    }
+    return bisect(l, timestamp, 0);
+}
 
+int zcm_eventlog_seek_to_eventnum(zcm_eventlog_t *l, int64_t eventnum)
+{
+    take_cursor(l);
+    if (l->priv->blocks)
+        return blocks_seek(l, eventnum, 1);
+    if (l->priv->index) {
+        int ret = index_seek(l, eventnum, 1);
+        if (ret != INDEX_INVALID)
+            return ret;
+    }
+
+    if (bisect(l, eventnum, 1) != 0)
+        return -1;
+
+    // Bisection only gets close, step back until before the target and scan from there
+    zcm_eventlog_event_t le;
+    while (l->eventcount > eventnum) {
+        if (sync_stream_backwards(l) < 0 || read_event(l, &le, 1, 0) != 0)
+            break;
+        l->eventcount = le.eventnum;
+    }
+    return scan_forward(l, eventnum, 1);
+}
+
+// Reads the event whose magic the cursor was just synced past into a view of the
+// mapped file. The cursor is left at the end of the event, or at its magic if
+// 'rewindWhenDone' is set. With 'skipUnwanted', events the channel filter rejects are
+// stepped over without touching their data and 1 is returned
+static int read_event_mapped(zcm_eventlog_t *l, zcm_eventlog_event_t *le, int rewindWhenDone,
+                             int skipUnwanted)
+{
+    off_t pos = l->priv->mappos;
+    if ((off_t)l->priv->maplen - pos < (off_t)EVENT_HEADER_BYTES && !map_grow(l))
+        return -1;
+    if ((off_t)l->priv->maplen - pos < (off_t)EVENT_HEADER_BYTES)
+        return -1;
+
+    const uint8_t *hdr = l->priv->map + pos;
+    le->eventnum   = read_be64(hdr);
+    le->timestamp  = read_be64(hdr + 8);
+    le->channellen = read_be32(hdr + 16);
+    le->datalen    = read_be32(hdr + 20);
+    if (check_event_lengths(le) != 0)
+        return -1;
+
+    off_t end = pos + EVENT_HEADER_BYTES + le->channellen + le->datalen;
+    if (end > (off_t)l->priv->maplen && !map_grow(l))
+        return -1;
+    if (end > (off_t)l->priv->maplen)
+        return -1;
+
+    // Check that there's a valid event or the EOF after this event.
+    if (end + 4 <= (off_t)l->priv->maplen && read_be32(l->priv->map + end) != MAGIC) {
+        fprintf(stderr, "Invalid header after log data\n");
+        return -1;
+    }
+
+    le->channel = (char*) l->priv->map + pos + EVENT_HEADER_BYTES;
+    le->data    = l->priv->map + pos + EVENT_HEADER_BYTES + le->channellen;
+    int wanted = !skipUnwanted || !l->priv->filter ||
+                 filter_wants(l->priv->filter, le->channel, le->channellen);
+    l->priv->mappos = rewindWhenDone ? pos - 4 : end;
+    if (!rewindWhenDone && wanted)
+        map_read_ahead(l, end);
+    return wanted ? 0 : 1;
+}
+
+// Same as above when reading through stdio. The view is backed by 'readbuf'
+static int read_event_stdio(zcm_eventlog_t *l, zcm_eventlog_event_t *le, int rewindWhenDone,
+                            int skipUnwanted)
+{
     if (0 != fread64(l->f, &le->eventnum) ||
         0 != fread64(l->f, &le->timestamp) ||
         0 != fread32(l->f, &le->channellen) ||
         0 != fread32(l->f, &le->datalen)) {
-        free(le);
-        return NULL;
+        return -1;
     }
 
-    // Sanity check the channel length and data length
-    if (le->channellen <= 0 || le->channellen >= 1000) {
-        fprintf(stderr, "Log event has invalid channel length: %d\n", le->channellen);
-        free(le);
-        return NULL;
-    }
-    if (le->datalen < 0) {
-        fprintf(stderr, "Log event has invalid data length: %d\n", le->datalen);
-        free(le);
-        return NULL;
-    }
+    if (check_event_lengths(le) != 0)
+        return -1;
 
-    le->channel = (char *) calloc(1, le->channellen+1);
-    if (fread(le->channel, 1, le->channellen, l->f) != (size_t) le->channellen) {
-        free(le->channel);
-        free(le);
-        return NULL;
+    // Null terminate both the channel and the data
+    size_t need = (size_t)le->channellen + 1 + (size_t)le->datalen + 1;
+    if (need > l->priv->readbuflen) {
+        uint8_t *buf = (uint8_t*) realloc(l->priv->readbuf, need);
+        if (!buf) return -1;
+        l->priv->readbuf = buf;
+        l->priv->readbuflen = need;
     }
+    le->channel = (char*) l->priv->readbuf;
+    le->data    = l->priv->readbuf + le->channellen + 1;
 
-    le->data = calloc(1, le->datalen+1);
-    if (fread(le->data, 1, le->datalen, l->f) != (size_t) le->datalen) {
-        free(le->channel);
-        free(le->data);
-        free(le);
-        return NULL;
+    if (fread(le->channel, 1, le->channellen, l->f) != (size_t) le->channellen)
+        return -1;
+    le->channel[le->channellen] = '\0';
+    int wanted = !skipUnwanted || !l->priv->filter ||
+                 filter_wants(l->priv->filter, le->channel, le->channellen);
+    if (!wanted) {
+        if (fseeko(l->f, le->datalen, SEEK_CUR) != 0)
+            return -1;
+    } else {
+        if (fread(le->data, 1, le->datalen, l->f) != (size_t) le->datalen)
+            return -1;
+        ((char*)le->data)[le->datalen] = '\0';
     }
 
     // Check that there's a valid event or the EOF after this event.
@@ -172,10 +2653,7 @@ static zcm_eventlog_event_t *zcm_event_read_helper(zcm_eventlog_t *l, int rewind
     if (0 == fread32(l->f, &next_magic)) {
         if (next_magic != MAGIC) {
             fprintf(stderr, "Invalid header after log data\n");
-            free(le->channel);
-            free(le->data);
-            free(le);
-            return NULL;
+            return -1;
         }
         fseeko (l->f, -4, SEEK_CUR);
     }
@@ -183,26 +2661,356 @@ static zcm_eventlog_event_t *zcm_event_read_helper(zcm_eventlog_t *l, int rewind
         fseeko (l->f, -(sizeof(int64_t) * 2 + sizeof(int32_t) * 3 +
                         le->datalen + le->channellen), SEEK_CUR);
     }
+    return wanted ? 0 : 1;
+}
+
+static int read_event(zcm_eventlog_t *l, zcm_eventlog_event_t *le, int rewindWhenDone,
+                      int skipUnwanted)
+{
+    if (l->priv->dict)
+        return v2_read_event(l, le, rewindWhenDone, skipUnwanted);
+    if (l->priv->mapped)
+        return read_event_mapped(l, le, rewindWhenDone, skipUnwanted);
+    return read_event_stdio(l, le, rewindWhenDone, skipUnwanted);
+}
+
+static int read_next(zcm_eventlog_t *l, zcm_eventlog_event_t *le)
+{
+    int ret;
+    if (l->priv->blocks) {
+        // Blocks are decompressed whole, unwanted events are only not returned
+        while ((ret = blocks_read_next(l, le)) == 0 && l->priv->filter &&
+               !filter_wants(l->priv->filter, le->channel, le->channellen)) {}
+        return ret;
+    }
+    do {
+        if (sync_stream(l)) return -1;
+    } while ((ret = read_event(l, le, 0, 1)) == 1);
+    return ret;
+}
+
+/**** Prefetching ****/
+// The prefetch thread reads ahead with the eventlog's own cursor and copies events into a
+// ring. Anything else that uses the cursor pauses the thread first, which drops the events
+// read ahead, keeping the last one returned, and moves the cursor back to just after it
+typedef struct _prefetch_slot_t prefetch_slot_t;
+struct _prefetch_slot_t
+{
+    zcm_eventlog_event_t event;
+    uint8_t *buf;
+    size_t   cap;
+    off_t    pos;       // Cursor after this event
+    int64_t  block;
+    int32_t  blockevent;
+};
+
+struct _zcm_eventlog_prefetch_t
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    prefetch_slot_t *slots;
+    size_t  nslots;
+    size_t  maxbytes;
+    size_t  head;       // Oldest event, held by the reader once returned
+    size_t  count;
+    size_t  bytes;
+    int     held;
+
+    int     paused;
+    int     busy;       // Thread is reading
+    int     eof;
+    int     retry;      // Reader wants another try at the end of the log
+    int     quit;
+    int     threadwaits;
+    int     readerwaits;
+
+    prefetch_slot_t resume; // Cursor after the last event returned
+};
+
+// Don't keep huge buffers around in every slot a large event passed through
+#define PREFETCH_SLOT_KEEP_BYTES (64 << 10)
+
+static void cursor_save(zcm_eventlog_t *l, prefetch_slot_t *s)
+{
+    if (l->priv->blocks) {
+        s->block = l->priv->blocks->block;
+        s->blockevent = l->priv->blocks->event;
+    } else {
+        s->pos = tell(l);
+    }
+}
+
+static void cursor_restore(zcm_eventlog_t *l, const prefetch_slot_t *s)
+{
+    if (l->priv->blocks) {
+        l->priv->blocks->block = s->block;
+        l->priv->blocks->event = s->blockevent;
+    } else {
+        seek(l, s->pos);
+    }
+}
+
+static void *prefetch_thread(void *usr)
+{
+    zcm_eventlog_t *l = (zcm_eventlog_t*) usr;
+    zcm_eventlog_prefetch_t *p = l->priv->prefetch;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->quit) {
+        if (p->paused || (p->eof && !p->retry) || p->count == p->nslots ||
+            (p->bytes >= p->maxbytes && p->count > 0)) {
+            p->threadwaits = 1;
+            pthread_cond_wait(&p->cond, &p->lock);
+            p->threadwaits = 0;
+            continue;
+        }
+        p->busy = 1;
+        p->retry = 0;
+        p->eof = 0;
+        prefetch_slot_t *s = &p->slots[(p->head + p->count) % p->nslots];
+        pthread_mutex_unlock(&p->lock);
+
+        zcm_eventlog_event_t le;
+        size_t need = 0;
+        int ret = read_next(l, &le);
+        if (ret == 0)
+            need = le.channellen + 1 + le.datalen + 1;
+        if (ret == 0 && need > s->cap) {
+            uint8_t *buf = (uint8_t*) realloc(s->buf, need);
+            if (buf) {
+                s->buf = buf;
+                s->cap = need;
+            } else {
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            s->event = le;
+            s->event.channel = (char*) s->buf;
+            s->event.data = s->buf + le.channellen + 1;
+            memcpy(s->event.channel, le.channel, le.channellen);
+            s->event.channel[le.channellen] = '\0';
+            memcpy(s->event.data, le.data, le.datalen);
+            ((char*)s->event.data)[le.datalen] = '\0';
+            cursor_save(l, s);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->busy = 0;
+        if (ret == 0) {
+            p->count++;
+            p->bytes += need;
+        } else {
+            p->eof = 1;
+        }
+        // Waking the reader for every event would cost more than reading it
+        if (p->readerwaits)
+            pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// Called with the lock held
+static void prefetch_release(zcm_eventlog_prefetch_t *p)
+{
+    if (!p->held) return;
+    prefetch_slot_t *s = &p->slots[p->head];
+    p->bytes -= s->event.channellen + 1 + s->event.datalen + 1;
+    if (s->cap > PREFETCH_SLOT_KEEP_BYTES) {
+        free(s->buf);
+        s->buf = NULL;
+        s->cap = 0;
+    }
+    p->head = (p->head + 1) % p->nslots;
+    p->count--;
+    p->held = 0;
+}
+
+static void prefetch_pause(zcm_eventlog_t *l)
+{
+    zcm_eventlog_prefetch_t *p = l->priv->prefetch;
+    if (!p) return;
+    pthread_mutex_lock(&p->lock);
+    if (!p->paused) {
+        p->paused = 1;
+        while (p->busy) {
+            p->readerwaits = 1;
+            pthread_cond_wait(&p->cond, &p->lock);
+            p->readerwaits = 0;
+        }
+        cursor_restore(l, &p->resume);
+        // The event returned last stays valid until the next read, so only the events
+        // after it are dropped. The next read releases its slot
+        p->count = p->held;
+        p->bytes = 0;
+        if (p->held) {
+            prefetch_slot_t *s = &p->slots[p->head];
+            p->bytes = s->event.channellen + 1 + s->event.datalen + 1;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static int prefetch_next(zcm_eventlog_t *l, zcm_eventlog_event_t *le)
+{
+    zcm_eventlog_prefetch_t *p = l->priv->prefetch;
+    if (p->paused) {
+        take_cursor(l);
+        cursor_save(l, &p->resume);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    prefetch_release(p);
+    if (p->paused) {
+        p->paused = 0;
+        p->eof = 0;
+    }
+    if (p->count == 0 && p->eof)
+        p->retry = 1;
+    if (p->threadwaits)
+        pthread_cond_broadcast(&p->cond);
+    while (p->count == 0 && (p->retry || !p->eof)) {
+        p->readerwaits = 1;
+        pthread_cond_wait(&p->cond, &p->lock);
+        p->readerwaits = 0;
+    }
+
+    int ret = -1;
+    if (p->count > 0) {
+        prefetch_slot_t *s = &p->slots[p->head];
+        *le = s->event;
+        p->resume = *s;
+        p->held = 1;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static void prefetch_destroy(zcm_eventlog_t *l)
+{
+    zcm_eventlog_prefetch_t *p = l->priv->prefetch;
+    prefetch_pause(l);
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    size_t i;
+    for (i = 0; i < p->nslots; ++i)
+        free(p->slots[i].buf);
+    free(p->slots);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p);
+    l->priv->prefetch = NULL;
+}
+
+int zcm_eventlog_enable_prefetch(zcm_eventlog_t *l, size_t max_events, size_t max_bytes)
+{
+    if (l->priv->writer) return -1;
+    if (l->priv->prefetch) prefetch_destroy(l);
+    if (max_events == 0) return 0;
+
+    zcm_eventlog_prefetch_t *p =
+        (zcm_eventlog_prefetch_t*) calloc(1, sizeof(zcm_eventlog_prefetch_t));
+    if (!p) return -1;
+    // One more slot than asked for is held by the reader
+    p->nslots = max_events + 1;
+    p->slots = (prefetch_slot_t*) calloc(p->nslots, sizeof(prefetch_slot_t));
+    if (!p->slots) {
+        free(p);
+        return -1;
+    }
+    p->maxbytes = max_bytes;
+    p->paused = 1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    l->priv->prefetch = p;
+    if (pthread_create(&p->thread, NULL, prefetch_thread, l) != 0) {
+        free(p->slots);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+        free(p);
+        l->priv->prefetch = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int zcm_eventlog_read_next_event_view(zcm_eventlog_t *l, zcm_eventlog_event_t *le)
+{
+    if (l->priv->prefetch)
+        return prefetch_next(l, le);
+    take_cursor(l);
+    return read_next(l, le);
+}
+
+int zcm_eventlog_read_prev_event_view(zcm_eventlog_t *l, zcm_eventlog_event_t *le)
+{
+    take_cursor(l);
+    int ret;
+    if (l->priv->blocks) {
+        while ((ret = blocks_read_prev(l, le)) == 0 && l->priv->filter &&
+               !filter_wants(l->priv->filter, le->channel, le->channellen)) {}
+        return ret;
+    }
+    do {
+        if (sync_stream_backwards(l) < 0) return -1;
+    } while ((ret = read_event(l, le, 1, 1)) == 1);
+    return ret;
+}
+
+int zcm_eventlog_read_event_at_offset_view(zcm_eventlog_t *l, off_t offset,
+                                           zcm_eventlog_event_t *le)
+{
+    take_cursor(l);
+    if (l->priv->blocks)
+        return blocks_seek_offset(l, offset) == 0 ? blocks_read_next(l, le) : -1;
+    seek(l, offset);
+    if (sync_stream(l)) return -1;
+    return read_event(l, le, 0, 0);
+}
+
+// Copies a view into a newly allocated event
+static zcm_eventlog_event_t *copy_event(const zcm_eventlog_event_t *view)
+{
+    zcm_eventlog_event_t *le =
+        (zcm_eventlog_event_t*) calloc(1, sizeof(zcm_eventlog_event_t));
+    *le = *view;
+
+    le->channel = (char *) calloc(1, le->channellen+1);
+    memcpy(le->channel, view->channel, le->channellen);
+
+    le->data = calloc(1, le->datalen+1);
+    memcpy(le->data, view->data, le->datalen);
+
     return le;
 }
 
 zcm_eventlog_event_t *zcm_eventlog_read_next_event(zcm_eventlog_t *l)
 {
-    if (sync_stream(l)) return NULL;
-    return zcm_event_read_helper(l, 0);
+    zcm_eventlog_event_t view;
+    if (zcm_eventlog_read_next_event_view(l, &view)) return NULL;
+    return copy_event(&view);
 }
 
 zcm_eventlog_event_t *zcm_eventlog_read_prev_event(zcm_eventlog_t *l)
 {
-    if (sync_stream_backwards(l) < 0) return NULL;
-    return zcm_event_read_helper(l, 1);
+    zcm_eventlog_event_t view;
+    if (zcm_eventlog_read_prev_event_view(l, &view)) return NULL;
+    return copy_event(&view);
 }
 
 zcm_eventlog_event_t *zcm_eventlog_read_event_at_offset(zcm_eventlog_t *l, off_t offset)
 {
-    fseeko(l->f, offset, SEEK_SET);
-    if (sync_stream(l)) return NULL;
-    return zcm_event_read_helper(l, 0);
+    zcm_eventlog_event_t view;
+    if (zcm_eventlog_read_event_at_offset_view(l, offset, &view)) return NULL;
+    return copy_event(&view);
 }
 
 void zcm_eventlog_free_event(zcm_eventlog_event_t *le)
@@ -215,21 +3023,317 @@ void zcm_eventlog_free_event(zcm_eventlog_event_t *le)
 
 int zcm_eventlog_write_event(zcm_eventlog_t *l, zcm_eventlog_event_t *le)
 {
-    if (0 != fwrite32(l->f, MAGIC)) return -1;
+    if (!l->priv->writer) {
+        errno = EBADF;
+        return -1;
+    }
+
+    off_t offset = l->priv->writepos;
 
     le->eventnum = l->eventcount;
 
-    if (0 != fwrite64(l->f, le->eventnum)) return -1;
-    if (0 != fwrite64(l->f, le->timestamp)) return -1;
-    if (0 != fwrite32(l->f, le->channellen)) return -1;
-    if (0 != fwrite32(l->f, le->datalen)) return -1;
+    if (l->priv->blocks) {
+        if (blocks_write_event(l, le) != 0) return -1;
+        l->eventcount++;
+        return 0;
+    }
+
+    if (l->priv->dict) {
+        int err = v2_write_event(l, le, &offset);
+        if (err) {
+            errno = err;
+            return -1;
+        }
+    } else {
+        size_t len = EVENT_BYTES(le);
+        int err = writer_reserve(l->priv->writer, len);
+        if (err) {
+            errno = err;
+            return -1;
+        }
+        put_event(l->priv->writer->bufs[l->priv->writer->active] + l->priv->writer->len, le);
+        l->priv->writer->len += len;
+        l->priv->writepos += len;
+    }
+    l->eventcount++;
+
+    if (l->priv->index && index_event(l->priv->index, le, offset) != 0) {
+        // The log itself is fine, just stop indexing it
+        fprintf(stderr, "Unable to write log index, disabling it\n");
+        index_destroy(l->priv->index);
+        l->priv->index = NULL;
+    }
+
+    return 0;
+}
+
+size_t zcm_eventlog_write_events(zcm_eventlog_t *l, zcm_eventlog_event_t *events, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (zcm_eventlog_write_event(l, &events[i]) != 0)
+            break;
+    }
+    return i;
+}
+
+int zcm_eventlog_flush(zcm_eventlog_t *l)
+{
+    if (!l->priv->writer) return 0;
+
+    // Compression threads write blocks out concurrently
+    int err;
+    if (l->priv->blocks && l->priv->blocks->nthreads > 0) {
+        pthread_mutex_lock(&l->priv->blocks->lock);
+        err = writer_flush(l->priv->writer);
+        pthread_mutex_unlock(&l->priv->blocks->lock);
+    } else {
+        err = writer_flush(l->priv->writer);
+    }
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int zcm_eventlog_flush_async(zcm_eventlog_t *l)
+{
+    if (!l->priv->writer) return 0;
 
-    if (le->channellen != fwrite(le->channel, 1, le->channellen, l->f))
+    // Compression threads write blocks out concurrently. One busy writing a block out
+    // holds the lock for as long as that takes, so this leaves the flush to a later call
+    int err;
+    if (l->priv->blocks && l->priv->blocks->nthreads > 0) {
+        if (pthread_mutex_trylock(&l->priv->blocks->lock) != 0) return 0;
+        err = writer_flush_async(l->priv->writer);
+        pthread_mutex_unlock(&l->priv->blocks->lock);
+    } else {
+        err = writer_flush_async(l->priv->writer);
+    }
+    if (err) {
+        errno = err;
         return -1;
-    if (le->datalen != fwrite(le->data, 1, le->datalen, l->f))
+    }
+    return 0;
+}
+
+void zcm_eventlog_get_write_stats(zcm_eventlog_t *l, zcm_eventlog_write_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    // Compression threads write blocks out concurrently
+    zcm_eventlog_blocks_t *b = (l->priv->blocks && l->priv->blocks->nthreads > 0) ? l->priv->blocks : NULL;
+    if (b) {
+        pthread_mutex_lock(&b->lock);
+        stats->queued_blocks = b->fill - b->head;
+        stats->compress_waits = b->waits;
+    }
+
+    zcm_eventlog_writer_t *w = l->priv->writer;
+    if (w) {
+        if (w->running) pthread_mutex_lock(&w->lock);
+        stats->buffered_bytes = w->len + w->pendlen;
+        int i;
+        for (i = 0; i < w->nbufs; ++i)
+            stats->buffered_bytes += w->inflight[i];
+        stats->disk_waits = w->waits;
+        if (w->running) pthread_mutex_unlock(&w->lock);
+    }
+
+    if (b) pthread_mutex_unlock(&b->lock);
+}
+
+int zcm_eventlog_set_write_buffer(zcm_eventlog_t *l, size_t buffer_size, int flags)
+{
+    if (!l->priv->writer || l->priv->blocks) return -1;
+
+    int err = writer_destroy(l->priv->writer);
+    l->priv->writer = writer_create(fileno(l->f), l->priv->writepos, buffer_size, flags);
+    if (!l->priv->writer) {
+        // Keep the log writable
+        l->priv->writer = writer_create(fileno(l->f), l->priv->writepos, WRITE_BUFFER_DEFAULT, 0);
         return -1;
+    }
+    return err ? -1 : 0;
+}
 
-    l->eventcount++;
+/**** Parallel scanning ****/
+typedef struct _scan_t scan_t;
+struct _scan_t
+{
+    const char *path;
+    int     nshards;
+    off_t   filelen;
+    zcm_eventlog_scan_handler_t handler;
+    zcm_eventlog_scan_merge_t   merge;
+    void   *usr;
+
+    pthread_mutex_t lock;
+    int     next;       // Next shard to scan
+    int     merged;     // Shards merged so far
+    int     merging;    // Whether a thread is calling 'merge'
+    uint8_t *done;      // For each shard
+    int     stopped;
+    int     failed;
+};
+
+// Whether the magic the cursor was just synced past starts a version 1 event, i.e. the event
+// is followed by another magic or the end of the file. Data can hold the magic too
+static int scan_at_event(zcm_eventlog_t *l, off_t filelen)
+{
+    if (l->priv->dict) return 1;
+
+    off_t pos = tell(l);
+    uint8_t hdr[EVENT_HEADER_BYTES];
+    if (read_at(l, pos, hdr, sizeof(hdr)) != 0)
+        return 0;
+    int32_t channellen = read_be32(hdr + 16);
+    int32_t datalen = read_be32(hdr + 20);
+    if (channellen <= 0 || channellen >= 1000 || datalen < 0)
+        return 0;
+    off_t end = pos + EVENT_HEADER_BYTES + channellen + datalen;
+    int32_t magic;
+    if (end == filelen)
+        return 1;
+    return read_at(l, end, &magic, sizeof(magic)) == 0 &&
+           read_be32((const uint8_t*)&magic) == MAGIC;
+}
+
+// Passes the events starting in [begin, end) of an uncompressed log to the handler
+static int scan_shard(scan_t *s, zcm_eventlog_t *l, int shard, off_t begin, off_t end)
+{
+    zcm_eventlog_event_t le;
+    int first = 1;
+    seek(l, begin);
+    while (sync_stream(l) == 0) {
+        if (tell(l) - 4 >= end)
+            break;
+        if (first && !scan_at_event(l, s->filelen))
+            continue;
+        first = 0;
+        // Skip past an unreadable event
+        if (read_event(l, &le, 0, 0) != 0)
+            continue;
+        if (s->handler(shard, &le, s->usr) != 0)
+            return 1;
+    }
+    return 0;
+}
 
+// Same as above for the blocks starting in [begin, end) of a compressed log
+static int scan_shard_blocks(scan_t *s, zcm_eventlog_t *l, int shard, off_t begin, off_t end)
+{
+    zcm_eventlog_blocks_t *b = l->priv->blocks;
+    zcm_eventlog_event_t le;
+    blocks_scan(l);
+
+    size_t lo = 0, hi = b->nentries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (b->entries[mid].fileoff < begin)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    b->block = lo;
+    b->event = 0;
+    while (b->block < (int64_t)b->nentries && b->entries[b->block].fileoff < end) {
+        // Don't decompress the first block of the next shard
+        if (b->event >= b->entries[b->block].nevents &&
+            (b->block + 1 >= (int64_t)b->nentries || b->entries[b->block + 1].fileoff >= end))
+            break;
+        if (blocks_read_next(l, &le) != 0)
+            break;
+        if (s->handler(shard, &le, s->usr) != 0)
+            return 1;
+    }
     return 0;
 }
+
+static void *scan_worker(void *usr)
+{
+    scan_t *s = (scan_t*) usr;
+    zcm_eventlog_t *l = zcm_eventlog_create(s->path, "r");
+
+    pthread_mutex_lock(&s->lock);
+    if (!l) s->failed = 1;
+    while (!s->stopped && !s->failed && s->next < s->nshards) {
+        int shard = s->next++;
+        pthread_mutex_unlock(&s->lock);
+
+        off_t begin = s->filelen * shard / s->nshards;
+        off_t end = s->filelen * (shard + 1) / s->nshards;
+        int stop = l->priv->blocks ? scan_shard_blocks(s, l, shard, begin, end)
+                             : scan_shard(s, l, shard, begin, end);
+
+        pthread_mutex_lock(&s->lock);
+        if (stop) s->stopped = 1;
+        s->done[shard] = 1;
+        if (!s->merge || s->merging) continue;
+
+        // Merge every shard scanned in order so far. Shards that finish meanwhile are
+        // merged by this thread too, so that merges are never concurrent
+        s->merging = 1;
+        while (!s->stopped && s->merged < s->nshards && s->done[s->merged]) {
+            int m = s->merged++;
+            pthread_mutex_unlock(&s->lock);
+            s->merge(m, s->usr);
+            pthread_mutex_lock(&s->lock);
+        }
+        s->merging = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (l) zcm_eventlog_destroy(l);
+    return NULL;
+}
+
+int zcm_eventlog_scan_parallel(const char *path, int nshards, int nthreads,
+                               zcm_eventlog_scan_handler_t handler,
+                               zcm_eventlog_scan_merge_t merge, void *usr)
+{
+    struct stat st;
+    if (nshards <= 0 || !handler || stat(path, &st) != 0)
+        return -1;
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > nshards)
+        nthreads = nshards;
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    scan_t s;
+    memset(&s, 0, sizeof(s));
+    s.path = path;
+    s.nshards = nshards;
+    s.filelen = st.st_size;
+    s.handler = handler;
+    s.merge = merge;
+    s.usr = usr;
+    s.done = (uint8_t*) calloc(nshards, 1);
+    pthread_t *threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+    if (!s.done || !threads) {
+        free(s.done);
+        free(threads);
+        return -1;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+
+    // The calling thread scans too
+    int i, nstarted = 0;
+    for (i = 1; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, scan_worker, &s) != 0)
+            break;
+        nstarted++;
+    }
+    scan_worker(&s);
+    for (i = 1; i <= nstarted; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&s.lock);
+    free(s.done);
+    free(threads);
+    if (s.failed) return -1;
+    return s.stopped ? 1 : 0;
+}
@@ -20,11 +20,17 @@ struct _zcm_eventlog_event_t
     void   *data;
 };
 
+typedef struct _zcm_eventlog_private_t zcm_eventlog_private_t;
+
 typedef struct _zcm_eventlog_t zcm_eventlog_t;
 struct _zcm_eventlog_t
 {
     FILE *f;
     int64_t eventcount;
+
+    /* Private: everything else, kept out of this struct so that its layout doesn't
+     * change whenever an eventlog feature needs more state */
+    zcm_eventlog_private_t *priv;
 };
 
 /**** Methods for creation/deletion ****/
@@ -33,8 +39,78 @@ void zcm_eventlog_destroy(zcm_eventlog_t *eventlog);
 
 
 /**** Methods for general operations ****/
+// NOTE: The position of the returned FILE* is only kept in sync with reads done through
+//       the eventlog when zcm_eventlog_get_fileptr() is called again after those reads
+// NOTE: For writers this flushes the events written so far, see zcm_eventlog_flush()
+// NOTE: For compressed logs this is the compressed file. Moving its position moves the
+//       eventlog to the start of the block containing the new position
 FILE *zcm_eventlog_get_fileptr(zcm_eventlog_t *eventlog);
+// Seeks so that the next event read is the first one with a timestamp >= 'ts'.
+// Exact and O(log n) when the log has an index, otherwise this bisects the file and
+// only lands near 'ts'. Returns 0 on success -1 on failure
 int zcm_eventlog_seek_to_timestamp(zcm_eventlog_t *eventlog, int64_t ts);
+// Seeks so that the next event read is the one numbered 'eventnum'
+// Returns 0 on success -1 if there is no such event
+int zcm_eventlog_seek_to_eventnum(zcm_eventlog_t *eventlog, int64_t eventnum);
+
+#define ZCM_EVENTLOG_INDEX_SUFFIX ".zidx"
+
+// Makes a writer keep a seek index in a sidecar file, "<path>.zidx", with an entry at least
+// every 'stride_events' events or every 'stride_usec' microseconds of log time (either may
+// be 0 to disable that stride). Readers load the sidecar automatically when present. Must
+// be called before any event is written. Returns 0 on success -1 on failure
+int zcm_eventlog_enable_index(zcm_eventlog_t *eventlog, int64_t stride_events,
+                              int64_t stride_usec);
+
+// Makes a writer store events in independently compressed blocks holding about
+// 'block_size' bytes of events each, followed by an index of the blocks. Readers detect
+// compressed logs automatically and only decompress the blocks they read. 'level' is the
+// zlib compression level (-1 for the default). When 'nthreads' > 0, blocks are compressed
+// and written by that many background threads, otherwise by the thread that fills them.
+// Events reach the file a block at a time. Offsets passed to read_event_at_offset() are
+// offsets into the uncompressed events, i.e. the same as in an uncompressed copy of the log.
+// Must be called before any event is written and can't be combined with a seek index
+// (the block index serves the same purpose). Returns 0 on success -1 on failure, which
+// includes zcm being built without zlib
+int zcm_eventlog_enable_compression(zcm_eventlog_t *eventlog, int level, size_t block_size,
+                                    int nthreads);
+
+// The original log format, with the channel name repeated in every event
+#define ZCM_EVENTLOG_FORMAT_V1 1
+// Channel names are stored once, in a dictionary, and every event has a fixed size,
+// 8 byte aligned header referring to its channel by id. Smaller for small messages and
+// faster to scan. Not readable by versions of zcm that predate it
+#define ZCM_EVENTLOG_FORMAT_V2 2
+
+// Chooses the format a writer writes. Readers detect the format automatically. Must be
+// called before any event is written (appending to a log keeps its format) and can't be
+// combined with compression. Returns 0 on success -1 on failure
+int zcm_eventlog_set_format(zcm_eventlog_t *eventlog, int format);
+
+
+// Decides whether events on a channel are wanted. Returns non-zero if they are
+typedef int (*zcm_eventlog_channel_filter_t)(const char *channel, int32_t channellen,
+                                             void *usr);
+
+// Makes read_next_event() and read_prev_event() (and their views) skip events on channels
+// 'wanted' rejects, stepping over their data without reading it. 'wanted' is asked once
+// per channel, with a null terminated name. Seeking and read_event_at_offset() are not
+// filtered. A NULL 'wanted' removes the filter. Readers only. Returns 0 on success -1 on
+// failure
+int zcm_eventlog_set_channel_filter(zcm_eventlog_t *eventlog,
+                                    zcm_eventlog_channel_filter_t wanted, void *usr);
+// Same as above, keeping the channels whose whole name matches the POSIX extended 'regex'
+int zcm_eventlog_set_channel_regex(zcm_eventlog_t *eventlog, const char *regex);
+
+// Makes a reader read ahead on a background thread, so that read_next_event() (and its
+// view) usually returns an event that was already read in and copied, and slow reads (e.g.
+// page faults on a spinning disk or a network mount) don't stall the caller. Up to
+// 'max_events' events and about 'max_bytes' bytes of them are kept ahead of the reader.
+// Any other read or seek drops the events read ahead, so prefetching only pays off when
+// reading forwards. When set, the channel filter is called on the background thread.
+// 'max_events' of 0 stops prefetching. Returns 0 on success -1 on failure
+int zcm_eventlog_enable_prefetch(zcm_eventlog_t *eventlog, size_t max_events,
+                                 size_t max_bytes);
 
 
 /**** Methods for read/write ****/
@@ -43,7 +119,75 @@ zcm_eventlog_event_t *zcm_eventlog_read_next_event(zcm_eventlog_t *eventlog);
 zcm_eventlog_event_t *zcm_eventlog_read_prev_event(zcm_eventlog_t *eventlog);
 zcm_eventlog_event_t *zcm_eventlog_read_event_at_offset(zcm_eventlog_t *eventlog, off_t offset);
 void zcm_eventlog_free_event(zcm_eventlog_event_t *event);
+// NOTE: Written events are buffered in memory until the buffer fills up, the eventlog is
+//       flushed or it is destroyed. On failure errno is set and all later writes fail
 int zcm_eventlog_write_event(zcm_eventlog_t *eventlog, zcm_eventlog_event_t *event);
+// Writes 'n' events. Returns the number written, which is less than 'n' only on failure
+size_t zcm_eventlog_write_events(zcm_eventlog_t *eventlog, zcm_eventlog_event_t *events,
+                                 size_t n);
+// Hands the buffered events to the OS (use fdatasync() on the file to make them durable).
+// Returns 0 on success -1 on failure with errno set
+int zcm_eventlog_flush(zcm_eventlog_t *eventlog);
+// Like zcm_eventlog_flush(), but only starts the buffered events being written out by the
+// background writes of a ZCM_EVENTLOG_WRITE_ASYNC writer, without waiting for them. If they
+// are all still busy the events stay buffered for a later call. Returns 0 on success -1 on
+// failure with errno set
+int zcm_eventlog_flush_async(zcm_eventlog_t *eventlog);
+
+// Write buffers out in the background while the next one is being filled. Several writes
+// are kept in flight through io_uring when ZCM is built with it and the kernel supports it,
+// otherwise a background thread writes one buffer at a time
+#define ZCM_EVENTLOG_WRITE_ASYNC  0x1
+// Write through O_DIRECT, bypassing the page cache. Needs the log to be empty or to end on
+// a 4096 byte boundary when appending
+#define ZCM_EVENTLOG_WRITE_DIRECT 0x2
+
+// Sets how a writer buffers events: 'buffer_size' bytes (rounded up to a multiple of 4096)
+// are written out at a time, and 'flags' is a combination of the ZCM_EVENTLOG_WRITE_* above.
+// Writers start with a 64kB buffer written synchronously. Must be called before
+// zcm_eventlog_enable_compression(). Returns 0 on success -1 on failure
+int zcm_eventlog_set_write_buffer(zcm_eventlog_t *eventlog, size_t buffer_size, int flags);
+
+typedef struct _zcm_eventlog_write_stats_t zcm_eventlog_write_stats_t;
+struct _zcm_eventlog_write_stats_t
+{
+    uint64_t buffered_bytes;  /* written but not yet handed to the OS */
+    uint64_t disk_waits;      /* times writing had to wait for the disk */
+    uint64_t queued_blocks;   /* compressed logs: blocks waiting to be compressed or written */
+    uint64_t compress_waits;  /* compressed logs: times writing had to wait for compression */
+};
+// Fills in how far behind the stages of a writer are. Counts are since creation
+void zcm_eventlog_get_write_stats(zcm_eventlog_t *eventlog, zcm_eventlog_write_stats_t *stats);
+
+/**** Methods for zero-copy reads ****/
+// These fill in 'event' without allocating or copying: 'channel' and 'data' point directly
+// into the memory mapped log. They remain valid only until the next read on the eventlog
+// and must not be freed. Note that 'channel' is NOT null terminated, use 'channellen'.
+// Returns 0 on success and -1 at the end of the log or on error.
+int zcm_eventlog_read_next_event_view(zcm_eventlog_t *eventlog, zcm_eventlog_event_t *event);
+int zcm_eventlog_read_prev_event_view(zcm_eventlog_t *eventlog, zcm_eventlog_event_t *event);
+int zcm_eventlog_read_event_at_offset_view(zcm_eventlog_t *eventlog, off_t offset,
+                                           zcm_eventlog_event_t *event);
+
+/**** Methods for parallel scanning ****/
+// Called for every event of a shard on the thread scanning it, see zcm_eventlog_scan_parallel().
+// 'event' is only valid during the call. Returns 0 to continue, non-zero to stop the scan
+typedef int (*zcm_eventlog_scan_handler_t)(int shard, const zcm_eventlog_event_t *event,
+                                           void *usr);
+// Called once for every shard after it has been scanned
+typedef void (*zcm_eventlog_scan_merge_t)(int shard, void *usr);
+
+// Scans the log at 'path' on 'nthreads' threads (0 for one per core). The file is split into
+// 'nshards' byte ranges of about equal size, and each shard is scanned by one thread from the
+// first event starting in it (for compressed logs, the first block). The handler is called
+// for the events of a shard in log order, but for different shards concurrently, so keep
+// results per shard. 'merge' (can be NULL) is then called for the shards one at a time, in
+// shard order, as soon as a shard and all shards before it have been scanned. Shard order is
+// log order, which is event number order for logs with a single writer.
+// Returns 0 once the whole log was scanned, 1 if a handler stopped the scan, -1 on failure
+int zcm_eventlog_scan_parallel(const char *path, int nshards, int nthreads,
+                               zcm_eventlog_scan_handler_t handler,
+                               zcm_eventlog_scan_merge_t merge, void *usr);
 
 
 #ifdef __cplusplus
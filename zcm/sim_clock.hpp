@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include <zcm/zcm-cpp.hpp>
+
+namespace zcm {
+
+// The log time of a lockstep playback ('file://vehicle.log?lockstep', or
+// 'zcm-logplayer --lockstep'), for code under test to read instead of the wall clock.
+//
+// Playback announces every message with a tick on the clock channel and waits for the
+// tick to be acknowledged before playing the message. The clock acknowledges ticks
+// from the dispatch thread, after the handlers of every message before the tick
+// returned, so a slow handler slows the playback down rather than missing messages.
+// When several processes follow one playback, either all of them acknowledge
+// (zcm-logplayer --lockstep=N) or only one does and the others pass acknowledge=false.
+class SimClock
+{
+  public:
+    static constexpr const char* CLOCK_CHANNEL = "ZCM_FILE_CLOCK";
+    static constexpr const char* CONTROL_CHANNEL = "ZCM_FILE_CONTROL";
+
+  private:
+    zcm::ZCM* zcmLocal;
+    bool acknowledge;
+    zcm::Subscription* s;
+
+    std::atomic<int64_t> now {-1};
+    std::mutex lock;
+    std::condition_variable ticked;
+
+    static void handle(const zcm::ReceiveBuffer* rbuf, const std::string& chan, void* usr)
+    {
+        SimClock* me = (SimClock*) usr;
+        // The tick is the log time in decimal. Unlike recv_utime it survives being
+        // republished on another transport
+        std::string tick(rbuf->data, rbuf->data_size);
+        {
+            std::unique_lock<std::mutex> lk(me->lock);
+            me->now = std::stoll(tick);
+        }
+        me->ticked.notify_all();
+
+        if (me->acknowledge) {
+            std::string ack = "ACK " + tick;
+            me->zcmLocal->publish(CONTROL_CHANNEL, ack.c_str(), ack.size());
+        }
+    }
+
+  public:
+    SimClock(zcm::ZCM* zcmLocal, bool acknowledge = true)
+        : zcmLocal(zcmLocal), acknowledge(acknowledge)
+    {
+        s = zcmLocal->subscribe(CLOCK_CHANNEL, &SimClock::handle, this);
+    }
+
+    virtual ~SimClock()
+    {
+        zcmLocal->unsubscribe(s);
+    }
+
+    // Log time of the message being played, -1 before the first one
+    int64_t utime() const { return now; }
+
+    // Waits until the clock reaches 'utime'. Returns false if it didn't within
+    // 'timeoutMs' milliseconds. Must not be called from a handler, which would keep
+    // the clock from ever moving
+    bool waitUntil(int64_t utime, int timeoutMs)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        return ticked.wait_for(lk, std::chrono::milliseconds(timeoutMs),
+                               [&](){ return now >= utime; });
+    }
+};
+
+}
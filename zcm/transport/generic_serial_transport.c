@@ -7,19 +7,47 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define MTU 128
-#define BUFFER_SIZE 5*MTU+5*ZCM_CHANNEL_MAXLEN
+#define MTU ZCM_GENERIC_SERIAL_MTU
+#define BUFFER_SIZE ZCM_GENERIC_SERIAL_BUFFER_SIZE
 #define ESCAPE_CHAR (0xcc)
 
-// Framing (size = 8 + chan_len + data_len)
-//   0xCC
-//   0x00
+// Frame contents
 //   chan_len
 //   data_len  (4 bytes)
 //   *chan
 //   *data
-//   sum(*chan, *data)
-#define FRAME_BYTES 8
+//   crc16(chan_len, data_len, *chan, *data)  (2 bytes)
+#define HEADER_BYTES 5
+#define CRC_BYTES 2
+#define MAX_DECODED_BYTES (HEADER_BYTES + ZCM_CHANNEL_MAXLEN + MTU + CRC_BYTES)
+
+#ifndef ZCM_GENERIC_SERIAL_COBS
+// Escape framing (size = 9 + chan_len + data_len + number of escaped bytes)
+//   0xCC 0x00 sync, followed by the frame contents.
+// Every byte after the sync is escaped by sending 0xCC twice
+#define FRAME_BYTES (2 + HEADER_BYTES + CRC_BYTES)
+#define MAX_ENCODED_BYTES (2 + 2 * MAX_DECODED_BYTES)
+#else
+// COBS framing (size <= 1 + n + n/254 + 1 for n bytes of frame contents)
+//   The frame contents are COBS encoded, so they contain no zero bytes, and
+//   a 0x00 delimiter marks the end of each frame
+#define COBS_MAX_ENCODED(n) ((n) + (n)/254 + 1)
+#define MAX_ENCODED_BYTES (COBS_MAX_ENCODED(MAX_DECODED_BYTES) + 1)
+#endif
+
+// Fails to compile if a max size frame cannot fit in the buffers
+typedef char buffer_size_check_t[(BUFFER_SIZE > MAX_ENCODED_BYTES) ? 1 : -1];
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xffff), must match transport_serial.cpp
+#define CRC16_INIT 0xffff
+static uint16_t crc16_update(uint16_t crc, uint8_t d)
+{
+    int i;
+    crc ^= (uint16_t)d << 8;
+    for (i = 0; i < 8; ++i)
+        crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    return crc;
+}
 
 // Note: there is little to no error checking in this, misuse will cause problems
 typedef struct circBuffer_t circBuffer_t;
@@ -136,7 +164,13 @@ struct zcm_trans_generic_serial_t
     circBuffer_t sendBuffer;
     circBuffer_t recvBuffer;
     char         recvChanName[ZCM_CHANNEL_MAXLEN+1];
+#ifndef ZCM_GENERIC_SERIAL_COBS
     char         recvMsgData[MTU];
+#else
+    uint8_t      recvFrame[MAX_DECODED_BYTES];
+    uint32_t     recvScanned; // bytes of recvBuffer known to hold no delimiter
+    bool         recvDiscard; // dropping an oversized frame up to its delimiter
+#endif
 
     uint32_t (*get)(uint8_t* data, uint32_t nData, void* usr);
     uint32_t (*put)(const uint8_t* data, uint32_t nData, void* usr);
@@ -151,66 +185,116 @@ size_t serial_get_mtu(zcm_trans_generic_serial_t *zt)
     return MTU;
 }
 
-int serial_sendmsg(zcm_trans_generic_serial_t *zt, zcm_msg_t msg)
+#ifndef ZCM_GENERIC_SERIAL_COBS
+static uint32_t count_escapes(const uint8_t* data, size_t len)
 {
-    size_t chan_len = strlen(msg.channel);
-    size_t nPushed = 0;
-
-    if (chan_len > ZCM_CHANNEL_MAXLEN)                               return ZCM_EINVALID;
-    if (msg.len > MTU)                                               return ZCM_EINVALID;
-    if (FRAME_BYTES + chan_len + msg.len > cb_room(&zt->sendBuffer)) return ZCM_EAGAIN;
-
-    cb_push(&zt->sendBuffer, ESCAPE_CHAR); nPushed++;
-    cb_push(&zt->sendBuffer, 0x00);        nPushed++;
-    cb_push(&zt->sendBuffer, chan_len);    nPushed++;
-
-    uint32_t len = (uint32_t)msg.len;
-    cb_push(&zt->sendBuffer, (len>>24)&0xff); nPushed++;
-    cb_push(&zt->sendBuffer, (len>>16)&0xff); nPushed++;
-    cb_push(&zt->sendBuffer, (len>> 8)&0xff); nPushed++;
-    cb_push(&zt->sendBuffer, (len>> 0)&0xff); nPushed++;
-
-    uint8_t sum = 0;
-    int i;
-    for (i = 0; i < chan_len; ++i) {
-        char c = msg.channel[i];
-
-        cb_push(&zt->sendBuffer, c); nPushed++;
-
-        if (c == ESCAPE_CHAR) {
-        	// the escape character doesn't count, so we have chan_len - i characters
-        	// remaining in channel + the msg + the checksum.
-            if (cb_room(&zt->sendBuffer) > chan_len - i + msg.len + 1) {
-                cb_push(&zt->sendBuffer, c); nPushed++;
-            } else {
-                cb_pop(&zt->sendBuffer, nPushed);
-                return ZCM_EAGAIN;
-            }
-        }
+    uint32_t n = 0;
+    size_t i;
+    for (i = 0; i < len; ++i)
+        if (data[i] == ESCAPE_CHAR) n++;
+    return n;
+}
 
-        sum += c;
+static void cb_push_escaped(circBuffer_t* cb, const uint8_t* data, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        cb_push(cb, data[i]);
+        if (data[i] == ESCAPE_CHAR) cb_push(cb, data[i]);
     }
+}
+#else
+// Streams COBS encoded bytes into a circular buffer. Each block starts with a
+// code byte that is filled in once the block is complete.
+typedef struct cobsEncoder_t cobsEncoder_t;
+struct cobsEncoder_t
+{
+    circBuffer_t* cb;
+    int codeIdx;
+    uint8_t code;
+};
 
-    for (i = 0; i < msg.len; ++i) {
-        char c = msg.buf[i];
-
-        cb_push(&zt->sendBuffer, c); nPushed++;
+static void cobs_begin_block(cobsEncoder_t* enc)
+{
+    enc->codeIdx = enc->cb->back;
+    enc->code = 1;
+    cb_push(enc->cb, 0);
+}
 
-        if (c == ESCAPE_CHAR) {
-        	// the escape character doesn't count, so we have msg.len - i characters
-        	// remaining in the msg + the checksum.
-            if (cb_room(&zt->sendBuffer) > msg.len - i + 1) {
-                cb_push(&zt->sendBuffer, c); nPushed++;
-            } else {
-                cb_pop(&zt->sendBuffer, nPushed);
-                return ZCM_EAGAIN;
-            }
+static void cobs_push(cobsEncoder_t* enc, const uint8_t* data, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if (data[i] != 0) {
+            cb_push(enc->cb, data[i]);
+            if (++enc->code != 0xff) continue;
         }
-
-        sum += c;
+        enc->cb->data[enc->codeIdx] = enc->code;
+        cobs_begin_block(enc);
     }
+}
+
+static void cobs_end(cobsEncoder_t* enc)
+{
+    enc->cb->data[enc->codeIdx] = enc->code;
+    cb_push(enc->cb, 0x00);
+}
+#endif
 
-    cb_push(&zt->sendBuffer, sum); nPushed++;
+int serial_sendmsg(zcm_trans_generic_serial_t *zt, zcm_msg_t msg)
+{
+    size_t chan_len = strlen(msg.channel);
+    uint8_t header[HEADER_BYTES];
+    uint8_t footer[CRC_BYTES];
+    uint16_t crc = CRC16_INIT;
+    uint32_t frame_len;
+    size_t i;
+#ifdef ZCM_GENERIC_SERIAL_COBS
+    cobsEncoder_t enc;
+#endif
+
+    if (chan_len > ZCM_CHANNEL_MAXLEN) return ZCM_EINVALID;
+    if (msg.len > MTU)                 return ZCM_EINVALID;
+
+    header[0] = (uint8_t)chan_len;
+    header[1] = (msg.len>>24)&0xff;
+    header[2] = (msg.len>>16)&0xff;
+    header[3] = (msg.len>> 8)&0xff;
+    header[4] = (msg.len>> 0)&0xff;
+
+    for (i = 0; i < HEADER_BYTES; ++i) crc = crc16_update(crc, header[i]);
+    for (i = 0; i < chan_len;     ++i) crc = crc16_update(crc, (uint8_t)msg.channel[i]);
+    for (i = 0; i < msg.len;      ++i) crc = crc16_update(crc, (uint8_t)msg.buf[i]);
+    footer[0] = (crc >> 8) & 0xff;
+    footer[1] = (crc >> 0) & 0xff;
+
+#ifndef ZCM_GENERIC_SERIAL_COBS
+    frame_len = FRAME_BYTES + chan_len + msg.len +
+                count_escapes(header, HEADER_BYTES) +
+                count_escapes((const uint8_t*)msg.channel, chan_len) +
+                count_escapes((const uint8_t*)msg.buf, msg.len) +
+                count_escapes(footer, CRC_BYTES);
+    if (frame_len > cb_room(&zt->sendBuffer)) return ZCM_EAGAIN;
+
+    cb_push(&zt->sendBuffer, ESCAPE_CHAR);
+    cb_push(&zt->sendBuffer, 0x00);
+    cb_push_escaped(&zt->sendBuffer, header, HEADER_BYTES);
+    cb_push_escaped(&zt->sendBuffer, (const uint8_t*)msg.channel, chan_len);
+    cb_push_escaped(&zt->sendBuffer, (const uint8_t*)msg.buf, msg.len);
+    cb_push_escaped(&zt->sendBuffer, footer, CRC_BYTES);
+#else
+    // Bounded overhead, so there is no need to scan the data up front
+    frame_len = COBS_MAX_ENCODED(HEADER_BYTES + chan_len + msg.len + CRC_BYTES) + 1;
+    if (frame_len > cb_room(&zt->sendBuffer)) return ZCM_EAGAIN;
+
+    enc.cb = &zt->sendBuffer;
+    cobs_begin_block(&enc);
+    cobs_push(&enc, header, HEADER_BYTES);
+    cobs_push(&enc, (const uint8_t*)msg.channel, chan_len);
+    cobs_push(&enc, (const uint8_t*)msg.buf, msg.len);
+    cobs_push(&enc, footer, CRC_BYTES);
+    cobs_end(&enc);
+#endif
 
     return ZCM_EOK;
 }
@@ -223,101 +307,211 @@ int serial_recvmsg_enable(zcm_trans_generic_serial_t *zt, const char *channel, b
     return ZCM_EOK;
 }
 
+#ifndef ZCM_GENERIC_SERIAL_COBS
+// Reads one unescaped byte at offset '*consumed' of the recv buffer.
+// Returns 1 on success, 0 if more bytes are needed, and -1 on a bad escape
+static int cb_read_escaped(circBuffer_t* cb, uint32_t* consumed, uint32_t size, uint8_t* out)
+{
+    uint8_t c;
+    if (*consumed >= size) return 0;
+    c = cb_top(cb, *consumed);
+    if (c == ESCAPE_CHAR) {
+        if (*consumed + 1 >= size) return 0;
+        if (cb_top(cb, *consumed + 1) != ESCAPE_CHAR) return -1;
+        (*consumed)++;
+    }
+    (*consumed)++;
+    *out = c;
+    return 1;
+}
+
 int serial_recvmsg(zcm_trans_generic_serial_t *zt, zcm_msg_t *msg, int timeout)
 {
     uint64_t utime = zt->time(zt->time_usr);
-    int incomingSize = cb_size(&zt->recvBuffer);
-    if (incomingSize < FRAME_BYTES)
-        return ZCM_EAGAIN;
-
-    uint32_t consumed = 0;
-
-    // Sync
-    if (cb_top(&zt->recvBuffer, consumed++) != ESCAPE_CHAR) goto fail;
-    if (cb_top(&zt->recvBuffer, consumed++) != 0x00       ) goto fail;
-
-    // Msg sizes
-    uint8_t chan_len = cb_top(&zt->recvBuffer, consumed++);
-    msg->len  = cb_top(&zt->recvBuffer, consumed++) << 24;
-    msg->len |= cb_top(&zt->recvBuffer, consumed++) << 16;
-    msg->len |= cb_top(&zt->recvBuffer, consumed++) << 8;
-    msg->len |= cb_top(&zt->recvBuffer, consumed++);
+    uint32_t incomingSize;
+    uint32_t consumed;
+    uint8_t header[HEADER_BYTES];
+    uint8_t footer[CRC_BYTES];
+    uint8_t chan_len;
+    uint16_t crc;
+    uint32_t i;
+    int rc;
+
+    // Note: because this is a nonblocking transport, timeout is ignored
+    for (;;) {
+        incomingSize = cb_size(&zt->recvBuffer);
+        consumed = 0;
+        crc = CRC16_INIT;
+
+        if (incomingSize < FRAME_BYTES)
+            return ZCM_EAGAIN;
+
+        // Sync
+        if (cb_top(&zt->recvBuffer, 0) != ESCAPE_CHAR) goto fail_sync;
+        if (cb_top(&zt->recvBuffer, 1) != 0x00       ) goto fail_sync;
+        consumed = 2;
+
+        // Msg sizes
+        for (i = 0; i < HEADER_BYTES; ++i) {
+            rc = cb_read_escaped(&zt->recvBuffer, &consumed, incomingSize, &header[i]);
+            if (rc == 0) return ZCM_EAGAIN;
+            if (rc < 0)  goto fail;
+            crc = crc16_update(crc, header[i]);
+        }
 
-    if (chan_len > ZCM_CHANNEL_MAXLEN) goto fail;
-    if (msg->len > MTU)                goto fail;
+        chan_len  = header[0];
+        msg->len  = (uint32_t)header[1] << 24;
+        msg->len |= (uint32_t)header[2] << 16;
+        msg->len |= (uint32_t)header[3] << 8;
+        msg->len |= (uint32_t)header[4];
 
-    if (incomingSize < FRAME_BYTES + chan_len + msg->len) return ZCM_EAGAIN;
+        if (chan_len > ZCM_CHANNEL_MAXLEN) goto fail;
+        if (msg->len > MTU)                goto fail;
 
-    memset(&zt->recvChanName, '0', ZCM_CHANNEL_MAXLEN);
+        if (incomingSize < FRAME_BYTES + chan_len + msg->len) return ZCM_EAGAIN;
 
-    uint8_t sum = 0;
-    int i;
-    for (i = 0; i < chan_len; ++i) {
+        for (i = 0; i < chan_len; ++i) {
+            rc = cb_read_escaped(&zt->recvBuffer, &consumed, incomingSize,
+                                 (uint8_t*)&zt->recvChanName[i]);
+            if (rc == 0) return ZCM_EAGAIN;
+            if (rc < 0)  goto fail;
+            crc = crc16_update(crc, (uint8_t)zt->recvChanName[i]);
+        }
 
-        char c = cb_top(&zt->recvBuffer, consumed++);
+        zt->recvChanName[chan_len] = '\0';
 
-        if (c == ESCAPE_CHAR) {
-        	// the escape character doesn't count, so we have chan_len - i characters
-        	// remaining in channel + the msg + the checksum.
-            if (consumed + chan_len - i + msg->len + 1 > incomingSize) return ZCM_EAGAIN;
+        for (i = 0; i < msg->len; ++i) {
+            rc = cb_read_escaped(&zt->recvBuffer, &consumed, incomingSize,
+                                 (uint8_t*)&zt->recvMsgData[i]);
+            if (rc == 0) return ZCM_EAGAIN;
+            if (rc < 0)  goto fail;
+            crc = crc16_update(crc, (uint8_t)zt->recvMsgData[i]);
+        }
 
-            c = cb_top(&zt->recvBuffer, consumed++);
+        for (i = 0; i < CRC_BYTES; ++i) {
+            rc = cb_read_escaped(&zt->recvBuffer, &consumed, incomingSize, &footer[i]);
+            if (rc == 0) return ZCM_EAGAIN;
+            if (rc < 0)  goto fail;
+        }
 
-            if (c != ESCAPE_CHAR) {
-                consumed-=2;
-                goto fail;
-            }
+        if (crc == (((uint16_t)footer[0] << 8) | footer[1])) {
+            msg->channel = zt->recvChanName;
+            msg->buf     = zt->recvMsgData;
+            msg->utime   = utime;
+            cb_pop(&zt->recvBuffer, consumed);
+            return ZCM_EOK;
         }
 
-        zt->recvChanName[i] = c;
-        sum += c;
+      fail:
+        // Drop this sync marker and look for the next one
+        cb_pop(&zt->recvBuffer, 2);
+        continue;
+
+      fail_sync:
+        // Skip escaped pairs as a whole so that their second byte is never taken as a sync
+        if (cb_top(&zt->recvBuffer, 0) == ESCAPE_CHAR &&
+            cb_top(&zt->recvBuffer, 1) == ESCAPE_CHAR)
+            cb_pop(&zt->recvBuffer, 2);
+        else
+            cb_pop(&zt->recvBuffer, 1);
+    }
+}
+#else
+// Decodes the 'len' COBS encoded bytes at the front of the recv buffer into 'out'.
+// Returns the decoded length, or -1 if the bytes are not a valid encoding
+static int cb_cobs_decode(circBuffer_t* cb, uint32_t len, uint8_t* out, uint32_t outSize)
+{
+    uint32_t in = 0;
+    uint32_t n = 0;
+    uint8_t code;
+    uint8_t i;
+
+    while (in < len) {
+        code = cb_top(cb, in++);
+        if (code == 0 || in + code - 1 > len) return -1;
+        if (n + code - 1 > outSize) return -1;
+        for (i = 1; i < code; ++i) out[n++] = cb_top(cb, in++);
+        if (code != 0xff && in < len) {
+            if (n >= outSize) return -1;
+            out[n++] = 0;
+        }
     }
+    return (int)n;
+}
 
-    zt->recvChanName[chan_len] = '\0';
+int serial_recvmsg(zcm_trans_generic_serial_t *zt, zcm_msg_t *msg, int timeout)
+{
+    uint64_t utime = zt->time(zt->time_usr);
+    uint32_t incomingSize;
+    uint32_t frame_len;
+    uint8_t chan_len;
+    uint16_t crc;
+    int decoded;
+    int i;
 
-    for (i = 0; i < msg->len; ++i) {
-        if (consumed > incomingSize) return ZCM_EAGAIN;
+    // Note: because this is a nonblocking transport, timeout is ignored
+    for (;;) {
+        incomingSize = cb_size(&zt->recvBuffer);
+
+        // Find the delimiter, picking up where the last call left off
+        while (zt->recvScanned < incomingSize &&
+               cb_top(&zt->recvBuffer, zt->recvScanned) != 0x00)
+            zt->recvScanned++;
+
+        if (zt->recvScanned == incomingSize) {
+            if (incomingSize >= MAX_ENCODED_BYTES) {
+                // Too long to be a frame: drop it all the way to its delimiter
+                cb_pop(&zt->recvBuffer, incomingSize);
+                zt->recvScanned = 0;
+                zt->recvDiscard = true;
+            }
+            return ZCM_EAGAIN;
+        }
 
-        char c = cb_top(&zt->recvBuffer, consumed++);
+        frame_len = zt->recvScanned;
+        zt->recvScanned = 0;
+        if (zt->recvDiscard) {
+            zt->recvDiscard = false;
+            cb_pop(&zt->recvBuffer, frame_len + 1);
+            continue;
+        }
 
-        if (c == ESCAPE_CHAR) {
-        	// the escape character doesn't count, so we have msg.len - i characters
-        	// remaining in the msg + the checksum.
-            if (consumed + msg->len - i + 1 > incomingSize) return ZCM_EAGAIN;
+        decoded = cb_cobs_decode(&zt->recvBuffer, frame_len, zt->recvFrame, MAX_DECODED_BYTES);
+        cb_pop(&zt->recvBuffer, frame_len + 1);
+        if (decoded < HEADER_BYTES + CRC_BYTES) continue;
 
-            c = cb_top(&zt->recvBuffer, consumed++);
+        chan_len  = zt->recvFrame[0];
+        msg->len  = (uint32_t)zt->recvFrame[1] << 24;
+        msg->len |= (uint32_t)zt->recvFrame[2] << 16;
+        msg->len |= (uint32_t)zt->recvFrame[3] << 8;
+        msg->len |= (uint32_t)zt->recvFrame[4];
 
-            if (c != ESCAPE_CHAR) {
-                consumed-=2;
-                goto fail;
-            }
-        }
+        if (chan_len > ZCM_CHANNEL_MAXLEN) continue;
+        if (msg->len > MTU)                continue;
+        if ((uint32_t)decoded != HEADER_BYTES + chan_len + msg->len + CRC_BYTES) continue;
 
-        zt->recvMsgData[i] = c;
-        sum += c;
-    }
+        crc = CRC16_INIT;
+        for (i = 0; i < decoded - CRC_BYTES; ++i) crc = crc16_update(crc, zt->recvFrame[i]);
+        if (crc != (((uint16_t)zt->recvFrame[decoded - 2] << 8) | zt->recvFrame[decoded - 1]))
+            continue;
 
-    uint8_t expected = cb_top(&zt->recvBuffer, consumed++);
+        memcpy(zt->recvChanName, zt->recvFrame + HEADER_BYTES, chan_len);
+        zt->recvChanName[chan_len] = '\0';
 
-    if (expected == sum) {
         msg->channel = zt->recvChanName;
-        msg->buf     = zt->recvMsgData;
+        msg->buf     = (char*)zt->recvFrame + HEADER_BYTES + chan_len;
         msg->utime   = utime;
-        cb_pop(&zt->recvBuffer, consumed);
         return ZCM_EOK;
     }
-
-  fail:
-    cb_pop(&zt->recvBuffer, consumed);
-    // Note: because this is a nonblocking transport, timeout is ignored, so we don't need
-    //       to subtract the time used here
-    return serial_recvmsg(zt, msg, timeout);
 }
+#endif
 
 int serial_update(zcm_trans_generic_serial_t *zt)
 {
-    cb_flush_in(&zt->recvBuffer, cb_room(&zt->recvBuffer), zt->get, zt->put_get_usr);
-    cb_flush_out(&zt->sendBuffer, zt->put, zt->put_get_usr);
+    if (zt->get)
+        cb_flush_in(&zt->recvBuffer, cb_room(&zt->recvBuffer), zt->get, zt->put_get_usr);
+    if (zt->put)
+        cb_flush_out(&zt->sendBuffer, zt->put, zt->put_get_usr);
 
     return ZCM_EOK;
 }
@@ -370,6 +564,10 @@ zcm_trans_t *zcm_trans_generic_serial_create(
     zt->trans.vtbl = &methods;
     cb_init(&zt->sendBuffer);
     cb_init(&zt->recvBuffer);
+#ifdef ZCM_GENERIC_SERIAL_COBS
+    zt->recvScanned = 0;
+    zt->recvDiscard = false;
+#endif
 
     zt->get  = get;
     zt->put  = put;
@@ -380,3 +578,32 @@ zcm_trans_t *zcm_trans_generic_serial_create(
 
     return (zcm_trans_t*) zt;
 }
+
+uint32_t zcm_trans_generic_serial_rx_region(zcm_trans_t *_zt, uint8_t **data)
+{
+    circBuffer_t* cb = &cast(_zt)->recvBuffer;
+    *data = cb->data + cb->back;
+    // One byte always stays free so that a full buffer is distinguishable from an empty one
+    if (cb->back < cb->front) return cb->front - cb->back - 1;
+    return BUFFER_SIZE - cb->back - (cb->front == 0 ? 1 : 0);
+}
+
+void zcm_trans_generic_serial_rx_commit(zcm_trans_t *_zt, uint32_t nData)
+{
+    circBuffer_t* cb = &cast(_zt)->recvBuffer;
+    cb->back += nData;
+    if (cb->back >= BUFFER_SIZE) cb->back -= BUFFER_SIZE;
+}
+
+uint32_t zcm_trans_generic_serial_tx_region(zcm_trans_t *_zt, const uint8_t **data)
+{
+    circBuffer_t* cb = &cast(_zt)->sendBuffer;
+    *data = cb->data + cb->front;
+    if (cb->back >= cb->front) return cb->back - cb->front;
+    return BUFFER_SIZE - cb->front;
+}
+
+void zcm_trans_generic_serial_tx_consume(zcm_trans_t *_zt, uint32_t nData)
+{
+    cb_pop(&cast(_zt)->sendBuffer, nData);
+}
@@ -8,6 +8,27 @@ extern "C" {
 #include "zcm/zcm.h"
 #include "zcm/transport.h"
 
+/* Compile time configuration. Override these on the compiler command line,
+ * e.g. -DZCM_GENERIC_SERIAL_MTU=1024
+ *
+ *   ZCM_GENERIC_SERIAL_MTU          largest message payload, in bytes
+ *   ZCM_GENERIC_SERIAL_BUFFER_SIZE  size of each of the send and recv buffers,
+ *                                   must hold at least one max size frame
+ *   ZCM_GENERIC_SERIAL_COBS         if defined, frames are COBS encoded and
+ *                                   terminated by 0x00 instead of 0xCC escaped.
+ *                                   Use the "framing=cobs" option of the serial
+ *                                   transport on the other end of the line.
+ */
+#ifndef ZCM_GENERIC_SERIAL_MTU
+#define ZCM_GENERIC_SERIAL_MTU 128
+#endif
+
+#ifndef ZCM_GENERIC_SERIAL_BUFFER_SIZE
+#define ZCM_GENERIC_SERIAL_BUFFER_SIZE (5*ZCM_GENERIC_SERIAL_MTU + 5*ZCM_CHANNEL_MAXLEN)
+#endif
+
+/* The get and put callbacks may be NULL if the driver moves bytes with the
+ * region functions below instead */
 zcm_trans_t *zcm_trans_generic_serial_create(
         uint32_t (*get)(uint8_t* data, uint32_t nData, void* usr),
         uint32_t (*put)(const uint8_t* data, uint32_t nData, void* usr),
@@ -15,6 +36,20 @@ zcm_trans_t *zcm_trans_generic_serial_create(
         uint64_t (*timestamp_now)(void* usr),
         void* time_usr);
 
+/* Direct access to the transport buffers, e.g. for DMA. Each region function
+ * returns the length of the largest contiguous region available at *data. That
+ * region stays valid until the matching commit/consume call, which may report
+ * fewer bytes than were offered. These must not be called concurrently with
+ * any other call on the transport. */
+
+/* Free space that incoming bytes can be written into */
+uint32_t zcm_trans_generic_serial_rx_region(zcm_trans_t *zt, uint8_t **data);
+void     zcm_trans_generic_serial_rx_commit(zcm_trans_t *zt, uint32_t nData);
+
+/* Encoded bytes waiting to be sent */
+uint32_t zcm_trans_generic_serial_tx_region(zcm_trans_t *zt, const uint8_t **data);
+void     zcm_trans_generic_serial_tx_consume(zcm_trans_t *zt, uint32_t nData);
+
 #ifdef __cplusplus
 }
 #endif
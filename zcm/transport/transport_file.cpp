@@ -7,30 +7,651 @@
 //#include "zcm/util/lockfile.h"
 
 #include "util/Types.hpp"
-#include "util/TimeUtil.hpp"
 
 #include <cstdio>
+#include <cstring>
+#include <cinttypes>
 #include <cassert>
 #include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <memory>
+#include <regex>
+#include <vector>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <algorithm>
 #include <unistd.h>
+#include <glob.h>
 #include <limits.h>
+#include <errno.h>
+#include <time.h>
 
 #define ZCM_TRANS_NAME TransportFile
 #define MTU (SSIZE_MAX)
 
+// Uncompressed bytes of events per compressed block when writing with 'compress'
+#define COMPRESS_BLOCK_SIZE (1 << 20)
+
+// Bytes written to the disk at a time when recording, while the next ones are buffered
+#define WRITE_BUFFER_SIZE (1 << 20)
+// How often recorded events are handed to the OS, so that readers of the log see them
+#define FLUSH_INTERVAL_MS 100
+
+// How far playback reads ahead of the message being played, unless 'prefetch' says otherwise
+#define PREFETCH_EVENTS 1024
+#define PREFETCH_BYTES  (64 << 20)
+
+// Publishing on this channel while reading controls playback, see docs/tools.md
+#define CONTROL_CHANNEL "ZCM_FILE_CONTROL"
+// Carries the log time of the next message during lockstep playback, see zcm/sim_clock.hpp
+#define CLOCK_CHANNEL "ZCM_FILE_CLOCK"
+
+static i64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 using namespace std;
 
-struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Replaces %XX escapes, so that the 'channel' regex can contain '&', which would otherwise
+// end the url option. A '%' that doesn't start an escape is kept as is
+static string percentDecode(const string& str)
+{
+    string out;
+    for (size_t i = 0; i < str.size(); ++i) {
+        int hi, lo;
+        if (str[i] == '%' && i + 2 < str.size() &&
+            (hi = hexValue(str[i+1])) >= 0 && (lo = hexValue(str[i+2])) >= 0) {
+            out += (char)(hi << 4 | lo);
+            i += 2;
+        } else {
+            out += str[i];
+        }
+    }
+    return out;
+}
+
+// Splits a list of paths or glob patterns at the 'sep' not escaped with a backslash. The
+// escapes are kept for glob(), which removes them. A list that names an existing file is
+// that one file, so that paths containing 'sep' still open without escaping
+static vector<string> splitPaths(const string& list, char sep)
+{
+    if (access(list.c_str(), F_OK) == 0) return { list };
+    vector<string> paths(1);
+    for (size_t i = 0; i < list.size(); ++i) {
+        if (list[i] == sep) {
+            paths.emplace_back();
+            continue;
+        }
+        paths.back() += list[i];
+        if (list[i] == '\\' && i + 1 < list.size())
+            paths.back() += list[++i];
+    }
+    return paths;
+}
+
+// Plays several log files, e.g. the segments of a split or rotated log, as one log. While a
+// segment is played, the next one is opened and starts reading ahead on another thread so
+// that there's no stall at the switch
+struct SegmentedLog
 {
+    vector<string> paths;
+    vector<i64> startUtimes;    // Of the first event of each segment
+    int prefetch = 0;
+
+    size_t segment = 0;
     zcm::LogFile *log = nullptr;
+    const zcm::LogEvent *first = nullptr;   // Already read from 'log', returned next
+    const zcm::LogEvent *lastRead = nullptr;
+
+    thread opener;
+    zcm::LogFile *nextLog = nullptr;
+    const zcm::LogEvent *nextFirst = nullptr;
+
+    // Wanted channels, or empty for all of them
+    function<bool(const string&)> filter;
+
+    ~SegmentedLog()
+    {
+        if (opener.joinable()) opener.join();
+        delete nextLog;
+        delete log;
+    }
+
+    // Opens the files matched by a comma separated list of paths or glob patterns, see
+    // splitPaths(). They are played in the order of their first events, which is right for
+    // split logs as well as for rotated ones
+    bool open(const string& list, int prefetchEvents)
+    {
+        prefetch = prefetchEvents;
+        vector<pair<i64, string>> files;
+        for (const string& pattern : splitPaths(list, ','))
+            if (!addFiles(pattern, files))
+                return false;
+        if (files.empty()) return false;
+
+        stable_sort(files.begin(), files.end(),
+                    [](const pair<i64, string>& a, const pair<i64, string>& b)
+                    { return a.first < b.first; });
+        for (auto& f : files) {
+            ZCM_DEBUG("Opening zcm logfile: \"%s\"", f.second.c_str());
+            startUtimes.push_back(f.first);
+            paths.push_back(f.second);
+        }
+
+        log = openSegment(paths[0], filter);
+        if (!log) return false;
+        openAhead();
+        return true;
+    }
+
+    // A pattern that names an existing file is that file, even if it also matches others
+    // as a glob, e.g. "a[1].log"
+    bool addFiles(const string& pattern, vector<pair<i64, string>>& files)
+    {
+        vector<string> matches;
+        glob_t g;
+        if (access(pattern.c_str(), F_OK) == 0) {
+            matches.push_back(pattern);
+        } else if (glob(pattern.c_str(), 0, NULL, &g) == 0) {
+            matches.assign(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+            globfree(&g);
+        } else {
+            fprintf(stderr, "Unable to open logfile %s\n", pattern.c_str());
+            return false;
+        }
+        for (const string& match : matches) {
+            zcm::LogFile lf(match, "r");
+            if (!lf.good()) {
+                fprintf(stderr, "Unable to open logfile %s\n", match.c_str());
+                return false;
+            }
+            const zcm::LogEvent *le = lf.readNextEvent();
+            files.emplace_back(le ? le->timestamp : INT64_MAX, match);
+        }
+        return true;
+    }
+
+    zcm::LogFile *openSegment(const string& path, const function<bool(const string&)>& wanted)
+    {
+        zcm::LogFile *lf = new zcm::LogFile(path, "r");
+        if (!lf->good()) {
+            fprintf(stderr, "Unable to open logfile %s\n", path.c_str());
+            delete lf;
+            return nullptr;
+        }
+        if (prefetch > 0 && lf->enablePrefetch(prefetch, PREFETCH_BYTES) != 0)
+            ZCM_DEBUG("Unable to prefetch, reading synchronously");
+        if (wanted)
+            lf->setChannelFilter(wanted);
+        return lf;
+    }
+
+    void openAhead()
+    {
+        if (segment + 1 >= paths.size()) return;
+        const string& path = paths[segment + 1];
+        function<bool(const string&)> wanted = filter;
+        opener = thread([this, path, wanted]() {
+            nextLog = openSegment(path, wanted);
+            nextFirst = nextLog ? nextLog->readNextEvent() : nullptr;
+        });
+    }
+
+    void applyFilter(zcm::LogFile *lf)
+    {
+        if (filter)
+            lf->setChannelFilter(filter);
+        else
+            lf->clearChannelFilter();
+    }
+
+    // Moves on to the segment opened ahead. Returns false if there is none
+    bool nextSegment()
+    {
+        if (!opener.joinable()) return false;
+        opener.join();
+        delete log;
+        log = nextLog;
+        first = nextFirst;
+        nextLog = nullptr;
+        nextFirst = nullptr;
+        segment++;
+        if (!log) {
+            // Play on from the segment after an unreadable one
+            log = openSegment(paths[segment], filter);
+            if (!log) return false;
+        }
+        // The filter may have changed since the segment was opened. Changing it only drops
+        // events read ahead, 'first' stays valid until the next read
+        applyFilter(log);
+        openAhead();
+        return true;
+    }
+
+    // Returns NULL at the end of the last segment. The event is valid until the next call
+    const zcm::LogEvent *readNext()
+    {
+        const zcm::LogEvent *le = first;
+        first = nullptr;
+        while (!le) {
+            le = log->readNextEvent();
+            if (le) break;
+            if (!nextSegment()) break;
+            le = first;
+            first = nullptr;
+        }
+        lastRead = le;
+        return le;
+    }
+
+    void setChannelFilter(const function<bool(const string&)>& wanted)
+    {
+        filter = wanted;
+        applyFilter(log);
+    }
+
+    int seekToTimestamp(i64 utime)
+    {
+        // The last segment starting at or before the target
+        size_t target = 0;
+        for (size_t i = 1; i < paths.size(); ++i)
+            if (startUtimes[i] <= utime) target = i;
+
+        if (target != segment) {
+            zcm::LogFile *lf = openSegment(paths[target], filter);
+            if (!lf) return -1;
+            if (opener.joinable()) opener.join();
+            delete nextLog;
+            nextLog = nullptr;
+            delete log;
+            log = lf;
+            segment = target;
+            openAhead();
+        }
+        first = nullptr;
+        if (log->seekToTimestamp(utime) == 0)
+            return 0;
+        // Past the end of the segment, so the next one starts after the target
+        return nextSegment() ? 0 : -1;
+    }
+};
+
+// Plays several logs recorded at the same time, e.g. by loggers on different hosts, as one
+// log ordered by timestamp. Each log reads ahead on threads of its own, and its timestamps
+// can be shifted to correct for clocks that disagree
+struct MergedLog
+{
+    struct Source
+    {
+        SegmentedLog log;
+        i64 offset = 0;
+    };
+    vector<Source*> sources;
+
+    // Sources that have an event, by the shifted timestamp of that event
+    typedef pair<i64, size_t> Head;
+    vector<Head> heap;
+    int last = -1;  // Source of the event returned last, read on by the next call
+    i64 firstUtime = 0; // Shifted timestamp of the first event, on any channel
+
+    ~MergedLog()
+    {
+        for (auto *src : sources)
+            delete src;
+    }
+
+    // 'spec' is a semicolon separated list of logs, each as in SegmentedLog::open().
+    // 'offsets' are microseconds added to the timestamps of each log, missing ones are 0
+    bool open(const string& spec, const vector<i64>& offsets, int prefetch,
+              const function<bool(const string&)>& wanted)
+    {
+        for (const string& list : splitPaths(spec, ';')) {
+            Source *src = new Source();
+            sources.push_back(src);
+            src->log.filter = wanted;
+            if (!src->log.open(list, prefetch))
+                return false;
+            if (offsets.size() >= sources.size())
+                src->offset = offsets[sources.size() - 1];
+        }
+        for (size_t i = 0; i < sources.size(); ++i)
+            readSource(i);
+
+        // Not the first event read, which skipped the channels filtered out
+        i64 first = INT64_MAX;
+        for (auto *src : sources)
+            if (src->log.startUtimes[0] != INT64_MAX)
+                first = min(first, src->log.startUtimes[0] + src->offset);
+        if (first != INT64_MAX) firstUtime = first;
+        return true;
+    }
+
+    void readSource(size_t i)
+    {
+        const zcm::LogEvent *le = sources[i]->log.readNext();
+        if (!le) return;
+        heap.emplace_back(le->timestamp + sources[i]->offset, i);
+        push_heap(heap.begin(), heap.end(), greater<Head>());
+    }
+
+    // Returns NULL once every log has ended. The event is valid until the next call, and
+    // 'utime' is set to its shifted timestamp
+    const zcm::LogEvent *readNext(i64 *utime)
+    {
+        if (last >= 0)
+            readSource(last);
+        last = -1;
+        if (heap.empty()) return nullptr;
+
+        pop_heap(heap.begin(), heap.end(), greater<Head>());
+        Head head = heap.back();
+        heap.pop_back();
+        last = head.second;
+        *utime = head.first;
+        return sources[head.second]->log.lastRead;
+    }
+
+    // The events of the sources in the heap stay valid, each is the last one its log returned
+    void setChannelFilter(const function<bool(const string&)>& wanted)
+    {
+        for (auto *src : sources)
+            src->log.setChannelFilter(wanted);
+    }
+
+    int seekToTimestamp(i64 utime)
+    {
+        heap.clear();
+        last = -1;
+        for (size_t i = 0; i < sources.size(); ++i) {
+            // Logs that end before the target stay ended until seeking back
+            if (sources[i]->log.seekToTimestamp(utime - sources[i]->offset) == 0)
+                readSource(i);
+        }
+        return heap.empty() ? -1 : 0;
+    }
+};
+
+// Records events to a log, or to a new log every 'splitBytes' bytes. The eventlog writes
+// its buffers out on a background thread, and a thread of our own hands it what was written
+// every FLUSH_INTERVAL_MS. When splitting, that thread also opens the next log ahead of time,
+// closes the finished ones and rotates the older ones, so that write() never waits on the
+// file system. Once writing fails every later write fails too
+struct LogWriter
+{
+    string path;
+    string mode;
+    int compressLevel = -2;     // Below -1 for not compressing
+    size_t splitBytes = 0;      // 0 for not splitting
+    int rotate = 0;             // Files kept when splitting, 0 for numbering them instead
+
+    zcm_eventlog_t *log = nullptr;
+    string filename;
+    size_t logBytes = 0;
+    int nextIncrement = 0;
+
+    mutex lock;
+    condition_variable flushCond;
+    thread flusher;
+    bool dirty = false;
+    bool stopping = false;
+    int error = 0;              // Of a failure that stops writing
+
+    // Shared with the flusher. A log that fills up before the next one is open keeps
+    // being written until it is
+    zcm_eventlog_t *nextLog = nullptr;
+    string nextFilename;
+    bool nextFailed = false;
+    vector<zcm_eventlog_t*> retiredLogs;
+    vector<string> retiredFilenames;
+
+    ~LogWriter()
+    {
+        if (flusher.joinable()) {
+            {
+                unique_lock<mutex> lk(lock);
+                stopping = true;
+            }
+            flushCond.notify_all();
+            flusher.join();
+        }
+        if (log) zcm_eventlog_destroy(log);
+    }
+
+    bool open()
+    {
+        if (rotate > 0) rotateFiles();
+        filename = nextLogFilename();
+        log = createLog(filename, splitBytes ? "w" : mode.c_str());
+        if (!log) return false;
+        flusher = thread(&LogWriter::flushLoop, this);
+        return true;
+    }
+
+    // Renames 'path'.0 to 'path'.1 and so on, dropping the oldest, like zcm-logger --rotate
+    void rotateFiles()
+    {
+        for (const string& suffix : { string(""), string(ZCM_EVENTLOG_INDEX_SUFFIX) }) {
+            string oldest = path + "." + to_string(rotate - 1) + suffix;
+            if (unlink(oldest.c_str()) != 0 && errno != ENOENT)
+                ZCM_DEBUG("Unable to delete %s: %s", oldest.c_str(), strerror(errno));
+            for (int i = rotate - 1; i > 0; --i) {
+                string from = path + "." + to_string(i - 1) + suffix;
+                string to = path + "." + to_string(i) + suffix;
+                if (rename(from.c_str(), to.c_str()) != 0 && errno != ENOENT)
+                    ZCM_DEBUG("Unable to rotate %s: %s", from.c_str(), strerror(errno));
+            }
+        }
+    }
+
+    string nextLogFilename()
+    {
+        if (splitBytes == 0) return path;
+        if (rotate > 0) return path + ".0";
+
+        // Never overwrites the parts of an earlier recording
+        string name;
+        char suffix[16];
+        do {
+            snprintf(suffix, sizeof(suffix), ".%02d", nextIncrement++);
+            name = path + suffix;
+        } while (access(name.c_str(), F_OK) == 0);
+        return name;
+    }
+
+    // Where the next log of a rotation is opened ahead of time, until it is renamed to
+    // 'path'.0. Hidden like zcm-logger's, so that globs over the rotated logs don't pick it up
+    string rotateAheadPath(const string& name)
+    {
+        size_t slash = name.rfind('/');
+        size_t base = slash == string::npos ? 0 : slash + 1;
+        return name.substr(0, base) + "." + name.substr(base) + ".next";
+    }
+
+    zcm_eventlog_t *createLog(const string& name, const char *logMode)
+    {
+        ZCM_DEBUG("Opening zcm logfile: \"%s\"", name.c_str());
+        zcm_eventlog_t *l = zcm_eventlog_create(name.c_str(), logMode);
+        if (!l) {
+            fprintf(stderr, "Unable to open logfile %s\n", name.c_str());
+            return nullptr;
+        }
+        if (zcm_eventlog_set_write_buffer(l, WRITE_BUFFER_SIZE, ZCM_EVENTLOG_WRITE_ASYNC) != 0 ||
+            (compressLevel >= -1 &&
+             zcm_eventlog_enable_compression(l, compressLevel, COMPRESS_BLOCK_SIZE, 1) != 0)) {
+            fprintf(stderr, "Unable to set up writing logfile %s\n", name.c_str());
+            zcm_eventlog_destroy(l);
+            return nullptr;
+        }
+        return l;
+    }
+
+    // Returns 0 on success -1 on failure with errno set
+    int write(i64 utime, const char *channel, const char *data, size_t len)
+    {
+        unique_lock<mutex> lk(lock);
+        if (error) {
+            errno = error;
+            return -1;
+        }
+
+        if (splitBytes && logBytes >= splitBytes && nextFailed) {
+            error = EIO;
+            errno = error;
+            return -1;
+        }
+        if (splitBytes && logBytes >= splitBytes && nextLog) {
+            retiredLogs.push_back(log);
+            retiredFilenames.push_back(filename);
+            log = nextLog;
+            filename = nextFilename;
+            nextLog = nullptr;
+            logBytes = 0;
+            flushCond.notify_all();
+        }
+
+        zcm_eventlog_event_t le;
+        le.timestamp = utime;
+        le.channellen = strlen(channel);
+        le.datalen = len;
+        le.channel = (char*) channel;
+        le.data = (void*) data;
+        if (zcm_eventlog_write_event(log, &le) != 0)
+            return -1;
+
+        logBytes += 4 + 8 + 8 + 4 + le.channellen + 4 + le.datalen;
+        dirty = true;
+        return 0;
+    }
+
+    void flushLoop()
+    {
+        unique_lock<mutex> lk(lock);
+        while (true) {
+            if (!retiredLogs.empty()) {
+                vector<zcm_eventlog_t*> retired;
+                vector<string> names;
+                retired.swap(retiredLogs);
+                names.swap(retiredFilenames);
+                lk.unlock();
+                int err = 0;
+                for (size_t i = 0; i < retired.size(); ++i) {
+                    // Closing writes out whatever is still buffered, and for compressed logs
+                    // the last block and the block index. Flushed first to find out whether
+                    // that worked
+                    if (zcm_eventlog_flush(retired[i]) != 0 && !err) err = errno;
+                    zcm_eventlog_destroy(retired[i]);
+                    // The log being written was opened ahead, and can still be renamed
+                    if (rotate > 0) {
+                        rotateFiles();
+                        string ahead = rotateAheadPath(names[i]);
+                        if (rename(ahead.c_str(), names[i].c_str()) != 0 && !err)
+                            err = errno;
+                    }
+                }
+                lk.lock();
+                if (err && !error) error = err;
+            }
+
+            // Only once the log opened ahead before was renamed into place. Parts of a
+            // split log always start out empty
+            if (splitBytes && !nextLog && !nextFailed && !stopping) {
+                lk.unlock();
+                string name = nextLogFilename();
+                zcm_eventlog_t *l = createLog(rotate > 0 ? rotateAheadPath(name) : name, "w");
+                lk.lock();
+                nextLog = l;
+                nextFilename = name;
+                nextFailed = !l;
+            }
+
+            if (stopping) break;
+            flushCond.wait_for(lk, chrono::milliseconds(FLUSH_INTERVAL_MS),
+                               [&]{ return stopping || !retiredLogs.empty(); });
+            if (!dirty || !log) continue;
+            dirty = false;
+            // Only hands the buffers over, a failed write fails the writes that follow it
+            if (zcm_eventlog_flush_async(log) != 0)
+                ZCM_DEBUG("Unable to flush %s: %s", filename.c_str(), strerror(errno));
+        }
+
+        // Nothing was written to the log opened ahead
+        if (nextLog) {
+            string name = rotate > 0 ? rotateAheadPath(nextFilename) : nextFilename;
+            zcm_eventlog_destroy(nextLog);
+            nextLog = nullptr;
+            unlink(name.c_str());
+        }
+    }
+};
+
+struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
+{
+    LogWriter *out = nullptr;       // When writing
+    MergedLog *in = nullptr;        // When reading
     unordered_map<string, string> options;
 
     string mode = "r";
     double speed = 1.0;
+    bool maxSpeed = false;
+    i64 spinNs = 0;
+
+    // Every message is due at a deadline relative to when the first one was played,
+    // so that time spent reading and dispatching doesn't add up over a playback
+    bool anchored = false;
+    i64 anchorLogUtime = 0;
+    i64 anchorNs = 0;
+    i64 lastLogUtime = 0;
+    const zcm::LogEvent *pending = nullptr;
+    i64 pendingUtime = 0;       // Timestamp of the last message read, shifted by its offset
+
+    // Playback control. Commands are published from other threads than the one receiving
+    // and are applied before each message is read
+    mutex controlLock;
+    condition_variable controlCond;
+    deque<string> controlCmds;
+    bool paused = false;
+    int steps = 0;              // Messages to play while paused
+    bool atEnd = false;
+    i64 pausedNs = 0;
+
+    // In lockstep every message is announced by a tick on CLOCK_CHANNEL and only played
+    // once 'lockstepAcks' acknowledgments of the tick came back. They come after the
+    // subscribers have handled everything played before the tick, so playback never
+    // gets ahead of them however slow they are
+    int lockstepAcks = 0;       // 0 when not in lockstep
+    bool ticked = false;        // The pending message was announced
+    i64 tickUtime = 0;
+    int acks = 0;
+    string tickStr;
 
-    u64 lastMsgUtime = 0;
-    u64 lastDispatchUtime = 0;
+    // Subscribed channels, so that reading skips the events nobody receives.
+    // Subscriptions are made from other threads than the one receiving
+    mutex enabledLock;
+    unordered_map<string, int> enabledChannels;
+    int enabledAll = 0;
+    atomic<bool> enabledChanged {false};
+
+    // Only the channels matching 'channel', or not matching it with 'invert', are read.
+    // Playing stops at 'end'
+    shared_ptr<regex> channelRegex;
+    bool invertChannels = false;
+    i64 endUtime = INT64_MAX;
 
     string *findOption(const string& s)
     {
@@ -50,10 +671,21 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             options[opts->name[i]] = opts->value[i];
 
         string* speedStr = findOption("speed");
-        if (speedStr) {
+        if (speedStr && *speedStr == "max") {
+            maxSpeed = true;
+        } else if (speedStr) {
             speed = atof(speedStr->c_str());
             if (speed <= 0) {
-                ZCM_DEBUG("Expected double argument for 'speed'");
+                ZCM_DEBUG("Expected double argument or 'max' for 'speed'");
+                return;
+            }
+        }
+
+        string* spinStr = findOption("spin");
+        if (spinStr) {
+            spinNs = atoll(spinStr->c_str()) * 1000;
+            if (spinNs < 0) {
+                ZCM_DEBUG("Expected microseconds for 'spin'");
                 return;
             }
         }
@@ -68,22 +700,115 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         }
 
         auto filename = zcm_url_address(url);
-        ZCM_DEBUG("Opening zcm logfile: \"%s\"", filename);
-        log = new zcm::LogFile(filename, string(mode));
-        if (!log->good()) {
-            fprintf(stderr, "Unable to open logfile %s\n", filename);
+        string* compressStr = findOption("compress");
+        if (compressStr && mode != "w") {
+            ZCM_DEBUG("Compression requires mode=w");
+            return;
+        }
+
+        if (mode == "r") {
+            string* prefetchStr = findOption("prefetch");
+            int prefetch = prefetchStr ? atoi(prefetchStr->c_str()) : PREFETCH_EVENTS;
+
+            vector<i64> offsets;
+            string* offsetsStr = findOption("offsets");
+            if (offsetsStr) {
+                const char *p = offsetsStr->c_str();
+                char *end;
+                while (*p) {
+                    offsets.push_back(strtoll(p, &end, 10));
+                    if (end == p || (*end && *end != ',')) {
+                        ZCM_DEBUG("Expected comma separated microseconds for 'offsets'");
+                        return;
+                    }
+                    p = *end ? end + 1 : end;
+                }
+            }
+
+            string* channelStr = findOption("channel");
+            if (channelStr) {
+                try {
+                    channelRegex = make_shared<regex>(percentDecode(*channelStr));
+                } catch (const regex_error& e) {
+                    ZCM_DEBUG("Invalid regex for 'channel': %s", e.what());
+                    return;
+                }
+                invertChannels = findOption("invert") != nullptr;
+            }
+
+            string* lockstepStr = findOption("lockstep");
+            if (lockstepStr) {
+                lockstepAcks = lockstepStr->empty() ? 1 : atoi(lockstepStr->c_str());
+                if (lockstepAcks <= 0) {
+                    ZCM_DEBUG("Expected a positive number of acknowledgments for 'lockstep'");
+                    return;
+                }
+            }
+
+            // The window is in seconds from the first event of the log
+            string* startStr = findOption("start");
+            string* endStr = findOption("end");
+
+            in = new MergedLog();
+            if (!in->open(filename, offsets, prefetch, wantedChannels())) {
+                delete in;
+                in = nullptr;
+                return;
+            }
+            if (endStr)
+                endUtime = in->firstUtime + (i64)(atof(endStr->c_str()) * 1e6);
+            // Seeks through the index, when the log has one, without reading up to the start
+            if (startStr && in->seekToTimestamp(in->firstUtime +
+                                                (i64)(atof(startStr->c_str()) * 1e6)) != 0)
+                atEnd = true;
             return;
         }
+
+        out = new LogWriter();
+        out->path = filename;
+        out->mode = mode;
+        if (compressStr)
+            out->compressLevel = atoi(compressStr->c_str());
+
+        string* splitStr = findOption("split-mb");
+        if (splitStr) {
+            double mb = atof(splitStr->c_str());
+            if (mb <= 0) {
+                ZCM_DEBUG("Expected a positive number of megabytes for 'split-mb'");
+                delete out;
+                out = nullptr;
+                return;
+            }
+            out->splitBytes = (size_t)(mb * (1 << 20));
+        }
+
+        string* rotateStr = findOption("rotate");
+        if (rotateStr) {
+            out->rotate = atoi(rotateStr->c_str());
+            if (out->rotate <= 0 || !splitStr) {
+                ZCM_DEBUG("Expected a positive number of files for 'rotate', with 'split-mb'");
+                delete out;
+                out = nullptr;
+                return;
+            }
+        }
+
+        if (!out->open()) {
+            delete out;
+            out = nullptr;
+        }
     }
 
     ~ZCM_TRANS_CLASSNAME()
     {
-        if (log) delete log;
+        if (out) delete out;
+        if (in) delete in;
     }
 
     bool good()
     {
-        return log ? log->good() : false;
+        if (mode == "r") return in != nullptr;
+        return out != nullptr;
     }
 
     /********************** METHODS **********************/
@@ -92,31 +817,71 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         return MTU;
     }
 
-    // XXX Completely untested
     int sendmsg(zcm_msg_t msg)
     {
         assert(good());
-        assert(mode == "w" || mode == "a");
+        if (mode == "r") {
+            if (strcmp(msg.channel, CONTROL_CHANNEL) != 0)
+                return ZCM_EINVALID;
+            unique_lock<mutex> lk(controlLock);
+            controlCmds.emplace_back((const char*)msg.buf, msg.len);
+            controlCond.notify_all();
+            return ZCM_EOK;
+        }
 
         if (msg.len > get_mtu())
             return ZCM_EINVALID;
 
-        zcm::LogEvent le;
-        le.timestamp = msg.utime;
-        le.datalen = msg.len;
-        le.channel = string(msg.channel);
-        le.data = msg.buf;
-
-        log->writeEvent(&le);
-
+        if (out->write(msg.utime, msg.channel, msg.buf, msg.len) != 0) {
+            ZCM_DEBUG("Unable to write to logfile %s: %s", out->path.c_str(), strerror(errno));
+            return ZCM_EUNKNOWN;
+        }
         return ZCM_EOK;
     }
 
     int recvmsg_enable(const char *channel, bool enable)
     {
+        unique_lock<mutex> lk(enabledLock);
+        int change = enable ? 1 : -1;
+        if (!channel) {
+            enabledAll += change;
+        } else {
+            int& n = enabledChannels[channel];
+            n += change;
+            if (n <= 0) enabledChannels.erase(channel);
+        }
+        enabledChanged = true;
         return ZCM_EOK;
     }
 
+    void updateChannelFilter()
+    {
+        in->setChannelFilter(wantedChannels());
+    }
+
+    // Returns an empty function when every channel is wanted
+    function<bool(const string&)> wantedChannels()
+    {
+        unique_lock<mutex> lk(enabledLock);
+        enabledChanged = false;
+        // Without any subscriptions every event is read, as before anything subscribes
+        shared_ptr<unordered_set<string>> channels;
+        if (enabledAll == 0 && !enabledChannels.empty()) {
+            channels = make_shared<unordered_set<string>>();
+            for (auto& it : enabledChannels)
+                channels->insert(it.first);
+        }
+        if (!channels && !channelRegex)
+            return nullptr;
+        // Asked once per channel, possibly on the threads reading ahead
+        shared_ptr<regex> re = channelRegex;
+        bool invert = invertChannels;
+        return [channels, re, invert](const string& channel) {
+            if (channels && !channels->count(channel)) return false;
+            return !re || regex_match(channel, *re) != invert;
+        };
+    }
+
     int recvmsg(zcm_msg_t *msg, int timeout)
     {
         assert(mode == "r");
@@ -128,38 +893,174 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             return ZCM_ECONNECT;
         }
 
-        const zcm::LogEvent* le = log->readNextEvent();
-        if (!le) {
-            delete log;
-            log = nullptr;
+        applyControl();
+        if ((paused && steps == 0) || atEnd) {
+            unique_lock<mutex> lk(controlLock);
+            controlCond.wait_for(lk, chrono::milliseconds(timeout < 0 ? 1000 : timeout),
+                                 [&](){ return !controlCmds.empty(); });
+            return atEnd ? ZCM_ECONNECT : ZCM_EAGAIN;
+        }
+
+        // Changing the filter keeps the events already read, the pending one included
+        if (enabledChanged)
+            updateChannelFilter();
+
+        // A message waiting for its deadline is still the last one read
+        const zcm::LogEvent* le = pending;
+        if (!le) le = in->readNext(&pendingUtime);
+        if (!le || pendingUtime > endUtime) {
+            // Stay open so that playback can seek back
+            atEnd = true;
             return ZCM_ECONNECT;
         }
+        pending = nullptr;
+
+        if (lockstepAcks > 0 && !ticked) {
+            ticked = true;
+            tickUtime = pendingUtime;
+            acks = 0;
+            pending = le;
+            tickStr = to_string(tickUtime);
+            msg->utime = tickUtime;
+            msg->channel = CLOCK_CHANNEL;
+            msg->len = tickStr.size();
+            msg->buf = (char*) tickStr.data();
+            return ZCM_EOK;
+        }
+        if (lockstepAcks > 0 && acks < lockstepAcks) {
+            pending = le;
+            unique_lock<mutex> lk(controlLock);
+            controlCond.wait_for(lk, chrono::milliseconds(timeout < 0 ? 1000 : timeout),
+                                 [&](){ return !controlCmds.empty(); });
+            return ZCM_EAGAIN;
+        }
+        ticked = false;
 
-        msg->utime = le->timestamp;
+        if (paused) {
+            // Steps play right away, and playing resumes from the message stepped to
+            steps--;
+            anchored = true;
+            anchorLogUtime = lastLogUtime = pendingUtime;
+            anchorNs = pausedNs = monotonicNs();
+        } else if (!maxSpeed && lockstepAcks == 0 && !waitForDeadline(pendingUtime, timeout)) {
+            // At speed=max messages are played as fast as the receive queue takes them,
+            // which is as fast as subscribers handle them
+            pending = le;
+            return ZCM_EAGAIN;
+        }
+
+        lastLogUtime = pendingUtime;
+        msg->utime = pendingUtime;
         msg->channel = le->channel.c_str();
         msg->len = le->datalen;
         msg->buf = le->data;
 
-        u64 now = TimeUtil::utime();
+        return ZCM_EOK;
+    }
 
-        if (lastMsgUtime == 0)
-            lastMsgUtime = msg->utime;
+    void applyControl()
+    {
+        deque<string> cmds;
+        {
+            unique_lock<mutex> lk(controlLock);
+            cmds.swap(controlCmds);
+        }
+        for (auto& cmd : cmds)
+            control(cmd);
+    }
 
-        if (lastDispatchUtime == 0)
-            lastDispatchUtime = now;
+    // Commands are "PLAY", "PAUSE", "STEP", "SPEED <multiplier|max>",
+    // "SEEK <log utime>", "SKIP <seconds>" (negative to go back) and, in lockstep,
+    // "ACK <log utime of the tick>"
+    void control(const string& cmd)
+    {
+        char word[16];
+        char arg[32] = "";
+        if (sscanf(cmd.c_str(), "%15s %31s", word, arg) < 1) return;
+        string w = word;
+        i64 now = monotonicNs();
 
-        u64 localDiff = now - lastDispatchUtime;
-        u64 logDiff = msg->utime - lastMsgUtime;
-        u64 logDiffSpeed = logDiff / this->speed;
-        u64 diff = logDiffSpeed > localDiff ? logDiffSpeed - localDiff : 0;
+        if (w == "PAUSE" || (w == "STEP" && !paused)) {
+            if (!paused) {
+                paused = true;
+                pausedNs = now;
+            }
+            if (w == "STEP") steps++;
+        } else if (w == "STEP") {
+            steps++;
+        } else if (w == "PLAY") {
+            if (paused) {
+                paused = false;
+                steps = 0;
+                anchorNs += now - pausedNs;
+            }
+        } else if (w == "SPEED") {
+            double newSpeed = atof(arg);
+            bool newMax = strcmp(arg, "max") == 0;
+            if (!newMax && newSpeed <= 0) {
+                ZCM_DEBUG("Invalid playback speed: %s", arg);
+                return;
+            }
+            // Continue from where playback is at at the new speed
+            if (anchored && !maxSpeed) {
+                i64 at = paused ? pausedNs : now;
+                anchorLogUtime += (i64)((at - anchorNs) / 1000 * speed);
+                anchorNs = at;
+            }
+            if (maxSpeed && !newMax)
+                anchored = false;
+            maxSpeed = newMax;
+            if (!newMax) speed = newSpeed;
+        } else if (w == "SEEK" || w == "SKIP") {
+            i64 target = w == "SEEK" ? atoll(arg) : lastLogUtime + (i64)(atof(arg) * 1e6);
+            if (in->seekToTimestamp(target) != 0) {
+                ZCM_DEBUG("Unable to seek to %" PRId64, target);
+                return;
+            }
+            pending = nullptr;
+            ticked = false;
+            anchored = false;
+            atEnd = false;
+        } else if (w == "ACK") {
+            // Late acknowledgments of a tick from before a seek don't count
+            if (ticked && atoll(arg) == tickUtime) acks++;
+        } else {
+            ZCM_DEBUG("Unknown playback command: %s", cmd.c_str());
+        }
+    }
 
-        if (diff > 0)
-            usleep(diff);
+    // Waits until a message logged at 'logUtime' is due. Gives up after 'timeoutMs' if the
+    // deadline is further out than that, so that the caller can check whether to stop
+    bool waitForDeadline(i64 logUtime, int timeoutMs)
+    {
+        i64 now = monotonicNs();
 
-        lastDispatchUtime = TimeUtil::utime();
-        lastMsgUtime = msg->utime;
+        // Start over on the first message and whenever the log goes back in time
+        if (!anchored || logUtime < lastLogUtime) {
+            anchored = true;
+            anchorLogUtime = logUtime;
+            anchorNs = now;
+        }
+        lastLogUtime = logUtime;
 
-        return ZCM_EOK;
+        i64 deadline = anchorNs + (i64)((logUtime - anchorLogUtime) * 1000 / speed);
+        if (deadline <= now)
+            return true;
+
+        bool giveUp = timeoutMs >= 0 && deadline - now > (i64)timeoutMs * 1000000;
+        i64 wakeup = giveUp ? now + (i64)timeoutMs * 1000000 : deadline - spinNs;
+        if (wakeup > now) {
+            struct timespec ts;
+            ts.tv_sec = wakeup / 1000000000;
+            ts.tv_nsec = wakeup % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+        }
+        if (giveUp)
+            return false;
+
+        // Sleeping wakes up late by tens of microseconds, spinning doesn't
+        while (monotonicNs() < deadline) {}
+        return true;
     }
 
     /********************** STATICS **********************/
@@ -208,4 +1109,16 @@ static zcm_trans_t *create(zcm_url_t *url)
 }
 
 const TransportRegister ZCM_TRANS_CLASSNAME::reg(
-    "file", "Interact with zcm log file (e.g. 'file://vehicle.log?speed=2.0)", create);
+    "file", "Interact with zcm log file (e.g. 'file://vehicle.log?speed=2.0' "
+            "or 'file://vehicle.log?speed=max'). Reading also takes several files, "
+            "separated by commas, or a glob (e.g. 'file://zcmlog-*'). Logs recorded at the "
+            "same time are merged by timestamp when separated by semicolons, with their "
+            "clocks shifted by 'offsets' in microseconds "
+            "(e.g. 'file://a.log;b.log?offsets=0,-1500'). 'channel' plays only the "
+            "channels matching a regex, or the others with 'invert', and 'start' and "
+            "'end' play a window of seconds into the log "
+            "(e.g. 'file://vehicle.log?channel=CAM.*&invert&start=60&end=90'). "
+            "'lockstep' plays each message once a zcm::SimClock acknowledged the tick "
+            "announcing it (e.g. 'file://vehicle.log?lockstep'). Writing (mode=w or mode=a) "
+            "takes 'split-mb', 'rotate' and 'compress' like zcm-logger "
+            "(e.g. 'file://out.log?mode=w&split-mb=100&rotate=5')", create);
@@ -15,10 +15,15 @@
 
 #include <cassert>
 #include <cstring>
+#include <cinttypes>
+#include <algorithm>
 
 #include <string>
+#include <vector>
 #include <unordered_map>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 using namespace std;
 
 // TODO: This transport layer needs to be "hardened" to handle
@@ -31,7 +36,31 @@ using namespace std;
 #define MTU (1<<20)
 #define ESCAPE_CHAR 0xcc
 
+// Framing:
+//   ESCAPE_CHAR 0x00                   sync marker (the only unescaped bytes)
+//   chan_len                           (1 byte)
+//   data_len                           (4 bytes, big endian)
+//   *chan
+//   *data
+//   crc16(chan_len .. data)            (2 bytes, big endian)
+// Every byte after the sync marker is escaped: ESCAPE_CHAR is sent twice
+//
+// With the "framing=cobs" option, the frame contents (chan_len .. crc16) are
+// COBS encoded instead and followed by a 0x00 delimiter. This bounds the
+// overhead to one byte in 254, regardless of the data.
+#define HEADER_BYTES 5
+#define CRC_BYTES 2
+#define MAX_FRAME_BYTES (2 + 2 * (HEADER_BYTES + ZCM_CHANNEL_MAXLEN + MTU + CRC_BYTES))
+#define COBS_MAX_ENCODED(n) ((n) + (n)/254 + 1)
+#define MAX_COBS_FRAME_BYTES \
+    (COBS_MAX_ENCODED(HEADER_BYTES + ZCM_CHANNEL_MAXLEN + MTU + CRC_BYTES) + 1)
+
+// Encoded frames accumulate while the writer thread is busy and are all
+// handed to the kernel in a single write(). Senders block past this size.
+#define TX_PENDING_MAX (1<<16)
+
 #define SERIAL_TIMEOUT_US 1e5 // u-seconds
+#define FRAMING_REPORT_PERIOD_US 1000000
 
 #define US_TO_MS(a) (a)/1e3
 
@@ -40,6 +69,118 @@ using u16 = uint16_t;
 using u32 = uint32_t;
 using u64 = uint64_t;
 
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xffff), also used by generic_serial_transport.c
+struct Crc16
+{
+    u16 table[256];
+
+    Crc16()
+    {
+        for (u32 i = 0; i < 256; i++) {
+            u16 crc = (u16)(i << 8);
+            for (int j = 0; j < 8; j++)
+                crc = (crc & 0x8000) ? (u16)((crc << 1) ^ 0x1021) : (u16)(crc << 1);
+            table[i] = crc;
+        }
+    }
+
+    static const u16 INIT = 0xffff;
+
+    u16 update(u16 crc, const u8 *data, size_t len) const
+    {
+        for (size_t i = 0; i < len; i++)
+            crc = (u16)((crc << 8) ^ table[((crc >> 8) ^ data[i]) & 0xff]);
+        return crc;
+    }
+};
+static const Crc16 crc16;
+
+// Appends 'data' to 'out' doubling every ESCAPE_CHAR. Runs between escape
+// chars are located with memchr() and copied in bulk. 'out' must have room
+// for the worst case of 2*len bytes past 'idx'. Returns the new end index
+static size_t appendEscaped(u8 *out, size_t idx, const u8 *data, size_t len)
+{
+    while (len > 0) {
+        const u8 *esc = (const u8*)memchr(data, ESCAPE_CHAR, len);
+        size_t run = esc ? (size_t)(esc - data) + 1 : len;
+        memcpy(out + idx, data, run);
+        idx += run;
+        if (esc)
+            out[idx++] = ESCAPE_CHAR;
+        data += run;
+        len -= run;
+    }
+    return idx;
+}
+
+// Appends COBS encoded bytes to a buffer. Each block starts with a code byte
+// that is filled in once the block is complete. Runs of non-zero bytes are
+// located with memchr() and copied in bulk.
+struct CobsEncoder
+{
+    u8 *out;
+    size_t idx;
+    size_t codeIdx;
+    u8 code = 1;
+
+    CobsEncoder(u8 *out, size_t idx) : out(out), idx(idx + 1), codeIdx(idx) {}
+
+    void append(const u8 *data, size_t len)
+    {
+        while (len > 0) {
+            size_t n = std::min(len, (size_t)(0xff - code));
+            const u8 *zero = (const u8*)memchr(data, 0, n);
+            size_t run = zero ? (size_t)(zero - data) : n;
+            memcpy(out + idx, data, run);
+            idx += run;
+            code += run;
+            data += run;
+            len -= run;
+            if (zero) {
+                data++;
+                len--;
+                closeBlock();
+            } else if (code == 0xff) {
+                closeBlock();
+            }
+        }
+    }
+
+    // Terminates the frame. Returns the new end index
+    size_t finish()
+    {
+        out[codeIdx] = code;
+        out[idx++] = 0;
+        return idx;
+    }
+
+  private:
+    void closeBlock()
+    {
+        out[codeIdx] = code;
+        codeIdx = idx++;
+        code = 1;
+    }
+};
+
+// Decodes the COBS encoded bytes in [buf, buf+len) in place.
+// Returns the decoded length, or -1 if the bytes are not a valid encoding
+static ssize_t cobsDecodeInPlace(u8 *buf, size_t len)
+{
+    size_t in = 0, n = 0;
+    while (in < len) {
+        u8 code = buf[in++];
+        if (code == 0 || in + code - 1 > len)
+            return -1;
+        memmove(buf + n, buf + in, code - 1);
+        n += code - 1;
+        in += code - 1;
+        if (code != 0xff && in < len)
+            buf[n++] = 0;
+    }
+    return n;
+}
+
 struct Serial
 {
     Serial(){}
@@ -153,16 +294,22 @@ void Serial::close()
     }
 }
 
+// Writes all of 'buf', returns the number of bytes written or -1 on error
 int Serial::write(const u8 *buf, size_t sz)
 {
     assert(this->isOpen());
-    int ret = ::write(fd, buf, sz);
-    if(ret == -1) {
-        ZCM_DEBUG("ERR: write failed: %s", strerror(errno));
-        return -1;
+    size_t written = 0;
+    while (written < sz) {
+        ssize_t ret = ::write(fd, buf + written, sz - written);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            ZCM_DEBUG("ERR: write failed: %s", strerror(errno));
+            return -1;
+        }
+        written += ret;
     }
-    fsync(fd);
-    return ret;
+    return (int)written;
 }
 
 int Serial::read(u8 *buf, size_t sz, u64 timeoutUs)
@@ -223,13 +370,55 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     Serial ser;
     unordered_map<string, string> options;
 
+    bool cobs = false;
+
     mutex mut; // protects the enabled channels
     unordered_map<string, int> recvChannels;
     bool recvAllChannels = false;
 
-    // Preallocated memory for recv
-    u8 recvChannelMem[33];
-    u8 recvDataMem[MTU];
+    // Send side: sendmsg() encodes into 'txPending' and the writer thread
+    // swaps it out and writes all of the accumulated frames at once
+    mutex txMut;
+    condition_variable txCond;
+    vector<u8> txPending;
+    vector<u8> txWriting;
+    bool txRunning = true;
+    thread txThread;
+
+    // Recv side: bytes are read in bulk into 'rxBuf' and fed through an
+    // incremental parser whose state persists across calls to recvmsg().
+    // Raw bytes in [rxParse, rxEnd) have not been looked at yet. Once a sync
+    // marker is found, the frame is unescaped in place into [rxFrame, rxOut)
+    // so the data handed to the caller is never copied. With COBS framing,
+    // [rxFrame, rxParse) holds the encoded frame so far and PARSE_SYNC means
+    // an oversized frame is being dropped up to its delimiter.
+    enum ParseState { PARSE_SYNC, PARSE_HEADER, PARSE_BODY };
+    vector<u8> rxBuf;
+    size_t rxParse = 0;
+    size_t rxEnd = 0;
+    ParseState rxState = PARSE_SYNC;
+    size_t rxFrame = 0;
+    size_t rxOut = 0;
+    size_t rxNeed = 0;
+    bool rxEscaped = false;
+    u8 rxChanLen = 0;
+    u32 rxDataLen = 0;
+    u64 rxFrameUtime = 0;
+    char recvChannelMem[ZCM_CHANNEL_MAXLEN + 1];
+
+    // Framing error counters, only touched by the recv thread
+    struct FramingStats {
+        u64 frames = 0;
+        u64 skippedBytes = 0;
+        u64 truncated = 0;
+        u64 badEncoding = 0;
+        u64 badLength = 0;
+        u64 badCrc = 0;
+        u64 errors() const { return truncated + badEncoding + badLength + badCrc; }
+    };
+    FramingStats rxStats;
+    u64 rxStatsReported = 0;
+    u64 rxStatsReportUtime = 0;
 
     string *findOption(const string& s)
     {
@@ -269,13 +458,41 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             }
         }
 
+        auto *framingStr = findOption("framing");
+        if (framingStr) {
+            if (*framingStr == "cobs") {
+                cobs = true;
+                rxState = PARSE_BODY;
+            } else if (*framingStr != "escape") {
+                ZCM_DEBUG("expected 'escape' or 'cobs' for 'framing'");
+                return;
+            }
+        }
+
         auto address = zcm_url_address(url);
-        ser.open(address, baud);
+        if (!ser.open(address, baud))
+            return;
+
+        rxBuf.resize(MAX_FRAME_BYTES);
+        txPending.reserve(TX_PENDING_MAX);
+        txWriting.reserve(TX_PENDING_MAX);
+        txThread = thread{&ZCM_TRANS_CLASSNAME::writerThreadFunc, this};
     }
 
     ~ZCM_TRANS_CLASSNAME()
     {
-        // TODO shutdown serial
+        // Let the writer drain any frames that are still pending
+        if (txThread.joinable()) {
+            {
+                unique_lock<mutex> lk(txMut);
+                txRunning = false;
+            }
+            txCond.notify_all();
+            txThread.join();
+        }
+
+        if (rxStats.errors() > 0)
+            reportFramingErrors(stderr);
     }
 
     bool good()
@@ -283,6 +500,26 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         return ser.isOpen();
     }
 
+    void writerThreadFunc()
+    {
+        unique_lock<mutex> lk(txMut);
+        while (true) {
+            txCond.wait(lk, [&](){ return !txPending.empty() || !txRunning; });
+            if (txPending.empty())
+                break;
+
+            txWriting.swap(txPending);
+            lk.unlock();
+            txCond.notify_all();
+
+            if (ser.write(txWriting.data(), txWriting.size()) < 0)
+                ZCM_DEBUG("serial writer: dropped %zu bytes of frames", txWriting.size());
+            txWriting.clear();
+
+            lk.lock();
+        }
+    }
+
     /********************** METHODS **********************/
     size_t getMtu()
     {
@@ -291,65 +528,63 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 
     int sendmsg(zcm_msg_t msg)
     {
-        string channel = msg.channel;
-        if (channel.size() > ZCM_CHANNEL_MAXLEN)
+        size_t chanLen = strlen(msg.channel);
+        if (chanLen > ZCM_CHANNEL_MAXLEN)
             return ZCM_EINVALID;
         if (msg.len > MTU)
             return ZCM_EINVALID;
 
-        u8 buffer[1024];
-        size_t index = 0;
-        u8 sum = 0;  // TODO introduce better checksum
-
-        auto writeBytes = [&](const u8 *data, size_t len) {
-            for (size_t i = 0; i < len; i++) {
-                // Less than 2 bytes of buffer left? Flush it.
-                if (index >= sizeof(buffer)-1) {
-                    ser.write(buffer, index);
-                    index = 0;
-                }
-                u8 c = data[i];
-                sum += c;
-                // Escape byte?
-                if (c == ESCAPE_CHAR) {
-                    buffer[index++] = ESCAPE_CHAR;
-                    buffer[index++] = c;
-                } else {
-                    buffer[index++] = c;
-                }
-            }
-        };
-
-        auto finish = [&]() {
-            if (index != 0) {
-                ser.write(buffer, index);
-                index = 0;
-            }
-            ser.write(&sum, 1);
-        };
-
-        // Sync bytes are Escape and 1 zero
-        buffer[index++] = ESCAPE_CHAR;
-        buffer[index++] = 0;
-
         // Length of the channel (1 byte) due to ZCM_CHANNEL_MAXLEN
         // being less than 256
         static_assert(ZCM_CHANNEL_MAXLEN < (1<<8),
                       "Expected channel length to fit in one byte");
-        buffer[index++] = (uint8_t)channel.size();
-
         // Length of the data (32-bits): Big Endian
         static_assert(MTU < (1ULL<<32),
                       "Expected data length to fit in 32-bits");
         u32 len = (u32)msg.len;
-        buffer[index++] = (len>>24)&0xff;
-        buffer[index++] = (len>>16)&0xff;
-        buffer[index++] = (len>>8)&0xff;
-        buffer[index++] = (len>>0)&0xff;
+        u8 header[HEADER_BYTES] = {
+            (u8)chanLen,
+            (u8)((len>>24)&0xff), (u8)((len>>16)&0xff),
+            (u8)((len>>8)&0xff),  (u8)((len>>0)&0xff),
+        };
 
-        writeBytes((u8*)channel.c_str(), channel.size());
-        writeBytes((u8*)msg.buf, msg.len);
-        finish();
+        u16 crc = crc16.update(Crc16::INIT, header, HEADER_BYTES);
+        crc = crc16.update(crc, (const u8*)msg.channel, chanLen);
+        crc = crc16.update(crc, (const u8*)msg.buf, msg.len);
+        u8 footer[CRC_BYTES] = { (u8)(crc >> 8), (u8)(crc & 0xff) };
+
+        size_t contentLen = HEADER_BYTES + chanLen + msg.len + CRC_BYTES;
+        size_t maxFrameLen = cobs ? COBS_MAX_ENCODED(contentLen) + 1 : 2 + 2 * contentLen;
+
+        unique_lock<mutex> lk(txMut);
+        txCond.wait(lk, [&](){
+            return txPending.empty() || txPending.size() + maxFrameLen <= TX_PENDING_MAX;
+        });
+
+        size_t idx = txPending.size();
+        txPending.resize(idx + maxFrameLen);
+        u8 *out = txPending.data();
+
+        if (cobs) {
+            CobsEncoder enc(out, idx);
+            enc.append(header, HEADER_BYTES);
+            enc.append((const u8*)msg.channel, chanLen);
+            enc.append((const u8*)msg.buf, msg.len);
+            enc.append(footer, CRC_BYTES);
+            idx = enc.finish();
+        } else {
+            // Sync bytes are Escape and 1 zero
+            out[idx++] = ESCAPE_CHAR;
+            out[idx++] = 0;
+            idx = appendEscaped(out, idx, header, HEADER_BYTES);
+            idx = appendEscaped(out, idx, (const u8*)msg.channel, chanLen);
+            idx = appendEscaped(out, idx, (const u8*)msg.buf, msg.len);
+            idx = appendEscaped(out, idx, footer, CRC_BYTES);
+        }
+        txPending.resize(idx);
+
+        lk.unlock();
+        txCond.notify_all();
 
         return ZCM_EOK;
     }
@@ -364,141 +599,324 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         return ZCM_EOK;
     }
 
-    int recvmsg(zcm_msg_t *msg, int timeout)
+    void reportFramingErrors(FILE *f)
     {
-        if (timeout < 0) return ZCM_EAGAIN;
+        fprintf(f, "serial: %" PRIu64 " frames received, %" PRIu64 " framing errors "
+                "(%" PRIu64 " truncated, %" PRIu64 " bad encodings, %" PRIu64 " bad lengths, "
+                "%" PRIu64 " bad crcs), %" PRIu64 " bytes skipped\n",
+                rxStats.frames, rxStats.errors(), rxStats.truncated, rxStats.badEncoding,
+                rxStats.badLength, rxStats.badCrc, rxStats.skippedBytes);
+    }
 
-        u64 utimeRcvStart = TimeUtil::utime();
+    void maybeReportFramingErrors()
+    {
+        if (!ZCM_DEBUG_ENABLED || rxStats.errors() == rxStatsReported)
+            return;
+        u64 now = TimeUtil::utime();
+        if (now - rxStatsReportUtime < FRAMING_REPORT_PERIOD_US)
+            return;
+        rxStatsReportUtime = now;
+        rxStatsReported = rxStats.errors();
+        zcm_debug_lock();
+        reportFramingErrors(stderr);
+        zcm_debug_unlock();
+    }
+
+    // Starts a new frame whose first escaped byte is at 'pos'
+    void beginFrame(size_t pos)
+    {
+        rxState = PARSE_HEADER;
+        rxParse = rxFrame = rxOut = pos;
+        rxNeed = HEADER_BYTES;
+        rxEscaped = false;
+        rxFrameUtime = TimeUtil::utime();
+    }
+
+    // Abandons the current frame and goes back to hunting for a sync marker
+    // starting at 'pos'. Nothing before 'pos' can hold a marker: escaped bytes
+    // that were already accepted never contain one.
+    void resync(size_t pos)
+    {
+        rxState = PARSE_SYNC;
+        rxParse = pos;
+    }
+
+    // Looks for the next sync marker in the unparsed bytes.
+    // Returns false if more bytes are needed to find one
+    bool parseSync()
+    {
+        u8 *buf = rxBuf.data();
+        while (rxParse < rxEnd) {
+            u8 *esc = (u8*)memchr(buf + rxParse, ESCAPE_CHAR, rxEnd - rxParse);
+            size_t pos = esc ? (size_t)(esc - buf) : rxEnd;
+            rxStats.skippedBytes += pos - rxParse;
+            rxParse = pos;
+            if (pos + 1 >= rxEnd)
+                return false; // Need the byte after the escape char
+            if (buf[pos + 1] == 0) {
+                beginFrame(pos + 2);
+                return true;
+            }
+            // Any other pair is garbage (or the middle of a frame we missed)
+            rxStats.skippedBytes += 2;
+            rxParse = pos + 2;
+        }
+        return false;
+    }
 
-        u8 buffer[1024];
-        size_t index = 0, size = 0;
-        u8 sum = 0;  // TODO introduce better checksum
-        bool timedOut = false;
-
-        auto refillBuffer = [&]() {
-            while (index == size) {
-                int n = ser.read(buffer, sizeof(buffer), timeout * 1e3);
-                if (n <= 0) {
-                    ZCM_DEBUG("serial recvmsg: read timed out");
-                    size = 0;
-                    index = 0;
-                    timedOut = true;
-                    break;
+    // Unescapes up to 'rxNeed' more bytes of the current frame in place.
+    // Returns false if the frame was abandoned
+    bool parseEscaped()
+    {
+        u8 *buf = rxBuf.data();
+        while (rxNeed > 0 && rxParse < rxEnd) {
+            if (rxEscaped) {
+                u8 c = buf[rxParse];
+                if (c == ESCAPE_CHAR) {
+                    buf[rxOut++] = ESCAPE_CHAR;
+                    rxParse++;
+                    rxNeed--;
+                    rxEscaped = false;
+                } else if (c == 0) {
+                    // A new frame started before this one finished
+                    rxStats.truncated++;
+                    ZCM_DEBUG("serial recvmsg: truncated frame");
+                    beginFrame(rxParse + 1);
+                    return false;
                 } else {
-                    index = 0;
-                    size = n;
+                    rxStats.badEncoding++;
+                    ZCM_DEBUG("serial recvmsg: bad escape sequence");
+                    resync(rxParse);
+                    return false;
                 }
+                continue;
             }
-        };
-        auto readByte = [&](u8& b) {
-            if (index == size) refillBuffer();
-            if (size == 0) return false;
-            b = buffer[index++];
-            return true;
-        };
-        auto readU32 = [&](u32& x) {
-            u8 a, b, c, d;
-            if (readByte(a) && readByte(b) && readByte(c) && readByte(d)) {
-                x = (u32(a) << 24) | (u32(b) << 16) | (u32(c) << 8) | (u32(d) << 0);
-                return true;
+
+            size_t avail = std::min(rxNeed, rxEnd - rxParse);
+            u8 *esc = (u8*)memchr(buf + rxParse, ESCAPE_CHAR, avail);
+            size_t run = esc ? (size_t)(esc - (buf + rxParse)) : avail;
+            if (rxOut != rxParse)
+                memmove(buf + rxOut, buf + rxParse, run);
+            rxOut += run;
+            rxParse += run;
+            rxNeed -= run;
+            if (esc) {
+                rxParse++;
+                rxEscaped = true;
             }
+        }
+        return true;
+    }
+
+    bool validLengths()
+    {
+        if (rxChanLen > ZCM_CHANNEL_MAXLEN || rxDataLen > MTU) {
+            rxStats.badLength++;
+            ZCM_DEBUG("serial recvmsg: bad lengths: channel %d, data %u",
+                      rxChanLen, rxDataLen);
             return false;
-        };
-        auto syncStream = [&]() {
-            while (!timedOut) {
-                u8 c;
-                if (!readByte(c)) return false;
+        }
+        return true;
+    }
 
-                if (c != ESCAPE_CHAR)
-                    continue;
+    // Checks the crc of a complete unescaped frame and points 'msg' at it
+    bool acceptFrame(const u8 *frame, zcm_msg_t *msg)
+    {
+        size_t crcOffset = HEADER_BYTES + rxChanLen + rxDataLen;
+        u16 crc = crc16.update(Crc16::INIT, frame, crcOffset);
+        u16 expect = ((u16)frame[crcOffset] << 8) | frame[crcOffset + 1];
+        if (crc != expect) {
+            rxStats.badCrc++;
+            ZCM_DEBUG("serial recvmsg: crc failed!");
+            return false;
+        }
+
+        rxStats.frames++;
+        memcpy(recvChannelMem, frame + HEADER_BYTES, rxChanLen);
+        recvChannelMem[rxChanLen] = '\0';
+
+        msg->utime = rxFrameUtime;
+        msg->channel = recvChannelMem;
+        msg->len = rxDataLen;
+        msg->buf = (char*)frame + HEADER_BYTES + rxChanLen;
+        return true;
+    }
+
+    // Feeds the buffered bytes through the parser. Returns true when a
+    // complete frame with a valid crc has been decoded into 'msg'
+    bool parse(zcm_msg_t *msg)
+    {
+        while (rxParse < rxEnd) {
+            if (rxState == PARSE_SYNC) {
+                if (!parseSync())
+                    return false;
+                continue;
+            }
+
+            if (!parseEscaped())
+                continue;
+            if (rxNeed > 0)
+                return false;
 
-                // We got one escape char, see if it's followed by a zero
-                if (!readByte(c)) return false;
-                if (c == 0) {
-                    msg->utime = TimeUtil::utime();
-                    return true;
+            if (rxState == PARSE_HEADER) {
+                const u8 *header = &rxBuf[rxFrame];
+                rxChanLen = header[0];
+                rxDataLen = ((u32)header[1] << 24) | ((u32)header[2] << 16) |
+                            ((u32)header[3] << 8)  | ((u32)header[4] << 0);
+
+                if (!validLengths()) {
+                    resync(rxParse);
+                    continue;
                 }
+                rxState = PARSE_BODY;
+                rxNeed = rxChanLen + rxDataLen + CRC_BYTES;
+                continue;
             }
-            return false;
-        };
-        auto readByteUnescape = [&](u8& b) {
-            u8 c;
-            if (!readByte(c)) return false;
-            if (c != ESCAPE_CHAR) {
-                b = c;
+
+            // The whole frame is here
+            resync(rxParse);
+            if (acceptFrame(&rxBuf[rxFrame], msg))
                 return true;
+        }
+        return false;
+    }
+
+    // Feeds the buffered bytes through the COBS parser. Returns true when a
+    // complete frame with a valid crc has been decoded into 'msg'
+    bool parseCobs(zcm_msg_t *msg)
+    {
+        u8 *buf = rxBuf.data();
+        while (rxParse < rxEnd) {
+            if (rxParse == rxFrame && rxState != PARSE_SYNC)
+                rxFrameUtime = TimeUtil::utime();
+
+            u8 *zero = (u8*)memchr(buf + rxParse, 0, rxEnd - rxParse);
+            if (!zero) {
+                rxParse = rxEnd;
+                if (rxState != PARSE_SYNC && rxEnd - rxFrame > MAX_COBS_FRAME_BYTES) {
+                    rxStats.badLength++;
+                    ZCM_DEBUG("serial recvmsg: frame is too long");
+                    rxState = PARSE_SYNC;
+                }
+                return false;
             }
-            // Byte was escaped, strip off the escape char
-            return readByte(b);
-        };
-        auto readBytes = [&](u8 *buffer, size_t sz) {
-            u8 c;
-            for (size_t i = 0; i < sz; i++) {
-                if(!readByteUnescape(c)) return false;
-                sum += c;
-                buffer[i] = c;
-            }
-            return true;
-        };
-        auto checkFinish = [&]() {
-            u8 expect;
-            if (!readByte(expect)) return false;
-            return expect == sum;
-        };
 
-        u8 channelLen;
-        u32 dataLen;
-        if (!syncStream() || !readByte(channelLen) || !readU32(dataLen))
-            return ZCM_EAGAIN;
+            size_t start = rxFrame;
+            size_t end = zero - buf;
+            rxParse = rxFrame = end + 1;
+            if (rxState == PARSE_SYNC) {
+                rxStats.skippedBytes += end - start;
+                rxState = PARSE_BODY;
+                continue;
+            }
+            if (end == start)
+                continue; // Empty frame
+
+            ssize_t n = cobsDecodeInPlace(buf + start, end - start);
+            if (n < 0) {
+                rxStats.badEncoding++;
+                ZCM_DEBUG("serial recvmsg: bad cobs encoding");
+                continue;
+            }
 
-        int diff = US_TO_MS(TimeUtil::utime() - utimeRcvStart);
+            const u8 *frame = buf + start;
+            if (n < HEADER_BYTES + CRC_BYTES) {
+                rxStats.truncated++;
+                ZCM_DEBUG("serial recvmsg: truncated frame");
+                continue;
+            }
+            rxChanLen = frame[0];
+            rxDataLen = ((u32)frame[1] << 24) | ((u32)frame[2] << 16) |
+                        ((u32)frame[3] << 8)  | ((u32)frame[4] << 0);
+            if (!validLengths())
+                continue;
+            if ((size_t)n != HEADER_BYTES + rxChanLen + rxDataLen + CRC_BYTES) {
+                rxStats.truncated++;
+                ZCM_DEBUG("serial recvmsg: frame length does not match its header");
+                continue;
+            }
 
-        // Validate the lengths received
-        if (channelLen > ZCM_CHANNEL_MAXLEN) {
-            ZCM_DEBUG("serial recvmsg: channel is too long: %d", channelLen);
-            if (timeout > 0 && diff > timeout) return ZCM_EAGAIN;
-            // retry the recvmsg via tail-recursion
-            return recvmsg(msg, timeout - diff);
+            if (acceptFrame(frame, msg))
+                return true;
         }
-        if (dataLen > MTU) {
-            ZCM_DEBUG("serial recvmsg: data is too long: %d", dataLen);
-            if (timeout > 0 && diff > timeout) return ZCM_EAGAIN;
-            // retry the recvmsg via tail-recursion
-            return recvmsg(msg, timeout - diff);
+        return false;
+    }
+
+    // Makes room for more bytes at the end of 'rxBuf'. Only called once every
+    // buffered byte has been parsed, so the only bytes worth keeping are the
+    // unescaped part of an in-progress frame and a trailing escape char
+    void compactRxBuf()
+    {
+        u8 *buf = rxBuf.data();
+        if (cobs) {
+            size_t keep = rxEnd - rxFrame;
+            if (rxState == PARSE_SYNC) {
+                rxStats.skippedBytes += keep;
+                keep = 0;
+            }
+            if (keep > 0 && rxFrame > 0)
+                memmove(buf, buf + rxFrame, keep);
+            rxFrame = 0;
+            rxParse = rxEnd = keep;
+            return;
         }
 
-        // Lengths are good! Recv the data
-        if (!readBytes(recvChannelMem, (size_t)channelLen) ||
-            !readBytes(recvDataMem,    (size_t)dataLen))
-            return ZCM_EAGAIN;
+        if (rxState == PARSE_SYNC) {
+            size_t keep = rxEnd - rxParse;
+            if (keep > 0)
+                memmove(buf, buf + rxParse, keep);
+            rxParse = 0;
+            rxEnd = keep;
+            return;
+        }
 
-        // Set the null-terminator
-        recvChannelMem[channelLen] = '\0';
+        // Drop the gap left behind by unescaping
+        assert(rxParse == rxEnd);
+        size_t keep = rxOut - rxFrame;
+        if (rxFrame > 0)
+            memmove(buf, buf + rxFrame, keep);
+        rxFrame = 0;
+        rxParse = rxEnd = rxOut = keep;
+    }
 
-        diff = US_TO_MS(TimeUtil::utime() - utimeRcvStart);
+    int recvmsg(zcm_msg_t *msg, int timeout)
+    {
+        if (timeout < 0) return ZCM_EAGAIN;
 
-        // Check the checksum
-        if (!checkFinish()) {
-            ZCM_DEBUG("serial recvmsg: checksum failed!");
-            if (timeout > 0 && diff > timeout) return ZCM_EAGAIN;
-            // retry the recvmsg via tail-recursion
-            return recvmsg(msg, timeout - diff);
+        u64 utimeRcvStart = TimeUtil::utime();
+        u64 timeoutUs = (u64)timeout * 1000;
+
+        // The last frame returned is no longer in use
+        if (cobs) {
+            if (rxFrame == rxEnd)
+                rxFrame = rxParse = rxEnd = 0;
+        } else if (rxState == PARSE_SYNC && rxParse == rxEnd) {
+            rxParse = rxEnd = 0;
         }
 
-        // Has this channel been enabled?
-        if (!isChannelEnabled((char*)recvChannelMem)) {
-            //ZCM_DEBUG("serial recvmsg: %s is not enabled!", recvChannelMem);
-            if (timeout > 0 && diff > timeout) return ZCM_EAGAIN;
-            // retry the recvmsg via tail-recursion
-            return recvmsg(msg, timeout - diff);
-        }
+        while (true) {
+            if (cobs ? parseCobs(msg) : parse(msg)) {
+                // Has this channel been enabled?
+                if (isChannelEnabled(msg->channel))
+                    return ZCM_EOK;
+                continue;
+            }
+            maybeReportFramingErrors();
 
-        // Good! Return it
-        msg->channel = (char*)recvChannelMem;
-        msg->len = dataLen;
-        msg->buf = (char*)recvDataMem;
+            u64 diff = TimeUtil::utime() - utimeRcvStart;
+            if (diff > timeoutUs)
+                return ZCM_EAGAIN;
 
-        return ZCM_EOK;
+            if (rxEnd == rxBuf.size())
+                compactRxBuf();
+
+            int n = ser.read(&rxBuf[rxEnd], rxBuf.size() - rxEnd, timeoutUs - diff);
+            if (n <= 0) {
+                ZCM_DEBUG("serial recvmsg: read timed out");
+                return ZCM_EAGAIN;
+            }
+            rxEnd += n;
+        }
     }
 
     /********************** STATICS **********************/
@@ -5,6 +5,7 @@
 #include "zcm/transport_register.hpp"
 #include "zcm/util/debug.h"
 #include "zcm/util/lockfile.h"
+#include "zcm/transport/zmq_sockopts.hpp"
 #include <zmq.h>
 
 #include "util/TimeUtil.hpp"
@@ -15,10 +16,14 @@
 #include <cstdio>
 #include <cstring>
 #include <cassert>
+#include <climits>
+#include <cinttypes>
 
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <atomic>
 #include <mutex>
 #include <thread>
 using namespace std;
@@ -27,23 +32,68 @@ using namespace std;
 #define ZCM_TRANS_CLASSNAME TransportZmqLocal
 #define MTU (1<<28)
 #define START_BUF_SIZE (1 << 20)
-#define ZMQ_IO_THREADS 1
+#define DROP_REPORT_PERIOD_US 1000000
 #define IPC_NAME_PREFIX "zcm-channel-zmq-ipc-"
 #define IPC_ADDR_PREFIX "ipc:///tmp/" IPC_NAME_PREFIX
+// Per-publisher endpoints: IPC_MPUB_ADDR_PREFIX "<pid>-<instance>-<channel>"
+#define IPC_MPUB_NAME_PREFIX "zcm-mpub-zmq-ipc-"
+#define IPC_MPUB_ADDR_PREFIX "ipc:///tmp/" IPC_MPUB_NAME_PREFIX
+#define IPC_MPUB_SCAN_PERIOD_US 250000
 #define INPROC_ADDR_PREFIX "inproc://"
 
 enum Type { IPC, INPROC, };
 
+// Per-socket counters of messages moved and messages that were lost. Each is only ever
+// updated by the thread using the socket, but may be read by any thread reporting them
+struct SockStats
+{
+    atomic<u64> msgs {0};
+    atomic<u64> drops {0};
+
+    static void bump(atomic<u64>& counter)
+    { counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed); }
+};
+
+struct PubSock
+{
+    void *sock;
+    SockStats *stats;
+};
+
+struct SubSock
+{
+    void *sock;
+    bool subExplicit; // Whether it was subscribed to explicitly
+    SockStats *stats;
+};
+
 struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 {
     void *ctx;
     Type type;
+    SockOpts sockopts;
+    unordered_map<string, string> options;
 
-    unordered_map<string, void*> pubsocks;
-    // socket pair contains the socket + whether it was subscribed to explicitly or not
-    unordered_map<string, pair<void*, bool>> subsocks;
+    unordered_map<string, PubSock> pubsocks;
+    unordered_map<string, SubSock> subsocks;
     bool recvAllChannels = false;
 
+    // Per-publisher endpoints each subsock is connected to in addition to
+    // the regular single-publisher address of its channel
+    unordered_map<string, unordered_set<string>> subendpoints;
+    u64 lastMultiPubScanUtime = 0;
+    // Distinguishes the endpoints of multiple transports within one process
+    int instance;
+
+    // Keyed by channel, these outlive the sockets so drops are never forgotten. Sockets
+    // point at their entry, so counting a message takes no lookup and no lock. 'statsMut'
+    // only protects adding entries against reports walking the maps
+    unordered_map<string, SockStats> pubstats;
+    unordered_map<string, SockStats> substats;
+    atomic<u64> lastReportUtime {0};
+    u64 lastDropReportTotal = 0;
+    mutex statsMut;
+
     string recvmsgChannel;
     size_t recvmsgBufferSize = START_BUF_SIZE; // Start at 1MB but allow it to grow to MTU
     char* recvmsgBuffer;
@@ -53,16 +103,28 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     // concurrently
     mutex mut;
 
-    ZCM_TRANS_CLASSNAME(Type type_)
+    ZCM_TRANS_CLASSNAME(Type type_, zcm_url_t *url)
     {
         trans_type = ZCM_BLOCKING;
         vtbl = &methods;
+        ctx = nullptr;
+        type = type_;
+
+        static atomic_int nextInstance {0};
+        instance = nextInstance++;
 
         recvmsgBuffer = new char[recvmsgBufferSize];
 
-        ctx = zmq_init(ZMQ_IO_THREADS);
+        // build 'options'
+        auto *opts = zcm_url_opts(url);
+        for (size_t i = 0; i < opts->numopts; i++)
+            options[opts->name[i]] = opts->value[i];
+
+        if (!sockopts.parse(options, type == IPC))
+            return;
+
+        ctx = zmq_init(sockopts.ioThreads);
         assert(ctx != nullptr);
-        type = type_;
     }
 
     ~ZCM_TRANS_CLASSNAME()
@@ -72,43 +134,144 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 
         // Clean up all publish sockets
         for (auto it = pubsocks.begin(); it != pubsocks.end(); ++it) {
-            address = getAddress(it->first);
+            address = getPubAddress(it->first);
 
-            rc = zmq_unbind(it->second, address.c_str());
+            rc = zmq_unbind(it->second.sock, address.c_str());
             if (rc == -1) {
                 ZCM_DEBUG("failed to unbind pubsock: %s", zmq_strerror(errno));
             }
 
-            rc = zmq_close(it->second);
+            rc = zmq_close(it->second.sock);
             if (rc == -1) {
                 ZCM_DEBUG("failed to close pubsock: %s", zmq_strerror(errno));
             }
+
+            // zmq leaves the file of an ipc endpoint behind. Per-publisher endpoints are
+            // never bound again, so they would pile up in /tmp
+            if (sockopts.multipub)
+                unlink(address.c_str() + strlen("ipc://"));
         }
 
         // Clean up all subscribe sockets
         for (auto it = subsocks.begin(); it != subsocks.end(); ++it) {
             address = getAddress(it->first);
 
-            rc = zmq_disconnect(it->second.first, address.c_str());
+            rc = zmq_disconnect(it->second.sock, address.c_str());
             if (rc == -1) {
                 ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
             }
 
-            rc = zmq_close(it->second.first);
+            rc = zmq_close(it->second.sock);
             if (rc == -1) {
                 ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
             }
         }
 
         // Clean up the zmq context
-        rc = zmq_ctx_term(ctx);
-        if (rc == -1) {
-            ZCM_DEBUG("failed to terminate context: %s", zmq_strerror(errno));
+        if (ctx) {
+            rc = zmq_ctx_term(ctx);
+            if (rc == -1) {
+                ZCM_DEBUG("failed to terminate context: %s", zmq_strerror(errno));
+            }
+        }
+
+        {
+            unique_lock<mutex> lk(statsMut);
+            if (totalDrops() != 0)
+                reportStats(stderr, true);
         }
 
         delete[] recvmsgBuffer;
     }
 
+    bool good()
+    {
+        return ctx != nullptr;
+    }
+
+    // Callers must hold 'statsMut'
+    u64 totalDrops()
+    {
+        u64 total = 0;
+        for (auto& elt : pubstats) total += elt.second.drops;
+        for (auto& elt : substats) total += elt.second.drops;
+        return total;
+    }
+
+    // Callers must hold 'statsMut'
+    void reportStats(FILE *f, bool onlyDrops)
+    {
+        for (auto& elt : pubstats)
+            if (!onlyDrops || elt.second.drops != 0)
+                fprintf(f, "zmq pubsock %s: %" PRIu64 " sent, %" PRIu64 " dropped\n",
+                        elt.first.c_str(), elt.second.msgs.load(), elt.second.drops.load());
+        for (auto& elt : substats)
+            if (!onlyDrops || elt.second.drops != 0)
+                fprintf(f, "zmq subsock %s: %" PRIu64 " received, %" PRIu64 " dropped\n",
+                        elt.first.c_str(), elt.second.msgs.load(), elt.second.drops.load());
+    }
+
+    // With 'stats_ms', prints every socket's counters once per period. Otherwise, with
+    // ZCM_DEBUG, prints the drop counters at most once a second when they have changed
+    void maybeReportStats()
+    {
+        u64 period = (u64)sockopts.statsMs * 1000;
+        if (period == 0) {
+            if (!ZCM_DEBUG_ENABLED) return;
+            period = DROP_REPORT_PERIOD_US;
+        }
+        u64 now = TimeUtil::utime();
+        u64 last = lastReportUtime.load(memory_order_relaxed);
+        if (now - last < period) return;
+        // Only one of the send and recv threads reports each period
+        if (!lastReportUtime.compare_exchange_strong(last, now)) return;
+
+        unique_lock<mutex> lk(statsMut);
+        if (sockopts.statsMs > 0) {
+            reportStats(stderr, false);
+            return;
+        }
+        u64 total = totalDrops();
+        if (total == lastDropReportTotal) return;
+        lastDropReportTotal = total;
+        zcm_debug_lock();
+        reportStats(stderr, true);
+        zcm_debug_unlock();
+    }
+
+    // Callers must not hold 'statsMut'
+    SockStats *statsFor(unordered_map<string, SockStats>& stats, const string& channel)
+    {
+        unique_lock<mutex> lk(statsMut);
+        return &stats[channel];
+    }
+
+    bool setSockOpt(void *sock, int opt, int val, const char *name)
+    {
+        if (val == -1) return true;
+        int rc = zmq_setsockopt(sock, opt, &val, sizeof(val));
+        if (rc == -1) {
+            ZCM_DEBUG("failed to set %s on socket: %s", name, zmq_strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // Must be called before bind()/connect() for the high-water marks to take effect
+    bool applyPubSockOpts(void *sock)
+    {
+        return setSockOpt(sock, ZMQ_SNDHWM, sockopts.sndhwm, "ZMQ_SNDHWM") &&
+               setSockOpt(sock, ZMQ_SNDBUF, sockopts.sndbuf, "ZMQ_SNDBUF") &&
+               setSockOpt(sock, ZMQ_LINGER, sockopts.linger, "ZMQ_LINGER");
+    }
+
+    bool applySubSockOpts(void *sock)
+    {
+        return setSockOpt(sock, ZMQ_RCVHWM, sockopts.rcvhwm, "ZMQ_RCVHWM") &&
+               setSockOpt(sock, ZMQ_RCVBUF, sockopts.rcvbuf, "ZMQ_RCVBUF") &&
+               setSockOpt(sock, ZMQ_LINGER, sockopts.linger, "ZMQ_LINGER");
+    }
+
     string getAddress(const string& channel)
     {
         switch (type) {
@@ -120,8 +283,22 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         assert(0 && "unreachable");
     }
 
+    // In multipub mode, every publisher binds its own endpoint and
+    // subscribers discover and connect to all of them
+    string getPubAddress(const string& channel)
+    {
+        if (sockopts.multipub)
+            return IPC_MPUB_ADDR_PREFIX + to_string(getpid()) + "-" +
+                   to_string(instance) + "-" + channel;
+        return getAddress(channel);
+    }
+
     bool acquirePubLockfile(const string& channel)
     {
+        // No lock needed: the endpoint is unique to this publisher
+        if (sockopts.multipub)
+            return true;
+
         switch (type) {
             case IPC: {
                 string lockfileName = IPC_ADDR_PREFIX+channel;
@@ -136,11 +313,11 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     }
 
     // May return null if it cannot create a new pubsock
-    void *pubsockFindOrCreate(const string& channel)
+    PubSock *pubsockFindOrCreate(const string& channel)
     {
         auto it = pubsocks.find(channel);
         if (it != pubsocks.end())
-            return it->second;
+            return &it->second;
         // Before we create a pubsock, we need to acquire the lock file for this
         if (!acquirePubLockfile(channel)) {
             fprintf(stderr, "Failed to acquire publish lock on %s! "
@@ -153,14 +330,18 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             ZCM_DEBUG("failed to create pubsock: %s", zmq_strerror(errno));
             return nullptr;
         }
-        string address = getAddress(channel);
+        if (!applyPubSockOpts(sock)) {
+            zmq_close(sock);
+            return nullptr;
+        }
+        string address = getPubAddress(channel);
         int rc = zmq_bind(sock, address.c_str());
         if (rc == -1) {
             ZCM_DEBUG("failed to bind pubsock: %s", zmq_strerror(errno));
             return nullptr;
         }
-        pubsocks.emplace(channel, sock);
-        return sock;
+        PubSock ps = { sock, statsFor(pubstats, channel) };
+        return &pubsocks.emplace(channel, ps).first->second;
     }
 
     // May return null if it cannot create a new subsock
@@ -168,14 +349,18 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     {
         auto it = subsocks.find(channel);
         if (it != subsocks.end()) {
-            it->second.second |= subExplicit;
-            return it->second.first;
+            it->second.subExplicit |= subExplicit;
+            return it->second.sock;
         }
         void *sock = zmq_socket(ctx, ZMQ_SUB);
         if (sock == nullptr) {
             ZCM_DEBUG("failed to create subsock: %s", zmq_strerror(errno));
             return nullptr;
         }
+        if (!applySubSockOpts(sock)) {
+            zmq_close(sock);
+            return nullptr;
+        }
         string address = getAddress(channel);
         int rc;
         rc = zmq_connect(sock, address.c_str());
@@ -188,7 +373,8 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             ZCM_DEBUG("failed to setsockopt on subsock: %s", zmq_strerror(errno));
             return nullptr;
         }
-        subsocks.emplace(channel, make_pair(sock, subExplicit));
+        SubSock ss = { sock, subExplicit, statsFor(substats, channel) };
+        subsocks.emplace(channel, ss);
         return sock;
     }
 
@@ -216,6 +402,79 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         closedir(d);
     }
 
+    // Connects subsocks to any new per-publisher endpoints and disconnects from
+    // endpoints that have been removed. Other processes' endpoints are never removed
+    // here: /tmp may be shared with other pid namespaces, where a pid says nothing
+    // about whether the publisher is alive. Connecting to an endpoint left behind by a
+    // publisher that crashed is harmless, zmq just keeps retrying it in the background
+    void ipcScanForMultiPublishers()
+    {
+        u64 now = TimeUtil::utime();
+        if (now - lastMultiPubScanUtime < IPC_MPUB_SCAN_PERIOD_US)
+            return;
+        lastMultiPubScanUtime = now;
+
+        const char *prefix = IPC_MPUB_NAME_PREFIX;
+        size_t prefixLen = strlen(IPC_MPUB_NAME_PREFIX);
+
+        DIR *d;
+        dirent *ent;
+
+        if (!(d=opendir("/tmp/")))
+            return;
+
+        unordered_map<string, unordered_set<string>> found;
+        while ((ent=readdir(d)) != nullptr) {
+            if (strncmp(ent->d_name, prefix, prefixLen) != 0)
+                continue;
+
+            pid_t pid;
+            string channel;
+            if (!parseMultiPubName(ent->d_name + prefixLen, pid, channel))
+                continue;
+
+            if (subsocks.find(channel) == subsocks.end() && !recvAllChannels)
+                continue;
+
+            found[channel].emplace(string("ipc:///tmp/") + ent->d_name);
+        }
+
+        closedir(d);
+
+        for (auto& elt : found) {
+            auto& channel = elt.first;
+            void *sock = subsockFindOrCreate(channel, false);
+            if (sock == nullptr) {
+                ZCM_DEBUG("failed to open subsock in scanForMultiPublishers(%s)",
+                          channel.c_str());
+                continue;
+            }
+            auto& connected = subendpoints[channel];
+            for (auto& address : elt.second) {
+                if (connected.count(address)) continue;
+                if (zmq_connect(sock, address.c_str()) == -1) {
+                    ZCM_DEBUG("failed to connect subsock: %s", zmq_strerror(errno));
+                    continue;
+                }
+                connected.emplace(address);
+            }
+        }
+
+        for (auto& elt : subendpoints) {
+            auto it = subsocks.find(elt.first);
+            if (it == subsocks.end()) continue;
+            auto fit = found.find(elt.first);
+            for (auto ait = elt.second.begin(); ait != elt.second.end(); ) {
+                if (fit == found.end() || !fit->second.count(*ait)) {
+                    zmq_disconnect(it->second.sock, ait->c_str());
+                    ait = elt.second.erase(ait);
+                } else {
+                    ++ait;
+                }
+            }
+        }
+    }
+
     // XXX This only works for channels within this instance! Creating another
     //     ZCM instance using 'inproc' will cause this scan to miss some channels!
     //     Need to implement a better technique. Should use a globally shared datastruct.
@@ -244,10 +503,12 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         if (msg.len > MTU)
             return ZCM_EINVALID;
 
-        void *sock = pubsockFindOrCreate(channel);
-        if (sock == nullptr)
+        PubSock *ps = pubsockFindOrCreate(channel);
+        if (ps == nullptr)
             return ZCM_ECONNECT;
-        int rc = zmq_send(sock, msg.buf, msg.len, 0);
+        int rc = zmq_send(ps->sock, msg.buf, msg.len, 0);
+        SockStats::bump(rc == (int)msg.len ? ps->stats->msgs : ps->stats->drops);
+        maybeReportStats();
         if (rc == (int)msg.len)
             return ZCM_EOK;
         assert(rc == -1);
@@ -268,19 +529,20 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
                 recvAllChannels = enable;
             } else {
                 for (auto it = subsocks.begin(); it != subsocks.end(); ) {
-                    if (!it->second.second) { // This channel is only subscribed to implicitly
+                    if (!it->second.subExplicit) { // This channel is only subscribed to implicitly
                         string address = getAddress(it->first);
-                        int rc = zmq_disconnect(it->second.first, address.c_str());
+                        int rc = zmq_disconnect(it->second.sock, address.c_str());
                         if (rc == -1) {
                             ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
                             return ZCM_ECONNECT;
                         }
 
-                        rc = zmq_close(it->second.first);
+                        rc = zmq_close(it->second.sock);
                         if (rc == -1) {
                             ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
                             return ZCM_ECONNECT;
                         }
+                        subendpoints.erase(it->first);
                         it = subsocks.erase(it);
                     } else {
                         ++it;
@@ -296,22 +558,23 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             } else {
                 auto it = subsocks.find(channel);
                 if (it != subsocks.end()) {
-                    if (it->second.second) { // This channel has been subscribed to explicitly
+                    if (it->second.subExplicit) { // This channel has been subscribed to explicitly
                         if (recvAllChannels) {
-                            it->second.second = false;
+                            it->second.subExplicit = false;
                         } else {
                             string address = getAddress(it->first);
-                            int rc = zmq_disconnect(it->second.first, address.c_str());
+                            int rc = zmq_disconnect(it->second.sock, address.c_str());
                             if (rc == -1) {
                                 ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
                                 return ZCM_ECONNECT;
                             }
 
-                            rc = zmq_close(it->second.first);
+                            rc = zmq_close(it->second.sock);
                             if (rc == -1) {
                                 ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
                                 return ZCM_ECONNECT;
                             }
+                            subendpoints.erase(it->first);
                             subsocks.erase(it);
                         }
                     }
@@ -326,6 +589,7 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         // Build up a list of poll items
         vector<zmq_pollitem_t> pitems;
         vector<string> pchannels;
+        vector<SockStats*> pstats;
         {
             // Mutex used to protect 'subsocks' while allowing
             // recvmsgEnable() and recvmsg() to be called
@@ -338,17 +602,21 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
                     case INPROC: inprocScanForNewChannels();
                 }
             }
+            // Only subscribers that opted in look for multiple publishers
+            if (type == IPC && sockopts.multipub)
+                ipcScanForMultiPublishers();
 
             pitems.resize(subsocks.size());
             int i = 0;
             for (auto& elt : subsocks) {
                 auto& channel = elt.first;
-                auto& sock = elt.second.first;
+                auto& sock = elt.second.sock;
                 auto *p = &pitems[i];
                 memset(p, 0, sizeof(*p));
                 p->socket = sock;
                 p->events = ZMQ_POLLIN;
                 pchannels.emplace_back(channel);
+                pstats.emplace_back(elt.second.stats);
                 i++;
             }
         }
@@ -381,12 +649,16 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
                     assert(0 < rc);
                     assert(rc < MTU && "Received message that is bigger than a legally-published message could be");
                     if (rc > (int)recvmsgBufferSize) {
+                        SockStats::bump(pstats[i]->drops);
+                        maybeReportStats();
                         ZCM_DEBUG("Reallocating recv buffer to handle larger messages. Size is now %d", rc);
                         recvmsgBufferSize = rc;
                         delete[] recvmsgBuffer;
                         recvmsgBuffer = new char[recvmsgBufferSize];
                         return ZCM_EAGAIN;
                     }
+                    SockStats::bump(pstats[i]->msgs);
+                    maybeReportStats();
                     recvmsgChannel = pchannels[i];
                     msg->channel = recvmsgChannel.c_str();
                     msg->len = rc;
@@ -446,20 +718,31 @@ zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
     &ZCM_TRANS_CLASSNAME::_destroy,
 };
 
+static zcm_trans_t *create(Type type, zcm_url_t *url)
+{
+    auto *trans = new ZCM_TRANS_CLASSNAME(type, url);
+    if (trans->good())
+        return trans;
+
+    delete trans;
+    return nullptr;
+}
+
 static zcm_trans_t *createIpc(zcm_url_t *url)
 {
-    return new ZCM_TRANS_CLASSNAME(IPC);
+    return create(IPC, url);
 }
 
 static zcm_trans_t *createInproc(zcm_url_t *url)
 {
-    return new ZCM_TRANS_CLASSNAME(INPROC);
+    return create(INPROC, url);
 }
 
 // Register this transport with ZCM
 #ifdef USING_TRANS_IPC
 const TransportRegister ZCM_TRANS_CLASSNAME::regIpc(
-    "ipc",    "Transfer data via Inter-process Communication (e.g. 'ipc')", createIpc);
+    "ipc",    "Transfer data via Inter-process Communication "
+              "(e.g. 'ipc' or 'ipc?io_threads=2&sndhwm=10000&multipub=true')", createIpc);
 #endif
 
 #ifdef USING_TRANS_INPROC
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "zcm/util/debug.h"
+
+#include <sys/types.h>
+
+#include <cstdlib>
+#include <climits>
+
+#include <string>
+#include <unordered_map>
+
+#define DEFAULT_IO_THREADS 1
+
+// Socket tuning that can be specified on the url, e.g.:
+//   'ipc?io_threads=2&sndhwm=10000&rcvhwm=10000&rcvbuf=4194304'
+// Any value left at -1 is not applied and the zmq default is used instead
+struct SockOpts
+{
+    int ioThreads = DEFAULT_IO_THREADS;
+    int sndhwm = -1;
+    int rcvhwm = -1;
+    int sndbuf = -1;
+    int rcvbuf = -1;
+    int linger = -1;
+    bool multipub = false;
+    int statsMs = 0;
+
+    // Returns false if any option is specified but invalid. 'multipub' is only supported
+    // by ipc and is ignored otherwise
+    bool parse(const std::unordered_map<std::string, std::string>& options, bool ipc)
+    {
+        if (!parseIntOption(options, "io_threads", ioThreads, 1) ||
+            !parseIntOption(options, "sndhwm",     sndhwm,    0) ||
+            !parseIntOption(options, "rcvhwm",     rcvhwm,    0) ||
+            !parseIntOption(options, "sndbuf",     sndbuf,    0) ||
+            !parseIntOption(options, "rcvbuf",     rcvbuf,    0) ||
+            !parseIntOption(options, "linger",     linger,    0) ||
+            !parseIntOption(options, "stats_ms",   statsMs,   0) ||
+            !parseBoolOption(options, "multipub",  multipub))
+            return false;
+
+        if (multipub && !ipc) {
+            ZCM_DEBUG("url option 'multipub' is only supported by ipc, ignoring it");
+            multipub = false;
+        }
+        return true;
+    }
+
+    // Returns false if the option was specified but is not a valid boolean
+    static bool parseBoolOption(const std::unordered_map<std::string, std::string>& options,
+                                const std::string& name, bool& dst)
+    {
+        auto it = options.find(name);
+        if (it == options.end()) return true;
+        const std::string& str = it->second;
+        if (str == "true" || str == "1") {
+            dst = true;
+        } else if (str == "false" || str == "0") {
+            dst = false;
+        } else {
+            ZCM_DEBUG("expected true|false for url option '%s'", name.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Returns false if the option was specified but is not a valid integer
+    static bool parseIntOption(const std::unordered_map<std::string, std::string>& options,
+                               const std::string& name, int& dst, int minval)
+    {
+        auto it = options.find(name);
+        if (it == options.end()) return true;
+        const std::string& str = it->second;
+        char *end = nullptr;
+        long val = strtol(str.c_str(), &end, 10);
+        if (str.empty() || *end != '\0' || val < minval || val > INT_MAX) {
+            ZCM_DEBUG("expected integer >= %d for url option '%s'", minval, name.c_str());
+            return false;
+        }
+        dst = (int)val;
+        return true;
+    }
+};
+
+// Parses a per-publisher endpoint name of the form "<pid>-<instance>-<channel>"
+// (following IPC_MPUB_NAME_PREFIX). Returns false if the name is malformed
+static inline bool parseMultiPubName(const char *name, pid_t& pid, std::string& channel)
+{
+    char *end;
+    long p = strtol(name, &end, 10);
+    if (end == name || *end != '-' || p <= 0) return false;
+    const char *inst = end + 1;
+    strtol(inst, &end, 10);
+    if (end == inst || *end != '-' || *(end + 1) == '\0') return false;
+    pid = (pid_t)p;
+    channel = std::string(end + 1);
+    return true;
+}
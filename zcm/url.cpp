@@ -66,13 +66,19 @@ struct zcm_url
 
         sep = url.find("://");
         if (sep == string::npos) {
-            protocol = url;
-            return;
+            // Allow options without an address (e.g. 'ipc?sndhwm=1000')
+            sep = url.find("?");
+            if (sep == string::npos) {
+                protocol = url;
+                return;
+            }
+            protocol = string(url.c_str(), sep);
+            rest = string(url.c_str()+sep, url.size()-sep);
+        } else {
+            protocol = string(url.c_str(), sep);
+            rest = string(url.c_str()+(sep+3), url.size()-(sep+3));
         }
 
-        protocol = string(url.c_str(), sep);
-        rest = string(url.c_str()+(sep+3), url.size()-(sep+3));
-
         sep = rest.find("?");
         if (sep == string::npos) {
             address = std::move(rest);
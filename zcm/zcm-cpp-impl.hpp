@@ -366,7 +366,6 @@ inline zcm_t *ZCM::getUnderlyingZCM()
 inline LogFile::LogFile(const std::string& path, const std::string& mode)
 {
     this->eventlog = zcm_eventlog_create(path.c_str(), mode.c_str());
-    this->lastevent = nullptr;
 }
 
 inline void LogFile::close()
@@ -374,9 +373,6 @@ inline void LogFile::close()
     if (eventlog)
         zcm_eventlog_destroy(eventlog);
     eventlog = nullptr;
-    if(lastevent)
-        zcm_eventlog_free_event(lastevent);
-    lastevent = nullptr;
 }
 
 inline LogFile::~LogFile()
@@ -394,41 +390,119 @@ inline int LogFile::seekToTimestamp(int64_t timestamp)
     return zcm_eventlog_seek_to_timestamp(eventlog, timestamp);
 }
 
+inline int LogFile::seekToEventnum(int64_t eventnum)
+{
+    return zcm_eventlog_seek_to_eventnum(eventlog, eventnum);
+}
+
 inline FILE* LogFile::getFilePtr()
 {
     return zcm_eventlog_get_fileptr(eventlog);
 }
 
-inline const LogEvent* LogFile::cplusplusIfyEvent(zcm_eventlog_event_t* evt)
+inline int LogFile::enableCompression(int level, size_t blockSize, int nthreads)
+{
+    return zcm_eventlog_enable_compression(eventlog, level, blockSize, nthreads);
+}
+
+inline int LogFile::setFormat(int format)
+{
+    return zcm_eventlog_set_format(eventlog, format);
+}
+
+inline int LogFile::wantedChannel(const char* channel, int32_t channellen, void* usr)
+{
+    LogFile* lf = (LogFile*) usr;
+    std::string name(channel, channellen);
+    #if __cplusplus > 199711L
+    if (lf->filterFunc)
+        return lf->filterFunc(name);
+    #endif
+    for (size_t i = 0; i < lf->filterChannels.size(); ++i)
+        if (lf->filterChannels[i] == name)
+            return 1;
+    return 0;
+}
+
+inline int LogFile::setChannelFilter(const std::vector<std::string>& channels)
+{
+    // Prefetching calls wantedChannel() on a thread of its own, removing the filter first
+    // stops it until the next read
+    int ret = zcm_eventlog_set_channel_filter(eventlog, nullptr, nullptr);
+    if (ret != 0) return ret;
+    #if __cplusplus > 199711L
+    filterFunc = nullptr;
+    #endif
+    filterChannels = channels;
+    return zcm_eventlog_set_channel_filter(eventlog, &LogFile::wantedChannel, this);
+}
+
+inline int LogFile::setChannelRegex(const std::string& regex)
 {
-    if (lastevent)
-        zcm_eventlog_free_event(lastevent);
-    lastevent = evt;
-    if (!evt)
+    #if __cplusplus > 199711L
+    // The same syntax as subscriptions and the file transport's 'channel' option
+    std::shared_ptr<std::regex> re;
+    try {
+        re = std::make_shared<std::regex>(regex);
+    } catch (const std::regex_error&) {
+        return -1;
+    }
+    return setChannelFilter([re](const std::string& channel) {
+        return std::regex_match(channel, *re);
+    });
+    #else
+    return zcm_eventlog_set_channel_regex(eventlog, regex.c_str());
+    #endif
+}
+
+#if __cplusplus > 199711L
+inline int LogFile::setChannelFilter(std::function<bool(const std::string&)> wanted)
+{
+    // See the other overload
+    int ret = zcm_eventlog_set_channel_filter(eventlog, nullptr, nullptr);
+    if (ret != 0) return ret;
+    filterChannels.clear();
+    filterFunc = wanted;
+    return zcm_eventlog_set_channel_filter(eventlog, &LogFile::wantedChannel, this);
+}
+#endif
+
+inline int LogFile::clearChannelFilter()
+{
+    return zcm_eventlog_set_channel_filter(eventlog, nullptr, nullptr);
+}
+
+inline int LogFile::enablePrefetch(size_t maxEvents, size_t maxBytes)
+{
+    return zcm_eventlog_enable_prefetch(eventlog, maxEvents, maxBytes);
+}
+
+inline const LogEvent* LogFile::cplusplusIfyEvent(int readRet)
+{
+    if (readRet != 0)
         return nullptr;
-    curEvent.eventnum = evt->eventnum;
-    curEvent.channel.assign(evt->channel, evt->channellen);
-    curEvent.timestamp = evt->timestamp;
-    curEvent.datalen = evt->datalen;
-    curEvent.data = (char*)evt->data;
+    // Event data is a view into the log, only the channel name is copied
+    curEvent.eventnum = lastevent.eventnum;
+    curEvent.channel.assign(lastevent.channel, lastevent.channellen);
+    curEvent.timestamp = lastevent.timestamp;
+    curEvent.datalen = lastevent.datalen;
+    curEvent.data = (char*)lastevent.data;
     return &curEvent;
 }
 
 inline const LogEvent* LogFile::readNextEvent()
 {
-    zcm_eventlog_event_t* evt = zcm_eventlog_read_next_event(eventlog);
-    return cplusplusIfyEvent(evt);
+    return cplusplusIfyEvent(zcm_eventlog_read_next_event_view(eventlog, &lastevent));
 }
 
 inline const LogEvent* LogFile::readPrevEvent()
 {
-    zcm_eventlog_event_t* evt = zcm_eventlog_read_prev_event(eventlog);
-    return cplusplusIfyEvent(evt);
+    return cplusplusIfyEvent(zcm_eventlog_read_prev_event_view(eventlog, &lastevent));
 }
 inline const LogEvent* LogFile::readEventAtOffset(off_t offset)
 {
-    zcm_eventlog_event_t* evt = zcm_eventlog_read_event_at_offset(eventlog, offset);
-    return cplusplusIfyEvent(evt);
+    return cplusplusIfyEvent(zcm_eventlog_read_event_at_offset_view(eventlog, offset,
+                                                                     &lastevent));
 }
 
 inline int LogFile::writeEvent(LogEvent* event)
@@ -442,4 +516,42 @@ inline int LogFile::writeEvent(LogEvent* event)
     evt.data = event->data;
     return zcm_eventlog_write_event(eventlog, &evt);
 }
+
+inline int LogFile::flush()
+{
+    return zcm_eventlog_flush(eventlog);
+}
+
+#if __cplusplus > 199711L
+inline int LogFile::scanParallel(const std::string& path, int nshards, int nthreads,
+                                 std::function<bool(int shard, const LogEvent& event)> handler,
+                                 std::function<void(int shard)> merge)
+{
+    struct Scan
+    {
+        std::function<bool(int, const LogEvent&)> handler;
+        std::function<void(int)> merge;
+
+        static int onEvent(int shard, const zcm_eventlog_event_t* le, void* usr)
+        {
+            LogEvent event;
+            event.eventnum = le->eventnum;
+            event.timestamp = le->timestamp;
+            event.channel.assign(le->channel, le->channellen);
+            event.datalen = le->datalen;
+            event.data = (char*)le->data;
+            return ((Scan*)usr)->handler(shard, event) ? 0 : 1;
+        }
+
+        static void onMerge(int shard, void* usr)
+        {
+            ((Scan*)usr)->merge(shard);
+        }
+    };
+
+    Scan scan { handler, merge };
+    return zcm_eventlog_scan_parallel(path.c_str(), nshards, nthreads, &Scan::onEvent,
+                                      merge ? &Scan::onMerge : nullptr, &scan);
+}
+#endif
 #endif
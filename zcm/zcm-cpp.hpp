@@ -12,6 +12,8 @@
 
 #if __cplusplus > 199711L
 #include <functional>
+#include <memory>
+#include <regex>
 #endif
 
 namespace zcm {
@@ -138,7 +140,24 @@ struct LogFile
 
     /**** Methods general operations ****/
     inline int seekToTimestamp(int64_t timestamp);
+    inline int seekToEventnum(int64_t eventnum);
     inline FILE* getFilePtr();
+    inline int enableCompression(int level, size_t blockSize, int nthreads);
+    inline int setFormat(int format);
+
+    // Reading only returns events on these channels, the rest are skipped unread
+    inline int setChannelFilter(const std::vector<std::string>& channels);
+    // Same, for channels whose whole name matches 'regex'. Before C++11 it is a POSIX
+    // extended regex, otherwise a std::regex like subscriptions
+    inline int setChannelRegex(const std::string& regex);
+    #if __cplusplus > 199711L
+    // Same, for channels 'wanted' returns true for. It's asked once per channel
+    inline int setChannelFilter(std::function<bool(const std::string&)> wanted);
+    #endif
+    inline int clearChannelFilter();
+    // Reads up to 'maxEvents' events ahead on a background thread, see
+    // zcm_eventlog_enable_prefetch()
+    inline int enablePrefetch(size_t maxEvents, size_t maxBytes);
 
     /**** Methods for read/write ****/
     // NOTE: user should NOT hold-onto the returned ptr across successive calls
@@ -146,12 +165,26 @@ struct LogFile
     inline const LogEvent* readPrevEvent();
     inline const LogEvent* readEventAtOffset(off_t offset);
     inline int writeEvent(LogEvent* event);
+    inline int flush();
+
+    #if __cplusplus > 199711L
+    // Scans the log at 'path' on several threads, see zcm_eventlog_scan_parallel().
+    // 'handler' returns false to stop the scan
+    static inline int scanParallel(const std::string& path, int nshards, int nthreads,
+                                   std::function<bool(int shard, const LogEvent& event)> handler,
+                                   std::function<void(int shard)> merge = nullptr);
+    #endif
 
   private:
-    inline const LogEvent* cplusplusIfyEvent(zcm_eventlog_event_t* le);
+    inline const LogEvent* cplusplusIfyEvent(int readRet);
+    static inline int wantedChannel(const char* channel, int32_t channellen, void* usr);
+    std::vector<std::string> filterChannels;
+    #if __cplusplus > 199711L
+    std::function<bool(const std::string&)> filterFunc;
+    #endif
     LogEvent curEvent;
     zcm_eventlog_t* eventlog;
-    zcm_eventlog_event_t* lastevent;
+    zcm_eventlog_event_t lastevent;
 };
 #endif
 